@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ack.h"
+#include "capture.h"
+
+#define ACK_REPORT_MAX 64
+#define ACK_PENDING_MAX 64
+
+struct ack_report {
+  unsigned char data[ACK_REPORT_MAX];
+  int length;
+};
+
+struct ack_pending {
+  int fd;
+  uint32_t seq;
+  uint64_t read_ns;
+  uint64_t deadline_ns;
+};
+
+static struct ack_report reports[2]; /* [0] bad-read, [1] good-read */
+static uint64_t consumer_timeout_ns = 0;
+static uint64_t budget_ns = 50 * 1000000ULL;
+
+static struct ack_pending pending[ACK_PENDING_MAX];
+static int n_pending = 0;
+
+static struct ack_stats stats;
+
+int ack_set_report(int good, const char *hex) {
+  struct ack_report *report = &reports[good ? 1 : 0];
+  int length = 0;
+  unsigned int byte;
+
+  while (*hex) {
+    if (length == ACK_REPORT_MAX || sscanf(hex, "%2x", &byte) != 1 ||
+        !hex[1]) {
+      fprintf(stderr, "Invalid output report '%s'.\n", hex);
+      return -1;
+    }
+    report->data[length++] = byte;
+    hex += 2;
+  }
+
+  report->length = length;
+
+  return 0;
+}
+
+void ack_set_consumer_timeout(int timeout_ms) {
+  consumer_timeout_ns = (uint64_t) timeout_ms * 1000000ULL;
+}
+
+void ack_set_budget(int budget_ms) {
+  budget_ns = (uint64_t) budget_ms * 1000000ULL;
+}
+
+int ack_enabled(void) {
+  return reports[0].length > 0 || reports[1].length > 0;
+}
+
+int ack_consumer_enabled(void) {
+  return consumer_timeout_ns > 0;
+}
+
+static void ack_write(int fd, uint64_t read_ns, int good) {
+  const struct ack_report *report = &reports[good ? 1 : 0];
+  uint64_t latency_ns;
+
+  if (report->length == 0)
+    return;
+
+  if (write(fd, report->data, report->length) != report->length) {
+    stats.failed++;
+    return;
+  }
+
+  latency_ns = capture_now() - read_ns;
+
+  if (good)
+    stats.good++;
+  else
+    stats.bad++;
+
+  stats.total_us += latency_ns / 1000;
+  if (latency_ns / 1000 > stats.max_us)
+    stats.max_us = latency_ns / 1000;
+  if (latency_ns > budget_ns)
+    stats.over_budget++;
+}
+
+static void ack_remove(int i) {
+  pending[i] = pending[--n_pending];
+}
+
+void ack_scan(int fd, uint32_t seq, uint64_t read_ns, int accepted) {
+  struct ack_pending *p;
+
+  if (!ack_enabled())
+    return;
+
+  if (!accepted || !ack_consumer_enabled()) {
+    ack_write(fd, read_ns, accepted);
+    return;
+  }
+
+  /* No room left: give up on the scan that has waited longest. */
+  if (n_pending == ACK_PENDING_MAX) {
+    int i, oldest = 0;
+
+    for (i = 1; i < n_pending; i++)
+      if (pending[i].deadline_ns < pending[oldest].deadline_ns)
+        oldest = i;
+
+    stats.timeouts++;
+    ack_write(pending[oldest].fd, pending[oldest].read_ns, 0);
+    ack_remove(oldest);
+  }
+
+  p = &pending[n_pending++];
+  p->fd = fd;
+  p->seq = seq;
+  p->read_ns = read_ns;
+  p->deadline_ns = read_ns + consumer_timeout_ns;
+}
+
+void ack_repeat(int fd, uint64_t read_ns) {
+  if (ack_enabled())
+    ack_write(fd, read_ns, 1);
+}
+
+int ack_consumer(uint32_t seq, int accepted) {
+  int i;
+
+  for (i = 0; i < n_pending; i++) {
+    if (pending[i].seq == seq) {
+      ack_write(pending[i].fd, pending[i].read_ns, accepted);
+      ack_remove(i);
+
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int ack_expire(uint64_t now_ns) {
+  uint64_t next = 0;
+  int i = 0;
+
+  while (i < n_pending) {
+    if (pending[i].deadline_ns <= now_ns) {
+      stats.timeouts++;
+      ack_write(pending[i].fd, pending[i].read_ns, 0);
+      ack_remove(i);
+      continue;
+    }
+
+    if (next == 0 || pending[i].deadline_ns < next)
+      next = pending[i].deadline_ns;
+    i++;
+  }
+
+  if (next == 0)
+    return -1;
+
+  /* round up, so the deadline has passed when we wake */
+  return (next - now_ns + 999999) / 1000000;
+}
+
+void ack_device_closed(int fd) {
+  int i = 0;
+
+  while (i < n_pending) {
+    if (pending[i].fd == fd)
+      ack_remove(i);
+    else
+      i++;
+  }
+}
+
+const struct ack_stats *ack_get_stats(void) {
+  return &stats;
+}
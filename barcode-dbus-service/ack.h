@@ -0,0 +1,54 @@
+#ifndef ACK_H
+#define ACK_H
+
+#include <stdint.h>
+
+/*
+ * Good-read/bad-read acknowledgement of scans through HID output reports,
+ * so the scanner beeps or flashes once the host has taken the read.
+ *
+ * Without a consumer the ack is sent as soon as the service accepted a
+ * scan. With --ack-consumer a consumer has to confirm each scan with the
+ * Ack method; a scan not confirmed within the timeout gets a bad-read.
+ */
+
+struct ack_stats {
+  uint32_t good;        /* good-read reports written */
+  uint32_t bad;         /* bad-read reports written */
+  uint32_t failed;      /* output reports the device didn't take */
+  uint32_t timeouts;    /* consumer acks that never came */
+  uint32_t over_budget; /* acks written later than the latency budget */
+  uint32_t max_us;      /* worst read to ack latency */
+  uint64_t total_us;    /* sum of read to ack latencies */
+};
+
+/* Parses a hex string such as "0501ff" as the report to send. */
+int ack_set_report(int good, const char *hex);
+void ack_set_consumer_timeout(int timeout_ms);
+void ack_set_budget(int budget_ms);
+
+int ack_enabled(void);
+int ack_consumer_enabled(void);
+
+/* Acknowledges scan seq read from fd at read_ns; accepted is the verdict
+ * of the service. Accepted scans wait for the consumer if there is one. */
+void ack_scan(int fd, uint32_t seq, uint64_t read_ns, int accepted);
+
+/* Sends a good-read for a repeat of a scan the host already accepted,
+ * without waiting for the consumer. Callers must only pass repeats of
+ * scans that got a good-read. */
+void ack_repeat(int fd, uint64_t read_ns);
+
+/* The consumer's verdict; returns -1 if seq isn't waiting for one. */
+int ack_consumer(uint32_t seq, int accepted);
+
+/* Sends bad-reads for consumer acks past their deadline and returns the
+ * milliseconds until the next deadline, or -1 if none is pending. */
+int ack_expire(uint64_t now_ns);
+
+/* Forgets the scans waiting for an ack on a closed device. */
+void ack_device_closed(int fd);
+
+const struct ack_stats *ack_get_stats(void);
+
+#endif /* ACK_H */
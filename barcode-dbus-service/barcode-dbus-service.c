@@ -10,9 +10,44 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
+#include <getopt.h>
 #include <dbus/dbus.h>
 #include <libudev.h>
 
+#include "ack.h"
+#include "capture.h"
+#include "charset.h"
+#include "utf8.h"
+
+#ifndef VERSION
+#define VERSION "0.0.1"
+#endif
+
+static int verbose = 0;
+static volatile sig_atomic_t quit = 0;
+
+#define PAYLOAD_MAX  32
+
+/* Per-open device state, indexed by hidraw fd. */
+struct hid_device {
+  uint16_t id;         /* small id, as recorded in the capture trace */
+  iconv_t decoder;     /* payload charset decoder or CHARSET_NONE */
+
+  /* last payload, to drop repeated reads of the same label */
+  unsigned char last[PAYLOAD_MAX];
+  int last_length;
+  uint64_t last_ns;
+  dbus_uint32_t last_seq;  /* scan the payload was delivered as */
+  int last_accepted;       /* the host took that scan */
+};
+
+/* Same payload from the same device within this window is a double read. */
+static uint64_t dedupe_window_ns = 0;
+
+static struct hid_device hid_devices[FD_SETSIZE];
+static uint16_t next_device_id = 1;
+
 const char * bus_str(int bus) {
  switch (bus) {
    case BUS_USB:
@@ -33,21 +68,288 @@ const char * bus_str(int bus) {
   }
 }
 
+#define SERVICE_NAME      "me.koppi.BarcodeReader"
+#define SERVICE_INTERFACE "me.koppi.BarcodeReader"
+#define SERVICE_PATH      "/me/koppi/BarcodeReader"
+#define SIGNAL_PATH       "/me/koppi/BarcodeReader/read"
+
+/* Advertised in the Ready signal and by GetCapabilities, so clients can
+ * pick the best transport this service speaks. */
+static const char *capabilities[] = {
+  "read",       /* read(s code, u seq) signal, UTF-8 payloads only */
+  "read-bytes", /* ReadBytes(ay data, u seq, b valid, s text) signal */
+  "journal",    /* GetScans(u since) -> a(us), GetScansBytes -> a(uaybs) */
+  "ack"         /* Ack(u seq, b accepted), GetAckStatistics() */
+};
+
+/* The most recent scans, kept so a client that activated the service can
+ * fetch what was read before its subscription became effective. */
+#define JOURNAL_SIZE 256
+#define TEXT_MAX     (PAYLOAD_MAX * 4) /* worst case growth to UTF-8 */
+
+struct journal_entry {
+  dbus_uint32_t seq;
+  int length;
+  unsigned char data[PAYLOAD_MAX];     /* exact payload bytes */
+  int valid;                           /* text holds the decoded payload */
+  char text[TEXT_MAX + 1];
+};
+
+static struct journal_entry journal[JOURNAL_SIZE];
+static dbus_uint32_t last_seq = 0;
+
+static const struct journal_entry *journal_add(const struct hid_device *device,
+                                               const unsigned char *data,
+                                               int length) {
+  struct journal_entry *entry;
+  int n;
+
+  if (length > PAYLOAD_MAX)
+    length = PAYLOAD_MAX;
+
+  entry = &journal[++last_seq % JOURNAL_SIZE];
+  entry->seq = last_seq;
+  entry->length = length;
+  memcpy(entry->data, data, length);
+
+  /* ASCII is passed through; other payloads are decoded with the
+   * device's charset, or must already be UTF-8 if it has none. */
+  n = charset_decode(device->decoder, data, length,
+                     entry->text, sizeof(entry->text));
+  if (n < 0 && device->decoder == CHARSET_NONE) {
+    memcpy(entry->text, data, length);
+    entry->text[length] = '\0';
+    n = length;
+  }
+
+  entry->valid = n >= 0 && utf8_validate((unsigned char *) entry->text, n);
+  if (!entry->valid)
+    entry->text[0] = '\0';
+
+  return entry;
+}
+
+/* Only repeats of a scan the host accepted are dropped; repeats of a bad
+ * read, of a rejected scan or of one still waiting for its Ack are new
+ * scans. Empty reads are always bad reads, never repeats. */
+static int is_duplicate(struct hid_device *device, const unsigned char *data,
+                        int length, uint64_t now_ns) {
+  int duplicate;
+
+  if (dedupe_window_ns == 0)
+    return 0;
+
+  duplicate = length > 0 && device->last_accepted &&
+              length == device->last_length &&
+              now_ns - device->last_ns < dedupe_window_ns &&
+              memcmp(data, device->last, length) == 0;
+
+  memcpy(device->last, data, length);
+  device->last_length = length;
+  device->last_ns = now_ns;
+
+  return duplicate;
+}
+
+/* The payload of a report starts at byte 4. Reports have a fixed size and
+ * are padded with NULs, so the payload ends after its last non-NUL byte;
+ * NULs inside it are kept. */
+static int report_payload_length(const unsigned char *buf, int res) {
+  int length = res - 4;
+
+  while (length > 0 && buf[4 + length - 1] == 0)
+    length--;
+
+  return length > 0 ? length : 0;
+}
+
+static void dbus_send_ready(DBusConnection *connection) {
+  DBusMessage *message;
+  const char **caps = capabilities;
+
+  message = dbus_message_new_signal(SERVICE_PATH, SERVICE_INTERFACE, "Ready");
+
+  dbus_message_append_args(message,
+                           DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &caps,
+                           (int) (sizeof(capabilities) / sizeof(capabilities[0])),
+                           DBUS_TYPE_UINT32, &last_seq,
+                           DBUS_TYPE_INVALID);
+
+  dbus_connection_send (connection, message, NULL);
+  dbus_connection_flush(connection);
+  dbus_message_unref (message);
+}
+
 static void dbus_send(DBusConnection *connection,
-                      const char *action, const char *msg) {
+                      const struct journal_entry *entry) {
 
   DBusMessage *message;
- 
-  message = dbus_message_new_signal("/me/koppi/BarcodeReader/read",
-                                    "me.koppi.BarcodeReader", action);
+  const char *msg = entry->text;
+  const unsigned char *data = entry->data;
+  dbus_bool_t valid = entry->valid;
+
+  /* libdbus refuses, or aborts on, strings that aren't valid UTF-8, so
+   * binary payloads are only sent as bytes. */
+  if (valid) {
+    message = dbus_message_new_signal(SIGNAL_PATH, SERVICE_INTERFACE, "read");
+
+    dbus_message_append_args(message,
+                             DBUS_TYPE_STRING, &msg,
+                             DBUS_TYPE_UINT32, &entry->seq,
+                             DBUS_TYPE_INVALID);
+
+    dbus_connection_send (connection, message, NULL);
+    dbus_message_unref (message);
+  }
 
-  dbus_message_append_args(message, DBUS_TYPE_STRING, &msg, DBUS_TYPE_INVALID);
+  message = dbus_message_new_signal(SIGNAL_PATH, SERVICE_INTERFACE, "ReadBytes");
+
+  dbus_message_append_args(message,
+                           DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, entry->length,
+                           DBUS_TYPE_UINT32, &entry->seq,
+                           DBUS_TYPE_BOOLEAN, &valid,
+                           DBUS_TYPE_STRING, &msg,
+                           DBUS_TYPE_INVALID);
 
   dbus_connection_send (connection, message, NULL);
   dbus_connection_flush(connection);
   dbus_message_unref (message);
 }
 
+static DBusMessage *get_capabilities(DBusMessage *message) {
+  DBusMessage *reply;
+  const char **caps = capabilities;
+
+  reply = dbus_message_new_method_return(message);
+  dbus_message_append_args(reply,
+                           DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &caps,
+                           (int) (sizeof(capabilities) / sizeof(capabilities[0])),
+                           DBUS_TYPE_UINT32, &last_seq,
+                           DBUS_TYPE_INVALID);
+
+  return reply;
+}
+
+static DBusMessage *get_scans(DBusMessage *message, int bytes) {
+  DBusMessage *reply;
+  DBusMessageIter iter, array, entry, payload;
+  dbus_uint32_t since, seq, first;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_UINT32, &since, DBUS_TYPE_INVALID))
+    return dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS,
+                                  "GetScans expects a sequence number");
+
+  first = last_seq > JOURNAL_SIZE ? last_seq - JOURNAL_SIZE + 1 : 1;
+  if (since >= first)
+    first = since + 1;
+
+  reply = dbus_message_new_method_return(message);
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                   bytes ? "(uaybs)" : "(us)", &array);
+
+  for (seq = first; seq <= last_seq; seq++) {
+    const struct journal_entry *e = &journal[seq % JOURNAL_SIZE];
+    const char *text = e->text;
+    const unsigned char *data = e->data;
+    dbus_bool_t valid = e->valid;
+
+    /* the string flavour can't carry binary payloads */
+    if (!bytes && !e->valid)
+      continue;
+
+    dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &e->seq);
+    if (bytes) {
+      dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+                                       DBUS_TYPE_BYTE_AS_STRING, &payload);
+      dbus_message_iter_append_fixed_array(&payload, DBUS_TYPE_BYTE,
+                                           &data, e->length);
+      dbus_message_iter_close_container(&entry, &payload);
+      dbus_message_iter_append_basic(&entry, DBUS_TYPE_BOOLEAN, &valid);
+    }
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &text);
+    dbus_message_iter_close_container(&array, &entry);
+  }
+
+  dbus_message_iter_close_container(&iter, &array);
+
+  return reply;
+}
+
+static DBusMessage *ack(DBusMessage *message) {
+  dbus_uint32_t seq;
+  dbus_bool_t accepted;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_UINT32, &seq,
+                             DBUS_TYPE_BOOLEAN, &accepted,
+                             DBUS_TYPE_INVALID))
+    return dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS,
+                                  "Ack expects a sequence number and a verdict");
+
+  if (ack_consumer(seq, accepted) < 0)
+    return dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS,
+                                  "The scan is not waiting for an ack");
+
+  /* Repeats of the scan may be dropped from now on */
+  if (accepted) {
+    int fd;
+
+    for (fd = 0; fd < FD_SETSIZE; fd++)
+      if (hid_devices[fd].last_seq == seq)
+        hid_devices[fd].last_accepted = 1;
+  }
+
+  return dbus_message_new_method_return(message);
+}
+
+static DBusMessage *get_ack_statistics(DBusMessage *message) {
+  const struct ack_stats *stats = ack_get_stats();
+  DBusMessage *reply;
+  dbus_uint32_t acked = stats->good + stats->bad;
+  dbus_uint32_t mean_us = acked ? stats->total_us / acked : 0;
+
+  reply = dbus_message_new_method_return(message);
+  dbus_message_append_args(reply,
+                           DBUS_TYPE_UINT32, &stats->good,
+                           DBUS_TYPE_UINT32, &stats->bad,
+                           DBUS_TYPE_UINT32, &stats->failed,
+                           DBUS_TYPE_UINT32, &stats->timeouts,
+                           DBUS_TYPE_UINT32, &stats->over_budget,
+                           DBUS_TYPE_UINT32, &mean_us,
+                           DBUS_TYPE_UINT32, &stats->max_us,
+                           DBUS_TYPE_INVALID);
+
+  return reply;
+}
+
+static DBusHandlerResult handle_message(DBusConnection *connection,
+                                        DBusMessage *message, void *data) {
+  DBusMessage *reply;
+
+  if (dbus_message_is_method_call(message, SERVICE_INTERFACE, "GetCapabilities"))
+    reply = get_capabilities(message);
+  else if (dbus_message_is_method_call(message, SERVICE_INTERFACE, "GetScans"))
+    reply = get_scans(message, 0);
+  else if (dbus_message_is_method_call(message, SERVICE_INTERFACE, "GetScansBytes"))
+    reply = get_scans(message, 1);
+  else if (dbus_message_is_method_call(message, SERVICE_INTERFACE, "Ack"))
+    reply = ack(message);
+  else if (dbus_message_is_method_call(message, SERVICE_INTERFACE, "GetAckStatistics"))
+    reply = get_ack_statistics(message);
+  else
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (reply) {
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 static int open_hid(struct udev_device *dev) {
   int fd;
   int i, res, desc_size = 0;
@@ -134,14 +436,60 @@ static int open_hid(struct udev_device *dev) {
 
     printf("%s opened.\n", udev_device_get_devnode(dev));
 
+    if (fd < FD_SETSIZE) {
+      memset(&hid_devices[fd], 0, sizeof(hid_devices[fd]));
+      hid_devices[fd].id = next_device_id++;
+      hid_devices[fd].decoder =
+        charset_open(vId, udev_device_get_sysattr_value(dev_parent, "idProduct"));
+      capture_device_added(hid_devices[fd].id, vId,
+                           udev_device_get_sysattr_value(dev_parent, "idProduct"),
+                           udev_device_get_devnode(dev));
+    }
+
     return fd;
   } else {
     return -1;
   }
 }
 
-int main (void) {
-  char buf[256];
+static void handle_signal(int sig) {
+  quit = 1;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options...]\n\n"
+         "  -c, --capture FILE  record raw HID reports to a binary trace\n"
+         "  -C, --charset [VID:PID=]ENCODING\n"
+         "                      decode payloads from ENCODING to UTF-8\n"
+         "  -g, --ack-good HEX  output report sent for a good read\n"
+         "  -b, --ack-bad HEX   output report sent for a bad read\n"
+         "  -a, --ack-consumer MS\n"
+         "                      wait up to MS for a consumer to Ack a scan\n"
+         "  -B, --ack-budget MS latency budget from read to ack (default 50)\n"
+         "  -d, --dedupe MS     drop repeated reads of a label within MS\n"
+         "  -v, --verbose       dump every report read to stdout\n"
+         "  -V, --version       print the version and exit\n"
+         "  -h, --help          print this help and exit\n", prog);
+}
+
+int main (int argc, char **argv) {
+  static const struct option options[] = {
+    { "capture", required_argument, NULL, 'c' },
+    { "charset", required_argument, NULL, 'C' },
+    { "ack-good", required_argument, NULL, 'g' },
+    { "ack-bad", required_argument, NULL, 'b' },
+    { "ack-consumer", required_argument, NULL, 'a' },
+    { "ack-budget", required_argument, NULL, 'B' },
+    { "dedupe", required_argument, NULL, 'd' },
+    { "verbose", no_argument,       NULL, 'v' },
+    { "version", no_argument,       NULL, 'V' },
+    { "help",    no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  unsigned char buf[256];
+  const char *capture_path = NULL;
+  int c;
 
   struct udev *udev;
   struct udev_enumerate *enumerate;
@@ -159,11 +507,58 @@ int main (void) {
   DBusConnection *connection;
   DBusError error;
 
-  char *name = "me.koppi.BarcodeReader";
+  char *name = SERVICE_NAME;
+  int dbus_fd = -1;
+
+  DBusObjectPathVTable vtable = { .message_function = handle_message };
+
+  while ((c = getopt_long(argc, argv, "c:C:g:b:a:B:d:vVh", options, NULL)) != -1) {
+    switch (c) {
+    case 'c':
+      capture_path = optarg;
+      break;
+    case 'C':
+      if (charset_add_rule(optarg) < 0)
+        return 1;
+      break;
+    case 'g':
+    case 'b':
+      if (ack_set_report(c == 'g', optarg) < 0)
+        return 1;
+      break;
+    case 'a':
+      ack_set_consumer_timeout(atoi(optarg));
+      break;
+    case 'B':
+      ack_set_budget(atoi(optarg));
+      break;
+    case 'd':
+      dedupe_window_ns = (uint64_t) atoi(optarg) * 1000000ULL;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'V':
+      printf("barcode-dbus-service %s\n", VERSION);
+      return 0;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
 
   FD_ZERO(&master);
   FD_ZERO(&read_fds);
 
+  if (capture_path && capture_start(capture_path) < 0)
+    return 1;
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
   udev = udev_new();
 
   if (!udev) {
@@ -244,20 +639,59 @@ int main (void) {
 
   udev_enumerate_unref(enumerate);
 
-  while (1) {
-    fd_set fds;
+  if (!dbus_connection_register_object_path(connection, SERVICE_PATH,
+                                            &vtable, NULL)) {
+    printf("Failed to register %s.\n", SERVICE_PATH);
 
+    return 1;
+  }
+  dbus_connection_get_unix_fd(connection, &dbus_fd);
+
+  /* Devices are enumerated and methods are served from here on. */
+  dbus_send_ready(connection);
+
+  while (!quit) {
+    int ret, i = 0, j;
+    int maxfd = fdmax;
+    int timeout_ms;
     struct timeval tv;
-    int ret, i = 0;
 
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
+    while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+      ;
+    dbus_connection_flush(connection);
+
+    read_fds = master;
+    FD_SET(fd, &read_fds);
+    if (fd > maxfd)
+      maxfd = fd;
+    if (dbus_fd >= 0) {
+      FD_SET(dbus_fd, &read_fds);
+      if (dbus_fd > maxfd)
+        maxfd = dbus_fd;
+    }
+
+    /* Block until a report, a uevent or a D-Bus message arrives, or a
+     * consumer ack times out. */
+    timeout_ms = ack_expire(capture_now());
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    ret = select(maxfd+1, &read_fds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("select");
+      break;
+    }
 
-    ret = select(fd+1, &fds, NULL, NULL, &tv);
+    if (dbus_fd >= 0 && FD_ISSET(dbus_fd, &read_fds)) {
+      if (!dbus_connection_read_write(connection, 0)) {
+        printf("Lost the connection to the D-BUS daemon.\n");
+        break;
+      }
+    }
 		
-    if (ret > 0 && FD_ISSET(fd, &fds)) {
+    if (FD_ISSET(fd, &read_fds)) {
       dev = udev_monitor_receive_device(mon);
       if (dev) {
 	printf(" %s ", udev_device_get_action(dev));
@@ -282,29 +716,60 @@ int main (void) {
       }					
     }
 
-    read_fds = master;
-    ret = select(fdmax+1, &read_fds, NULL, NULL, &tv);
     for (i = 0; i <= fdmax; i++) {
-      if (ret > 0 && FD_ISSET(i, &read_fds)) {
+      if (FD_ISSET(i, &master) && FD_ISSET(i, &read_fds)) {
 
         res = read(i, buf, 32);
         if (res < 0) {
+          capture_device_removed(hid_devices[i].id);
+          ack_device_closed(i);
+          charset_close(hid_devices[i].decoder);
+          hid_devices[i].decoder = CHARSET_NONE;
           close(i);
           FD_CLR(i, &master);
         } else {
-          printf("  read %d bytes: ", res);
-	  for (i = 0; i < res; i++)
-	    printf("%hhx ", buf[i]);
-          puts("\n");
+          uint64_t read_ns = capture_now();
+
+          capture_report(hid_devices[i].id, read_ns, buf, res);
 
-          dbus_send(connection, "read", &buf[4]);
+          if (verbose) {
+            printf("  read %d bytes: ", res);
+            for (j = 0; j < res; j++)
+              printf("%hhx ", buf[j]);
+            puts("\n");
+          }
+
+          if (res > 4) {
+            struct hid_device *device = &hid_devices[i];
+            const struct journal_entry *entry;
+            int length = report_payload_length(buf, res);
+            int accepted;
+
+            /* The host already has this label, confirm it again. */
+            if (is_duplicate(device, &buf[4], length, read_ns)) {
+              ack_repeat(i, read_ns);
+              continue;
+            }
+
+            entry = journal_add(device, &buf[4], length);
+            dbus_send(connection, entry);
+
+            /* Empty payloads and labels the configured charset can't
+             * decode are bad reads. */
+            accepted = entry->length > 0 &&
+                       (entry->valid || device->decoder == CHARSET_NONE);
+            ack_scan(i, entry->seq, read_ns, accepted);
+
+            /* With a consumer the scan counts as accepted once it says so */
+            device->last_seq = entry->seq;
+            device->last_accepted = accepted && !ack_consumer_enabled();
+          }
         }
       }
     }
-    usleep(250*1000);
-    // printf("."); fflush(stdout);
   }
 
+  capture_stop();
   udev_unref(udev);
   dbus_connection_unref(connection);
 
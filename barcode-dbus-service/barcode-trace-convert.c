@@ -0,0 +1,170 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+/*
+ * Converts a binary capture trace written by barcode-dbus-service --capture
+ * into the line based text format read by the replay tool:
+ *
+ *   <seconds since start> <device id> add <vid>:<pid> <devnode>
+ *   <seconds since start> <device id> report <hex bytes...>
+ *   <seconds since start> <device id> remove
+ */
+
+static void usage(const char *prog) {
+  printf("Usage: %s [--from SECONDS] [--to SECONDS] TRACE [OUTPUT]\n\n"
+         "Converts a barcode-dbus-service capture trace for the replay tool.\n"
+         "  -f, --from SECONDS  skip records before SECONDS into the trace\n"
+         "  -t, --to SECONDS    stop after SECONDS into the trace\n"
+         "  -h, --help          print this help and exit\n", prog);
+}
+
+static int read_record(FILE *in, long index, struct capture_record *record) {
+  long offset = sizeof(struct capture_file_header) +
+                index * (long) sizeof(struct capture_record);
+
+  if (fseek(in, offset, SEEK_SET) != 0)
+    return -1;
+
+  return fread(record, sizeof(*record), 1, in) == 1 ? 0 : -1;
+}
+
+/* Index of the first record at or after timestamp_ns. Records are fixed
+ * size and monotonic, so this is a plain bisection over the file. */
+static long find_record(FILE *in, long count, uint64_t timestamp_ns) {
+  struct capture_record record;
+  long lo = 0, hi = count;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+
+    if (read_record(in, mid, &record) < 0)
+      return count;
+
+    if (record.timestamp_ns < timestamp_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    { "from", required_argument, NULL, 'f' },
+    { "to",   required_argument, NULL, 't' },
+    { "help", no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  struct capture_file_header header;
+  struct capture_record record;
+  double from = 0.0, to = -1.0;
+  FILE *in, *out = stdout;
+  long count, index;
+  time_t started;
+  int c, i;
+
+  while ((c = getopt_long(argc, argv, "f:t:h", options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      from = atof(optarg);
+      break;
+    case 't':
+      to = atof(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  in = fopen(argv[optind], "rb");
+  if (!in) {
+    perror("Unable to open trace");
+    return 1;
+  }
+
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not a barcode capture trace.\n", argv[optind]);
+    return 1;
+  }
+
+  if (header.version != CAPTURE_VERSION ||
+      header.byte_order != CAPTURE_BYTE_ORDER ||
+      header.record_size != sizeof(struct capture_record)) {
+    fprintf(stderr, "%s: unsupported trace version or byte order.\n",
+            argv[optind]);
+    return 1;
+  }
+
+  if (optind + 1 < argc) {
+    out = fopen(argv[optind + 1], "w");
+    if (!out) {
+      perror("Unable to open output");
+      return 1;
+    }
+  }
+
+  fseek(in, 0, SEEK_END);
+  count = (ftell(in) - (long) sizeof(header)) / (long) sizeof(record);
+
+  index = 0;
+  if (from > 0.0)
+    index = find_record(in, count,
+                        header.start_monotonic_ns + (uint64_t) (from * 1e9));
+
+  started = header.start_realtime_ns / 1000000000ULL;
+  fprintf(out, "# barcode capture trace, started %s", ctime(&started));
+
+  for (; index < count; index++) {
+    double t;
+
+    if (read_record(in, index, &record) < 0)
+      break;
+
+    t = (record.timestamp_ns - header.start_monotonic_ns) / 1e9;
+    if (to >= 0.0 && t > to)
+      break;
+
+    fprintf(out, "%.6f %u ", t, record.device_id);
+
+    switch (record.type) {
+    case CAPTURE_RECORD_REPORT:
+      fprintf(out, "report");
+      for (i = 0; i < record.length && i < CAPTURE_DATA_MAX; i++)
+        fprintf(out, " %02x", record.data[i]);
+      fprintf(out, "\n");
+      break;
+    case CAPTURE_RECORD_ADDED:
+      fprintf(out, "add %.*s\n", record.length, (const char *) record.data);
+      break;
+    case CAPTURE_RECORD_REMOVED:
+      fprintf(out, "remove\n");
+      break;
+    default:
+      fprintf(out, "unknown %u\n", record.type);
+      break;
+    }
+  }
+
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+
+  return 0;
+}
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+/* Records queued between the read loop and the writer thread. When the
+ * writer falls behind the ring is full and new records are dropped and
+ * counted rather than stalling the read loop. */
+#define CAPTURE_RING_SIZE 1024
+
+/* Flush the stdio buffer to disk at least this often. */
+#define CAPTURE_FLUSH_NS (1000ULL * 1000 * 1000)
+
+static struct {
+  FILE *file;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int stopping;
+
+  struct capture_record ring[CAPTURE_RING_SIZE];
+  unsigned int head;           /* next slot to fill */
+  unsigned int tail;           /* next slot to write */
+
+  unsigned long written;
+  unsigned long dropped;
+} capture = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t capture_now(void) {
+  return clock_ns(CLOCK_MONOTONIC);
+}
+
+int capture_active(void) {
+  return capture.running;
+}
+
+static void *capture_writer(void *data) {
+  struct capture_record batch[64];
+  uint64_t last_flush = capture_now();
+
+  pthread_mutex_lock(&capture.lock);
+
+  while (1) {
+    unsigned int n = 0;
+
+    while (capture.head == capture.tail && !capture.stopping)
+      pthread_cond_wait(&capture.cond, &capture.lock);
+
+    if (capture.head == capture.tail && capture.stopping)
+      break;
+
+    while (capture.tail != capture.head && n < sizeof(batch) / sizeof(batch[0])) {
+      batch[n++] = capture.ring[capture.tail];
+      capture.tail = (capture.tail + 1) % CAPTURE_RING_SIZE;
+    }
+
+    pthread_mutex_unlock(&capture.lock);
+
+    if (fwrite(batch, sizeof(batch[0]), n, capture.file) != n)
+      perror("capture: write failed");
+
+    if (capture_now() - last_flush >= CAPTURE_FLUSH_NS) {
+      fflush(capture.file);
+      last_flush = capture_now();
+    }
+
+    pthread_mutex_lock(&capture.lock);
+    capture.written += n;
+  }
+
+  pthread_mutex_unlock(&capture.lock);
+
+  return NULL;
+}
+
+int capture_start(const char *path) {
+  struct capture_file_header header;
+
+  capture.file = fopen(path, "wb");
+  if (!capture.file) {
+    perror("capture: unable to open trace file");
+
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  header.byte_order = CAPTURE_BYTE_ORDER;
+  header.record_size = sizeof(struct capture_record);
+  header.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+  header.start_monotonic_ns = capture_now();
+
+  if (fwrite(&header, sizeof(header), 1, capture.file) != 1) {
+    perror("capture: unable to write trace header");
+    fclose(capture.file);
+    capture.file = NULL;
+
+    return -1;
+  }
+
+  capture.head = capture.tail = 0;
+  capture.stopping = 0;
+
+  if (pthread_create(&capture.thread, NULL, capture_writer, NULL) != 0) {
+    perror("capture: unable to start writer");
+    fclose(capture.file);
+    capture.file = NULL;
+
+    return -1;
+  }
+
+  capture.running = 1;
+  printf("Capturing raw reports to %s.\n", path);
+
+  return 0;
+}
+
+void capture_stop(void) {
+  if (!capture.running)
+    return;
+
+  pthread_mutex_lock(&capture.lock);
+  capture.stopping = 1;
+  pthread_cond_signal(&capture.cond);
+  pthread_mutex_unlock(&capture.lock);
+
+  pthread_join(capture.thread, NULL);
+  capture.running = 0;
+
+  fclose(capture.file);
+  capture.file = NULL;
+
+  printf("Capture stopped: %lu records written, %lu dropped.\n",
+         capture.written, capture.dropped);
+}
+
+static void capture_push(const struct capture_record *record) {
+  unsigned int next;
+
+  if (!capture.running)
+    return;
+
+  pthread_mutex_lock(&capture.lock);
+
+  next = (capture.head + 1) % CAPTURE_RING_SIZE;
+  if (next == capture.tail) {
+    capture.dropped++;
+  } else {
+    /* Only wake the writer when it may be waiting on an empty ring. */
+    if (capture.head == capture.tail)
+      pthread_cond_signal(&capture.cond);
+
+    capture.ring[capture.head] = *record;
+    capture.head = next;
+  }
+
+  pthread_mutex_unlock(&capture.lock);
+}
+
+void capture_report(uint16_t device_id, uint64_t timestamp_ns,
+                    const void *data, int length) {
+  struct capture_record record;
+
+  if (!capture.running)
+    return;
+
+  if (length < 0)
+    length = 0;
+  if (length > CAPTURE_DATA_MAX)
+    length = CAPTURE_DATA_MAX;
+
+  memset(&record, 0, sizeof(record));
+  record.timestamp_ns = timestamp_ns;
+  record.device_id = device_id;
+  record.type = CAPTURE_RECORD_REPORT;
+  record.length = length;
+  memcpy(record.data, data, length);
+
+  capture_push(&record);
+}
+
+void capture_device_added(uint16_t device_id, const char *vid,
+                          const char *pid, const char *devnode) {
+  struct capture_record record;
+  char desc[CAPTURE_DATA_MAX + 1];
+  int length;
+
+  if (!capture.running)
+    return;
+
+  length = snprintf(desc, sizeof(desc), "%s:%s %s",
+                    vid ? vid : "0000", pid ? pid : "0000",
+                    devnode ? devnode : "");
+  if (length > CAPTURE_DATA_MAX)
+    length = CAPTURE_DATA_MAX;
+
+  memset(&record, 0, sizeof(record));
+  record.timestamp_ns = capture_now();
+  record.device_id = device_id;
+  record.type = CAPTURE_RECORD_ADDED;
+  record.length = length;
+  memcpy(record.data, desc, length);
+
+  capture_push(&record);
+}
+
+void capture_device_removed(uint16_t device_id) {
+  struct capture_record record;
+
+  if (!capture.running)
+    return;
+
+  memset(&record, 0, sizeof(record));
+  record.timestamp_ns = capture_now();
+  record.device_id = device_id;
+  record.type = CAPTURE_RECORD_REMOVED;
+
+  capture_push(&record);
+}
@@ -0,0 +1,66 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Binary capture trace of raw HID reports.
+ *
+ * A trace is a capture_file_header followed by fixed size
+ * capture_records, so record n lives at
+ *
+ *   sizeof(struct capture_file_header) + n * sizeof(struct capture_record)
+ *
+ * and, since timestamps are monotonic, a reader can bisect the file
+ * by time without scanning it. All fields are stored in host byte order;
+ * the header's byte_order field tells a reader which one that was.
+ */
+
+#define CAPTURE_MAGIC      "BCTRACE1"
+#define CAPTURE_VERSION    1
+#define CAPTURE_BYTE_ORDER 0x01020304
+#define CAPTURE_DATA_MAX   32
+
+enum capture_record_type {
+  CAPTURE_RECORD_REPORT  = 0, /* data holds the raw report */
+  CAPTURE_RECORD_ADDED   = 1, /* data holds "vvvv:pppp /dev/hidrawN" */
+  CAPTURE_RECORD_REMOVED = 2  /* no data */
+};
+
+struct capture_file_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t start_realtime_ns;  /* wall clock at start, for display */
+  uint64_t start_monotonic_ns; /* monotonic clock at start */
+};
+
+struct capture_record {
+  uint64_t timestamp_ns;       /* CLOCK_MONOTONIC */
+  uint16_t device_id;
+  uint8_t  type;
+  uint8_t  length;
+  uint32_t reserved;
+  uint8_t  data[CAPTURE_DATA_MAX];
+};
+
+uint64_t capture_now(void);
+
+/* Open the trace file and start the background writer. */
+int capture_start(const char *path);
+
+/* Drain pending records, stop the writer and close the trace. */
+void capture_stop(void);
+
+int capture_active(void);
+
+/* Queue records for the writer; never blocks on file I/O. */
+void capture_report(uint16_t device_id, uint64_t timestamp_ns,
+                    const void *data, int length);
+void capture_device_added(uint16_t device_id, const char *vid,
+                          const char *pid, const char *devnode);
+void capture_device_removed(uint16_t device_id);
+
+#endif /* CAPTURE_H */
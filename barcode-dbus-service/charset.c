@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "charset.h"
+#include "utf8.h"
+
+#define CHARSET_RULES_MAX 32
+
+struct charset_rule {
+  char vid[5];      /* empty for the default rule */
+  char pid[5];
+  char encoding[32];
+};
+
+static struct charset_rule rules[CHARSET_RULES_MAX];
+static int n_rules = 0;
+
+int charset_add_rule(const char *spec) {
+  struct charset_rule *rule;
+  const char *encoding = strchr(spec, '=');
+
+  if (n_rules == CHARSET_RULES_MAX) {
+    fprintf(stderr, "Too many charset rules.\n");
+    return -1;
+  }
+
+  rule = &rules[n_rules];
+  memset(rule, 0, sizeof(*rule));
+
+  if (encoding) {
+    if (sscanf(spec, "%4[0-9a-fA-F]:%4[0-9a-fA-F]=", rule->vid, rule->pid) != 2) {
+      fprintf(stderr, "Invalid charset rule '%s', expected VID:PID=ENCODING.\n",
+              spec);
+      return -1;
+    }
+    encoding++;
+  } else {
+    encoding = spec;
+  }
+
+  if (!*encoding || strlen(encoding) >= sizeof(rule->encoding)) {
+    fprintf(stderr, "Invalid encoding in charset rule '%s'.\n", spec);
+    return -1;
+  }
+  strcpy(rule->encoding, encoding);
+
+  n_rules++;
+
+  return 0;
+}
+
+iconv_t charset_open(const char *vid, const char *pid) {
+  const char *encoding = NULL, *fallback = NULL;
+  iconv_t cd;
+  int i;
+
+  for (i = 0; i < n_rules; i++) {
+    if (!rules[i].vid[0])
+      fallback = rules[i].encoding;
+    else if (vid && pid && !strcasecmp(rules[i].vid, vid) &&
+             !strcasecmp(rules[i].pid, pid))
+      encoding = rules[i].encoding;
+  }
+
+  if (!encoding)
+    encoding = fallback;
+
+  if (!encoding || !strcasecmp(encoding, "UTF-8") ||
+      !strcasecmp(encoding, "UTF8"))
+    return CHARSET_NONE;
+
+  cd = iconv_open("UTF-8", encoding);
+  if (cd == CHARSET_NONE) {
+    fprintf(stderr, "  Unable to decode %s: %s\n", encoding, strerror(errno));
+    return CHARSET_NONE;
+  }
+
+  printf("  decoding payloads from %s.\n", encoding);
+
+  return cd;
+}
+
+void charset_close(iconv_t cd) {
+  if (cd != CHARSET_NONE)
+    iconv_close(cd);
+}
+
+int charset_decode(iconv_t cd, const unsigned char *in, size_t len,
+                   char *out, size_t out_size) {
+  char *inbuf = (char *) in, *outbuf = out;
+  size_t inleft = len, outleft = out_size - 1;
+
+  if (utf8_is_ascii(in, len)) {
+    if (len >= out_size)
+      return -1;
+    memcpy(out, in, len);
+    out[len] = '\0';
+
+    return len;
+  }
+
+  if (cd == CHARSET_NONE)
+    return -1;
+
+  /* reset the shift state left behind by a failed conversion */
+  iconv(cd, NULL, NULL, NULL, NULL);
+
+  if (iconv(cd, &inbuf, &inleft, &outbuf, &outleft) == (size_t) -1 ||
+      iconv(cd, NULL, NULL, &outbuf, &outleft) == (size_t) -1)
+    return -1;
+
+  *outbuf = '\0';
+
+  return outbuf - out;
+}
@@ -0,0 +1,31 @@
+#ifndef CHARSET_H
+#define CHARSET_H
+
+#include <iconv.h>
+#include <stddef.h>
+
+#define CHARSET_NONE ((iconv_t) -1)
+
+/*
+ * Adds a decoding rule from a command line spec, either "ENCODING" for
+ * every device or "VID:PID=ENCODING" for one model, e.g.
+ * "05e0:1300=SHIFT_JIS". A model rule beats the default rule, and among
+ * rules of the same kind the last one wins.
+ */
+int charset_add_rule(const char *spec);
+
+/* Opens the decoder for a device, or CHARSET_NONE if its payloads are
+ * passed on as they are. Devices keep the handle while they are open. */
+iconv_t charset_open(const char *vid, const char *pid);
+void charset_close(iconv_t cd);
+
+/*
+ * Converts len bytes at in to UTF-8 at out, which is NUL terminated.
+ * Pure ASCII payloads are copied without going through iconv. Returns the
+ * length written or -1 if the payload is not valid in the device encoding
+ * or doesn't fit.
+ */
+int charset_decode(iconv_t cd, const unsigned char *in, size_t len,
+                   char *out, size_t out_size);
+
+#endif /* CHARSET_H */
@@ -0,0 +1,89 @@
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+size_t utf8_ascii_prefix(const unsigned char *s, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  /* 16 bytes per step: a byte ends the run if its high bit is set or it
+   * is zero, and cmpeq turns zero bytes into 0xff. */
+  const __m128i zero = _mm_setzero_si128();
+
+  while (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+
+    if (mask)
+      return i + __builtin_ctz(mask);
+    i += 16;
+  }
+#endif
+
+  while (i < len && s[i] != 0 && s[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+int utf8_is_ascii(const unsigned char *s, size_t len) {
+  return utf8_ascii_prefix(s, len) == len;
+}
+
+/* Decodes one multi-byte sequence at s, returning its length or 0 if it
+ * is malformed or not a valid D-Bus character. */
+static size_t utf8_sequence(const unsigned char *s, size_t len) {
+  uint32_t c;
+  size_t n, i;
+
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    n = 2;
+    c = s[0] & 0x1f;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    n = 3;
+    c = s[0] & 0x0f;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    n = 4;
+    c = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (n > len)
+    return 0;
+
+  for (i = 1; i < n; i++) {
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+
+  /* overlong forms, surrogates, out of range and noncharacters */
+  if ((n == 3 && c < 0x800) || (n == 4 && c < 0x10000) ||
+      c > 0x10ffff || (c & 0xfffff800) == 0xd800 ||
+      (c >= 0xfdd0 && c <= 0xfdef) || (c & 0xfffe) == 0xfffe)
+    return 0;
+
+  return n;
+}
+
+int utf8_validate(const unsigned char *s, size_t len) {
+  size_t i = 0;
+
+  while (1) {
+    size_t n;
+
+    i += utf8_ascii_prefix(s + i, len - i);
+    if (i == len)
+      return 1;
+
+    n = utf8_sequence(s + i, len - i);
+    if (n == 0)
+      return 0;
+    i += n;
+  }
+}
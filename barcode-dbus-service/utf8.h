@@ -0,0 +1,19 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+/* Length of the leading run of non-NUL ASCII bytes in s. */
+size_t utf8_ascii_prefix(const unsigned char *s, size_t len);
+
+/* Non-zero if s is pure ASCII without embedded NULs. */
+int utf8_is_ascii(const unsigned char *s, size_t len);
+
+/*
+ * Non-zero if s is acceptable as a D-Bus string: well-formed UTF-8, no
+ * embedded NUL, no surrogates and no noncharacters (which older libdbus
+ * rejects as well).
+ */
+int utf8_validate(const unsigned char *s, size_t len);
+
+#endif /* UTF8_H */
@@ -27,6 +27,8 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <arpa/inet.h>
 
@@ -45,6 +47,15 @@
 
 #define NMD_SCRIPT_DIR    SYSCONFDIR "/BarcodeManager/dispatcher.d"
 
+/* Scripts here don't wait for each other or for earlier events */
+#define NMD_NO_WAIT_DIR   NMD_SCRIPT_DIR "/no-wait.d"
+
+/* Scripts running at once, over all events */
+#define MAX_RUNNING_SCRIPTS 4
+
+/* Scripts still running after this are killed */
+#define SCRIPT_TIMEOUT_SEC 3
+
 static GMainLoop *loop = NULL;
 static gboolean debug = FALSE;
 
@@ -189,24 +200,8 @@ bmd_is_valid_filename (const char *file_name)
 static gint
 sort_files (gconstpointer a, gconstpointer b)
 {
-	char *a_base = NULL, *b_base = NULL;
-	int ret = 0;
-
-	if (a && !b)
-		return 1;
-	if (!a && !b)
-		return 0;
-	if (!a && b)
-		return -1;
-
-	a_base = g_path_get_basename (a);
-	b_base = g_path_get_basename (b);
-
-	ret = strcmp (a_base, b_base);
-
-	g_free (a_base);
-	g_free (b_base);
-	return ret;
+	/* All paths of a list share the directory */
+	return strcmp (*(const char **) a, *(const char **) b);
 }
 
 static void
@@ -218,40 +213,63 @@ child_setup (gpointer user_data G_GNUC_UNUSED)
         setpgid (pid, pid);
 }
 
+/*****************************************************************************/
+
+/* Validated scripts of one directory, sorted; shared by the events that
+ * are still running them.
+ */
 typedef struct {
-	char **envp;
-	guint32 i;
-} EnvAddInfo;
+	guint refcount;
+	GPtrArray *paths;
+} ScriptList;
+
+typedef struct {
+	const char *path;
+	gboolean ordered;
+
+	/* inotify watch, or -1 if the directory couldn't be watched */
+	int wd;
+
+	/* NULL until loaded, and again when the directory changes */
+	ScriptList *scripts;
+} ScriptDir;
+
+static ScriptDir script_dirs[] = {
+	{ NMD_SCRIPT_DIR,  TRUE,  -1, NULL },
+	{ NMD_NO_WAIT_DIR, FALSE, -1, NULL },
+};
+
+static int inotify_fd = -1;
 
 static void
-add_one_option_to_envp (gpointer key, gpointer value, gpointer user_data)
+script_list_unref (ScriptList *list)
 {
-	EnvAddInfo *info = (EnvAddInfo *) user_data;
-	char *ucased;
+	if (--list->refcount)
+		return;
 
-	ucased = g_ascii_strup (key, -1);
-	info->envp[info->i++] = g_strdup_printf ("DHCP4_%s=%s", ucased, (char *) value);
-	g_free (ucased);
+	g_ptr_array_foreach (list->paths, (GFunc) g_free, NULL);
+	g_ptr_array_free (list->paths, TRUE);
+	g_slice_free (ScriptList, list);
 }
 
-static void
-dispatch_scripts (const char *action,
-                  const char *iface,
-                  const char *parent_iface,
-                  BMDeviceType type,
-                  const char *uuid)
+static ScriptList *
+load_scripts (const char *dir_path)
 {
+	ScriptList *list;
 	GDir *dir;
 	const char *filename;
-	GSList *scripts = NULL, *iter;
 	GError *error = NULL;
-	char **envp = NULL;
 
-	if (!(dir = g_dir_open (NMD_SCRIPT_DIR, 0, &error))) {
-		g_warning ("g_dir_open() could not open '" NMD_SCRIPT_DIR "'.  '%s'",
-		           error->message);
+	list = g_slice_new0 (ScriptList);
+	list->refcount = 1;
+	list->paths = g_ptr_array_new ();
+
+	if (!(dir = g_dir_open (dir_path, 0, &error))) {
+		/* The no-wait directory is optional */
+		if (strcmp (dir_path, NMD_NO_WAIT_DIR))
+			g_warning ("g_dir_open() could not open '%s'.  '%s'", dir_path, error->message);
 		g_error_free (error);
-		return;
+		return list;
 	}
 
 	while ((filename = g_dir_read_name (dir))) {
@@ -263,7 +281,7 @@ dispatch_scripts (const char *action,
 		if (!bmd_is_valid_filename (filename))
 			continue;
 
-		file_path = g_build_filename (NMD_SCRIPT_DIR, filename, NULL);
+		file_path = g_build_filename (dir_path, filename, NULL);
 
 		err = stat (file_path, &s);
 		if (err) {
@@ -272,21 +290,342 @@ dispatch_scripts (const char *action,
 			continue;
 		}
 
+		/* Subdirectories such as no-wait.d are expected */
+		if (S_ISDIR (s.st_mode)) {
+			g_free (file_path);
+			continue;
+		}
+
 		if (!bmd_permission_check (&s, &pc_error)) {
 			g_warning ("Script '%s' could not be executed: %s", file_path, pc_error->message);
 			g_error_free (pc_error);
 			g_free (file_path);
 		} else {
 			/* success */
-			scripts = g_slist_insert_sorted (scripts, file_path, sort_files);
+			g_ptr_array_add (list->paths, file_path);
 		}
 	}
 	g_dir_close (dir);
 
-	// FIXME invoke script here
+	g_ptr_array_sort (list->paths, sort_files);
+	return list;
+}
 
-	g_slist_foreach (scripts, (GFunc) g_free, NULL);
-	g_slist_free (scripts);
+static void
+invalidate_scripts (void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (script_dirs); i++) {
+		if (script_dirs[i].scripts) {
+			script_list_unref (script_dirs[i].scripts);
+			script_dirs[i].scripts = NULL;
+		}
+	}
+}
+
+static gboolean
+inotify_event_cb (GIOChannel *channel, GIOCondition cond, gpointer user_data)
+{
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	ssize_t len;
+	guint i;
+
+	while ((len = read (inotify_fd, buf, sizeof (buf))) > 0) {
+		char *ptr;
+
+		for (ptr = buf; ptr < buf + len; ) {
+			struct inotify_event *evt = (struct inotify_event *) ptr;
+
+			/* The directory itself went away; watch it again on reload */
+			if (evt->mask & IN_IGNORED) {
+				for (i = 0; i < G_N_ELEMENTS (script_dirs); i++) {
+					if (script_dirs[i].wd == evt->wd)
+						script_dirs[i].wd = -1;
+				}
+			}
+			ptr += sizeof (struct inotify_event) + evt->len;
+		}
+	}
+
+	/* Any change may add, remove or alter a script */
+	invalidate_scripts ();
+	return TRUE;
+}
+
+static void
+init_script_watch (void)
+{
+	GIOChannel *channel;
+
+	inotify_fd = inotify_init ();
+	if (inotify_fd < 0) {
+		g_warning ("Couldn't initialize inotify; scripts will be re-read for every event.");
+		return;
+	}
+	fcntl (inotify_fd, F_SETFL, O_NONBLOCK);
+
+	channel = g_io_channel_unix_new (inotify_fd);
+	g_io_add_watch (channel, G_IO_IN | G_IO_ERR, inotify_event_cb, NULL);
+	g_io_channel_unref (channel);
+}
+
+/* Returns a reference to the current scripts of 'dir' */
+static ScriptList *
+get_scripts (ScriptDir *dir)
+{
+	ScriptList *list;
+
+	/* Watch before reading so no change can slip in between */
+	if (dir->wd < 0 && inotify_fd >= 0) {
+		dir->wd = inotify_add_watch (inotify_fd, dir->path,
+		                             IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+		                             | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF
+		                             | IN_MOVE_SELF | IN_ONLYDIR);
+	}
+
+	if (dir->scripts) {
+		dir->scripts->refcount++;
+		return dir->scripts;
+	}
+
+	list = load_scripts (dir->path);
+
+	/* Without a watch nothing would tell us when to re-read */
+	if (dir->wd >= 0) {
+		dir->scripts = list;
+		list->refcount++;
+	}
+	return list;
+}
+
+/*****************************************************************************/
+
+/* One event: its environment is built once and shared by all of its
+ * scripts.
+ */
+typedef struct {
+	guint refcount;
+	char *action;
+	char *iface;
+	char **envp;
+
+	/* Ordered scripts, run one at a time after those of earlier events */
+	ScriptList *ordered;
+	guint next;
+} Request;
+
+typedef struct {
+	Request *request;
+	char *path;
+	gboolean ordered;
+
+	GPid pid;
+	guint timeout_id;
+} Job;
+
+static guint running_jobs = 0;
+static GQueue waiting_jobs = G_QUEUE_INIT;
+static GQueue ordered_requests = G_QUEUE_INIT;
+static gboolean ordered_busy = FALSE;
+
+static void job_submit (Job *job);
+
+static char **
+build_envp (const char *action,
+            const char *iface,
+            const char *parent_iface,
+            BMDeviceType type,
+            const char *uuid)
+{
+	GPtrArray *env;
+
+	env = g_ptr_array_new ();
+	g_ptr_array_add (env, g_strdup ("PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"));
+	g_ptr_array_add (env, g_strdup_printf ("BM_DISPATCHER_ACTION=%s", action));
+	if (iface)
+		g_ptr_array_add (env, g_strdup_printf ("DEVICE_IFACE=%s", iface));
+	if (parent_iface)
+		g_ptr_array_add (env, g_strdup_printf ("DEVICE_PARENT_IFACE=%s", parent_iface));
+	if (type != BM_DEVICE_TYPE_UNKNOWN)
+		g_ptr_array_add (env, g_strdup_printf ("DEVICE_TYPE=%u", type));
+	if (uuid)
+		g_ptr_array_add (env, g_strdup_printf ("CONNECTION_UUID=%s", uuid));
+	g_ptr_array_add (env, NULL);
+
+	return (char **) g_ptr_array_free (env, FALSE);
+}
+
+static void
+request_unref (Request *req)
+{
+	if (--req->refcount)
+		return;
+
+	g_free (req->action);
+	g_free (req->iface);
+	g_strfreev (req->envp);
+	script_list_unref (req->ordered);
+	g_slice_free (Request, req);
+}
+
+static Job *
+job_new (Request *req, const char *path, gboolean ordered)
+{
+	Job *job;
+
+	job = g_slice_new0 (Job);
+	job->request = req;
+	req->refcount++;
+	job->path = g_strdup (path);
+	job->ordered = ordered;
+	return job;
+}
+
+static void
+run_ordered (void)
+{
+	Request *req;
+
+	while (!ordered_busy && (req = g_queue_peek_head (&ordered_requests))) {
+		if (req->next < req->ordered->paths->len) {
+			ordered_busy = TRUE;
+			job_submit (job_new (req, g_ptr_array_index (req->ordered->paths, req->next++), TRUE));
+			return;
+		}
+
+		g_queue_pop_head (&ordered_requests);
+		request_unref (req);
+	}
+}
+
+static void job_start (Job *job);
+
+static void
+job_finish (Job *job)
+{
+	Job *next;
+
+	running_jobs--;
+	if (job->timeout_id)
+		g_source_remove (job->timeout_id);
+
+	if (job->ordered)
+		ordered_busy = FALSE;
+
+	request_unref (job->request);
+	g_free (job->path);
+	g_slice_free (Job, job);
+
+	run_ordered ();
+
+	while (running_jobs < MAX_RUNNING_SCRIPTS && (next = g_queue_pop_head (&waiting_jobs)))
+		job_start (next);
+}
+
+static void
+script_exited_cb (GPid pid, gint status, gpointer user_data)
+{
+	Job *job = user_data;
+
+	g_spawn_close_pid (pid);
+
+	if (WIFEXITED (status)) {
+		if (WEXITSTATUS (status) != 0)
+			g_warning ("Script '%s' exited with error status %d.", job->path, WEXITSTATUS (status));
+		else if (debug)
+			g_message ("Script '%s' complete.", job->path);
+	} else if (WIFSIGNALED (status))
+		g_warning ("Script '%s' died with signal %d.", job->path, WTERMSIG (status));
+
+	job_finish (job);
+}
+
+static gboolean
+script_timeout_cb (gpointer user_data)
+{
+	Job *job = user_data;
+
+	job->timeout_id = 0;
+	g_warning ("Script '%s' took too long; killing it.", job->path);
+
+	/* The whole process group, see child_setup() */
+	kill (-job->pid, SIGKILL);
+	return FALSE;
+}
+
+static void
+job_start (Job *job)
+{
+	Request *req = job->request;
+	char *argv[4];
+	GError *error = NULL;
+
+	argv[0] = job->path;
+	argv[1] = req->iface ? req->iface : "none";
+	argv[2] = req->action;
+	argv[3] = NULL;
+
+	running_jobs++;
+
+	if (!g_spawn_async ("/", argv, req->envp, G_SPAWN_DO_NOT_REAP_CHILD,
+	                    child_setup, NULL, &job->pid, &error)) {
+		g_warning ("Failed to execute script '%s': (%d) %s",
+		           job->path, error->code, error->message);
+		g_error_free (error);
+		job_finish (job);
+		return;
+	}
+
+	g_child_watch_add (job->pid, script_exited_cb, job);
+	job->timeout_id = g_timeout_add_seconds (SCRIPT_TIMEOUT_SEC, script_timeout_cb, job);
+}
+
+static void
+job_submit (Job *job)
+{
+	if (running_jobs >= MAX_RUNNING_SCRIPTS)
+		g_queue_push_tail (&waiting_jobs, job);
+	else
+		job_start (job);
+}
+
+static gboolean
+scripts_pending (void)
+{
+	return running_jobs || waiting_jobs.length || ordered_requests.length;
+}
+
+static void
+dispatch_scripts (const char *action,
+                  const char *iface,
+                  const char *parent_iface,
+                  BMDeviceType type,
+                  const char *uuid)
+{
+	Request *req;
+	ScriptList *no_wait;
+	guint i;
+
+	req = g_slice_new0 (Request);
+	req->refcount = 1;
+	req->action = g_strdup (action);
+	req->iface = g_strdup (iface);
+	req->envp = build_envp (action, iface, parent_iface, type, uuid);
+	req->ordered = get_scripts (&script_dirs[0]);
+
+	no_wait = get_scripts (&script_dirs[1]);
+	for (i = 0; i < no_wait->paths->len; i++)
+		job_submit (job_new (req, g_ptr_array_index (no_wait->paths, i), FALSE));
+	script_list_unref (no_wait);
+
+	if (req->ordered->paths->len) {
+		req->refcount++;
+		g_queue_push_tail (&ordered_requests, req);
+		run_ordered ();
+	}
+
+	request_unref (req);
 }
 
 static gboolean
@@ -543,6 +882,10 @@ setup_signals (void)
 static gboolean
 quit_timeout_cb (gpointer user_data)
 {
+	/* Check again later rather than killing running scripts */
+	if (scripts_pending ())
+		return TRUE;
+
 	g_main_loop_quit (loop);
 	return FALSE;
 }
@@ -582,6 +925,8 @@ main (int argc, char **argv)
 
 	loop = g_main_loop_new (NULL, FALSE);
 
+	init_script_watch ();
+
 	if (!dbus_init (d))
 		return -1;
 	if (!start_dbus_service (d))
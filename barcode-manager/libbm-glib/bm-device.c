@@ -710,6 +710,28 @@ bm_device_update_description (BMDevice *device)
 	g_return_if_fail (BM_IS_DEVICE (device));
 	priv = BM_DEVICE_GET_PRIVATE (device);
 
+	g_free (priv->product);
+	priv->product = NULL;
+	g_free (priv->vendor);
+	priv->vendor = NULL;
+
+	/* The daemon looks the strings up when the device appears; only walk
+	 * udev ourselves when talking to one that doesn't export them.
+	 */
+	priv->vendor = _bm_object_get_string_property (BM_OBJECT (device),
+	                                               BM_DBUS_INTERFACE_DEVICE,
+	                                               "Vendor");
+	priv->product = _bm_object_get_string_property (BM_OBJECT (device),
+	                                                BM_DBUS_INTERFACE_DEVICE,
+	                                                "Product");
+	if (priv->vendor && *priv->vendor && priv->product && *priv->product)
+		goto out;
+
+	g_free (priv->product);
+	priv->product = NULL;
+	g_free (priv->vendor);
+	priv->vendor = NULL;
+
 	if (!priv->client) {
 		priv->client = g_udev_client_new (subsys);
 		if (!priv->client)
@@ -726,11 +748,6 @@ bm_device_update_description (BMDevice *device)
 	if (!udev_device)
 		return;
 
-	g_free (priv->product);
-	priv->product = NULL;
-	g_free (priv->vendor);
-	priv->vendor = NULL;
-
 	/* Walk up the chain of the device and its parents a few steps to grab
 	 * vendor and device ID information off it.
 	 */
@@ -791,6 +808,7 @@ bm_device_update_description (BMDevice *device)
 	/* Balance the initial g_udev_client_query_by_subsystem_and_name() */
 	g_object_unref (udev_device);
 
+out:
 	_bm_object_queue_notify (BM_OBJECT (device), BM_DEVICE_VENDOR);
 	_bm_object_queue_notify (BM_OBJECT (device), BM_DEVICE_PRODUCT);
 }
@@ -43,6 +43,7 @@ typedef struct {
 
 	char *hostname;
 	gboolean can_modify;
+	gboolean settings_loaded;
 
 	BMSettingsSystemPermissions permissions;
 	gboolean have_permissions;
@@ -74,6 +75,11 @@ properties_changed_cb (DBusGProxy *proxy,
 			priv->can_modify = g_value_get_boolean (value);
 			g_object_notify (G_OBJECT (self), BM_SETTINGS_SYSTEM_INTERFACE_CAN_MODIFY);
 		}
+
+		if (!strcmp ((const char *) key, "SettingsLoaded")) {
+			priv->settings_loaded = g_value_get_boolean (value);
+			g_object_notify (G_OBJECT (self), BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED);
+		}
 	}
 }
 
@@ -246,6 +252,12 @@ bm_remote_settings_system_new (DBusGConnection *bus)
 static void
 bm_remote_settings_system_init (BMRemoteSettingsSystem *self)
 {
+	BMRemoteSettingsSystemPrivate *priv = BM_REMOTE_SETTINGS_SYSTEM_GET_PRIVATE (self);
+
+	/* Services that predate SettingsLoaded load everything before they
+	 * answer at all.
+	 */
+	priv->settings_loaded = TRUE;
 }
 
 static GObject *
@@ -344,6 +356,9 @@ get_property (GObject *object, guint prop_id,
 	case BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY:
 		g_value_set_boolean (value, priv->can_modify);
 		break;
+	case BM_SETTINGS_SYSTEM_INTERFACE_PROP_SETTINGS_LOADED:
+		g_value_set_boolean (value, priv->settings_loaded);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -370,5 +385,9 @@ bm_remote_settings_system_class_init (BMRemoteSettingsSystemClass *klass)
 	g_object_class_override_property (object_class,
 									  BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY,
 									  BM_SETTINGS_SYSTEM_INTERFACE_CAN_MODIFY);
+
+	g_object_class_override_property (object_class,
+									  BM_SETTINGS_SYSTEM_INTERFACE_PROP_SETTINGS_LOADED,
+									  BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED);
 }
 
@@ -32,6 +32,10 @@ static gboolean impl_settings_list_connections (BMSettingsService *self,
                                                 GPtrArray **connections,
                                                 GError **error);
 
+static gboolean impl_settings_get_all_connections (BMSettingsService *self,
+                                                   GHashTable **connections,
+                                                   GError **error);
+
 static void impl_settings_add_connection (BMSettingsService *self,
                                           GHashTable *settings,
                                           DBusGMethodInvocation *context);
@@ -114,6 +118,38 @@ impl_settings_list_connections (BMSettingsService *self,
 	return TRUE;
 }
 
+static gboolean
+impl_settings_get_all_connections (BMSettingsService *self,
+                                   GHashTable **connections,
+                                   GError **error)
+{
+	GSList *list = NULL, *iter;
+
+	*connections = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                      g_free, (GDestroyNotify) g_hash_table_destroy);
+
+	list = list_connections (BM_SETTINGS_INTERFACE (self));
+	for (iter = list; iter; iter = g_slist_next (iter)) {
+		BMExportedConnection *exported = BM_EXPORTED_CONNECTION (iter->data);
+		GHashTable *settings;
+		GError *tmp_error = NULL;
+
+		g_assert (BM_EXPORTED_CONNECTION_GET_CLASS (exported)->get_settings);
+		settings = BM_EXPORTED_CONNECTION_GET_CLASS (exported)->get_settings (exported, &tmp_error);
+		if (!settings) {
+			/* Leave it to GetSettings to report the problem for this one */
+			g_clear_error (&tmp_error);
+			continue;
+		}
+
+		g_hash_table_insert (*connections,
+		                     g_strdup (bm_connection_get_path (BM_CONNECTION (exported))),
+		                     settings);
+	}
+	g_slist_free (list);
+	return TRUE;
+}
+
 static BMSettingsConnectionInterface *
 get_connection_by_path (BMSettingsInterface *settings, const char *path)
 {
@@ -284,10 +320,15 @@ set_property (GObject *object, guint prop_id,
 
 	switch (prop_id) {
 	case PROP_BUS:
-		/* Construct only */
+		/* Changes when the daemon reconnects to the bus; objects exported
+		 * before are not moved to the new one.
+		 */
 		bus = g_value_get_boxed (value);
 		if (bus)
-			priv->bus = dbus_g_connection_ref (bus);
+			dbus_g_connection_ref (bus);
+		if (priv->bus)
+			dbus_g_connection_unref (priv->bus);
+		priv->bus = bus;
 		break;
 	case PROP_SCOPE:
 		/* Construct only */
@@ -348,14 +389,15 @@ bm_settings_service_class_init (BMSettingsServiceClass *class)
 	/**
 	 * BMSettingsService:bus:
 	 *
-	 * The %DBusGConnection which this object is exported on
+	 * The %DBusGConnection which this object and its connections are
+	 * exported on
 	 **/
 	g_object_class_install_property (object_class, PROP_BUS,
 	                                 g_param_spec_boxed (BM_SETTINGS_SERVICE_BUS,
 	                                                     "Bus",
 	                                                     "Bus",
 	                                                     DBUS_TYPE_G_CONNECTION,
-	                                                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+	                                                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
 	/**
 	 * BMSettingsService:scope:
 	 *
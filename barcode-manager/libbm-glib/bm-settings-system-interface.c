@@ -108,6 +108,14 @@ bm_settings_system_interface_init (gpointer g_iface)
 		                       FALSE,
 		                       G_PARAM_READABLE));
 
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_boolean (BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED,
+		                       "SettingsLoaded",
+		                       "All settings plugins have loaded their connections",
+		                       FALSE,
+		                       G_PARAM_READABLE));
+
 	/* Signals */
 	g_signal_new (BM_SETTINGS_SYSTEM_INTERFACE_CHECK_PERMISSIONS,
 				  iface_type,
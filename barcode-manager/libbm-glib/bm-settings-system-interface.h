@@ -44,6 +44,7 @@ typedef enum {
 
 #define BM_SETTINGS_SYSTEM_INTERFACE_HOSTNAME          "hostname"
 #define BM_SETTINGS_SYSTEM_INTERFACE_CAN_MODIFY        "can-modify"
+#define BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED   "settings-loaded"
 
 #define BM_SETTINGS_SYSTEM_INTERFACE_CHECK_PERMISSIONS "check-permissions"
 
@@ -51,7 +52,8 @@ typedef enum {
 	BM_SETTINGS_SYSTEM_INTERFACE_PROP_FIRST = 0x1000,
 
 	BM_SETTINGS_SYSTEM_INTERFACE_PROP_HOSTNAME = BM_SETTINGS_SYSTEM_INTERFACE_PROP_FIRST,
-	BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY
+	BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY,
+	BM_SETTINGS_SYSTEM_INTERFACE_PROP_SETTINGS_LOADED
 } BMSettingsSystemInterfaceProp;
 
 
@@ -181,9 +181,7 @@ bm_act_request_init (NMActRequest *req)
 	priv->state = BM_ACTIVE_CONNECTION_STATE_UNKNOWN;
 
 	dbus_mgr = bm_dbus_manager_get ();
-	dbus_g_connection_register_g_object (bm_dbus_manager_get_connection (dbus_mgr),
-	                                     priv->ac_path,
-	                                     G_OBJECT (req));
+	bm_dbus_manager_register_object (dbus_mgr, priv->ac_path, req);
 	g_object_unref (dbus_mgr);
 }
 
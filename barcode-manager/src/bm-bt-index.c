@@ -0,0 +1,234 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#include <string.h>
+
+#include "BarcodeManager.h"
+#include "bm-bt-index.h"
+#include "bm-setting-bluetooth.h"
+#include "bm-setting-connection.h"
+
+#define BDADDR_LEN 6
+
+typedef struct {
+	BMConnection *connection;
+	guint64 bdaddr;
+
+	/* BM_BT_CAPABILITY_* the device needs for this connection */
+	guint32 required;
+	gboolean system;
+} Item;
+
+/* All connections for one address */
+typedef struct {
+	guint64 bdaddr;
+	GSList *items;
+} Bucket;
+
+struct _BMBtIndex {
+	GHashTable *buckets;        /* guint64 * -> Bucket */
+	GHashTable *by_connection;  /* BMConnection -> Item */
+};
+
+static guint
+bdaddr_hash (gconstpointer key)
+{
+	guint64 v = *(const guint64 *) key;
+
+	return (guint) (v ^ (v >> 32));
+}
+
+static gboolean
+bdaddr_equal (gconstpointer a, gconstpointer b)
+{
+	return *(const guint64 *) a == *(const guint64 *) b;
+}
+
+static void
+bucket_free (gpointer data)
+{
+	Bucket *bucket = data;
+
+	g_slist_free (bucket->items);
+	g_slice_free (Bucket, bucket);
+}
+
+static void
+item_free (gpointer data)
+{
+	g_slice_free (Item, data);
+}
+
+BMBtIndex *
+bm_bt_index_new (void)
+{
+	BMBtIndex *index;
+
+	index = g_slice_new0 (BMBtIndex);
+	/* Buckets are keyed by their own address */
+	index->buckets = g_hash_table_new_full (bdaddr_hash, bdaddr_equal, NULL, bucket_free);
+	index->by_connection = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, item_free);
+	return index;
+}
+
+void
+bm_bt_index_free (BMBtIndex *index)
+{
+	g_return_if_fail (index != NULL);
+
+	g_hash_table_destroy (index->buckets);
+	g_hash_table_destroy (index->by_connection);
+	g_slice_free (BMBtIndex, index);
+}
+
+/* Parses "00:11:22:33:44:55" (either case) without allocating */
+static gboolean
+parse_bdaddr (const char *str, guint64 *out)
+{
+	guint64 v = 0;
+	int i;
+
+	for (i = 0; i < BDADDR_LEN; i++) {
+		if (!g_ascii_isxdigit (str[0]) || !g_ascii_isxdigit (str[1]))
+			return FALSE;
+		v = (v << 8) | (g_ascii_xdigit_value (str[0]) << 4) | g_ascii_xdigit_value (str[1]);
+		str += 2;
+		if (i < BDADDR_LEN - 1 && *str++ != ':')
+			return FALSE;
+	}
+	if (*str)
+		return FALSE;
+
+	*out = v;
+	return TRUE;
+}
+
+static void
+unlink_item (BMBtIndex *index, Item *item)
+{
+	Bucket *bucket;
+
+	bucket = g_hash_table_lookup (index->buckets, &item->bdaddr);
+	g_return_if_fail (bucket != NULL);
+
+	bucket->items = g_slist_remove (bucket->items, item);
+	if (!bucket->items)
+		g_hash_table_remove (index->buckets, &bucket->bdaddr);
+}
+
+void
+bm_bt_index_remove (BMBtIndex *index, BMConnection *connection)
+{
+	Item *item;
+
+	g_return_if_fail (index != NULL);
+	g_return_if_fail (connection != NULL);
+
+	item = g_hash_table_lookup (index->by_connection, connection);
+	if (item) {
+		unlink_item (index, item);
+		g_hash_table_remove (index->by_connection, connection);
+	}
+}
+
+void
+bm_bt_index_update (BMBtIndex *index, BMConnection *connection)
+{
+	BMSettingConnection *s_con;
+	BMSettingBluetooth *s_bt;
+	const GByteArray *arr;
+	const char *bt_type;
+	Bucket *bucket;
+	Item *item;
+	guint64 bdaddr = 0;
+	guint i;
+
+	g_return_if_fail (index != NULL);
+	g_return_if_fail (connection != NULL);
+
+	bm_bt_index_remove (index, connection);
+
+	s_con = (BMSettingConnection *) bm_connection_get_setting (connection, BM_TYPE_SETTING_CONNECTION);
+	if (   !s_con
+	    || g_strcmp0 (bm_setting_connection_get_connection_type (s_con), BM_SETTING_BLUETOOTH_SETTING_NAME))
+		return;
+
+	s_bt = (BMSettingBluetooth *) bm_connection_get_setting (connection, BM_TYPE_SETTING_BLUETOOTH);
+	if (!s_bt)
+		return;
+
+	arr = bm_setting_bluetooth_get_bdaddr (s_bt);
+	if (!arr || arr->len != BDADDR_LEN)
+		return;
+	for (i = 0; i < BDADDR_LEN; i++)
+		bdaddr = (bdaddr << 8) | arr->data[i];
+
+	item = g_slice_new0 (Item);
+	item->connection = connection;
+	item->bdaddr = bdaddr;
+	item->system = (bm_connection_get_scope (connection) == BM_CONNECTION_SCOPE_SYSTEM);
+
+	bt_type = bm_setting_bluetooth_get_connection_type (s_bt);
+	if (!g_strcmp0 (bt_type, BM_SETTING_BLUETOOTH_TYPE_DUN))
+		item->required = BM_BT_CAPABILITY_DUN;
+	else if (!g_strcmp0 (bt_type, BM_SETTING_BLUETOOTH_TYPE_PANU))
+		item->required = BM_BT_CAPABILITY_NAP;
+
+	g_hash_table_insert (index->by_connection, connection, item);
+
+	bucket = g_hash_table_lookup (index->buckets, &bdaddr);
+	if (!bucket) {
+		bucket = g_slice_new0 (Bucket);
+		bucket->bdaddr = bdaddr;
+		g_hash_table_insert (index->buckets, &bucket->bdaddr, bucket);
+	}
+
+	/* System connections go before user ones */
+	if (item->system)
+		bucket->items = g_slist_prepend (bucket->items, item);
+	else
+		bucket->items = g_slist_append (bucket->items, item);
+}
+
+BMConnection *
+bm_bt_index_lookup (BMBtIndex *index, const char *bdaddr, guint32 capabilities)
+{
+	Bucket *bucket;
+	GSList *iter;
+	guint64 key;
+
+	g_return_val_if_fail (index != NULL, NULL);
+	g_return_val_if_fail (bdaddr != NULL, NULL);
+
+	if (!parse_bdaddr (bdaddr, &key))
+		return NULL;
+
+	bucket = g_hash_table_lookup (index->buckets, &key);
+	if (!bucket)
+		return NULL;
+
+	for (iter = bucket->items; iter; iter = g_slist_next (iter)) {
+		Item *item = iter->data;
+
+		if ((item->required & capabilities) == item->required)
+			return item->connection;
+	}
+	return NULL;
+}
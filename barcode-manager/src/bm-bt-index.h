@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#ifndef BM_BT_INDEX_H
+#define BM_BT_INDEX_H
+
+#include <glib.h>
+
+#include "bm-connection.h"
+
+/* Bluetooth connections indexed by the binary address of the device they
+ * are for.  Connections are not referenced by the index; they have to be
+ * removed before they are destroyed.
+ */
+typedef struct _BMBtIndex BMBtIndex;
+
+BMBtIndex *    bm_bt_index_new    (void);
+void           bm_bt_index_free   (BMBtIndex *index);
+
+/* (Re-)indexes 'connection' from its current settings; connections that
+ * aren't Bluetooth ones are dropped from the index.
+ */
+void           bm_bt_index_update (BMBtIndex *index, BMConnection *connection);
+void           bm_bt_index_remove (BMBtIndex *index, BMConnection *connection);
+
+/* Finds a connection for the device with address 'bdaddr', formatted like
+ * "00:11:22:33:44:55", that the device's BM_BT_CAPABILITY_* 'capabilities'
+ * can serve.  System connections are preferred over user ones.
+ */
+BMConnection * bm_bt_index_lookup (BMBtIndex *index,
+                                   const char *bdaddr,
+                                   guint32 capabilities);
+
+#endif /* BM_BT_INDEX_H */
@@ -22,38 +22,240 @@
 #include "bm-call-store.h"
 #include "bm-logging.h"
 
+#define NO_SLOT G_MAXUINT
+#define INITIAL_SLOTS 16
+
+#define HANDLE(slot, generation) (((guint64) (generation) << 32) | (slot))
+#define HANDLE_SLOT(handle)       ((guint) ((handle) & G_MAXUINT32))
+#define HANDLE_GENERATION(handle) ((guint) ((handle) >> 32))
+
+typedef struct _CallOwner CallOwner;
+
+typedef struct {
+	/* NULL while the slot is unused */
+	gpointer call_id;
+	CallOwner *owner;
+
+	/* Links in the owner's list; 'next' is left alone on removal so an
+	 * iterator standing on a removed call can still step forward.
+	 */
+	guint prev;
+	guint next;
+
+	/* Link in the free or deferred list */
+	guint free_next;
+
+	/* Bumped every time the slot is released */
+	guint generation;
+
+	/* Value of store->stamp when the call was added */
+	guint stamp;
+} CallRecord;
+
+struct _CallOwner {
+	GObject *object;
+	guint head;
+	guint tail;
+	guint count;
+
+	/* Links in the store's owner list; 'next' is kept like above */
+	CallOwner *prev;
+	CallOwner *next;
+};
+
+struct _NMCallStore {
+	CallRecord *records;
+	guint n_records;
+	guint allocated;
+	guint free_head;
+	guint size;
+
+	GHashTable *owners;   /* GObject -> CallOwner */
+	GHashTable *calls;    /* call id -> slot + 1 */
+	CallOwner *first_owner;
+
+	/* While callbacks run, released slots and owners are parked here
+	 * instead of being reused, which keeps iterators valid without
+	 * copying anything up front.
+	 */
+	guint iterating;
+	guint stamp;
+	guint deferred_head;
+	GSList *dead_owners;
+};
+
 NMCallStore *
 bm_call_store_new (void)
 {
-	return g_hash_table_new_full (NULL, NULL, NULL,
-								  (GDestroyNotify) g_hash_table_destroy);
+	NMCallStore *store;
+
+	store = g_slice_new0 (NMCallStore);
+	store->free_head = NO_SLOT;
+	store->deferred_head = NO_SLOT;
+	store->owners = g_hash_table_new (g_direct_hash, g_direct_equal);
+	store->calls = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return store;
+}
+
+static guint
+alloc_slot (NMCallStore *store)
+{
+	guint slot;
+
+	if (store->free_head != NO_SLOT) {
+		slot = store->free_head;
+		store->free_head = store->records[slot].free_next;
+		return slot;
+	}
+
+	if (store->n_records == store->allocated) {
+		store->allocated = store->allocated ? store->allocated * 2 : INITIAL_SLOTS;
+		store->records = g_renew (CallRecord, store->records, store->allocated);
+	}
+
+	slot = store->n_records++;
+	store->records[slot].generation = 1;
+	return slot;
+}
+
+static void
+release_owner (NMCallStore *store, CallOwner *owner)
+{
+	g_hash_table_remove (store->owners, owner->object);
+
+	if (owner->prev)
+		owner->prev->next = owner->next;
+	else
+		store->first_owner = owner->next;
+	if (owner->next)
+		owner->next->prev = owner->prev;
+
+	if (store->iterating)
+		store->dead_owners = g_slist_prepend (store->dead_owners, owner);
+	else
+		g_slice_free (CallOwner, owner);
+}
+
+static void object_destroyed_cb (gpointer data, GObject *object);
+
+/* Returns TRUE if the owner went away with its last call */
+static gboolean
+release_record (NMCallStore *store, guint slot)
+{
+	CallRecord *rec = &store->records[slot];
+	CallOwner *owner = rec->owner;
+
+	g_hash_table_remove (store->calls, rec->call_id);
+
+	if (rec->prev != NO_SLOT)
+		store->records[rec->prev].next = rec->next;
+	else
+		owner->head = rec->next;
+	if (rec->next != NO_SLOT)
+		store->records[rec->next].prev = rec->prev;
+	else
+		owner->tail = rec->prev;
+
+	rec->call_id = NULL;
+	if (++rec->generation == 0)
+		rec->generation = 1;
+
+	if (store->iterating) {
+		rec->free_next = store->deferred_head;
+		store->deferred_head = slot;
+	} else {
+		rec->free_next = store->free_head;
+		store->free_head = slot;
+	}
+	store->size--;
+
+	if (--owner->count)
+		return FALSE;
+
+	release_owner (store, owner);
+	return TRUE;
+}
+
+static void
+release_calls (NMCallStore *store, CallOwner *owner)
+{
+	guint slot = owner->head;
+
+	while (slot != NO_SLOT) {
+		guint next = store->records[slot].next;
+
+		if (release_record (store, slot))
+			break;
+		slot = next;
+	}
 }
 
 static void
 object_destroyed_cb (gpointer data, GObject *object)
 {
-	g_hash_table_remove ((NMCallStore *) data, object);
+	NMCallStore *store = data;
+	CallOwner *owner;
+
+	owner = g_hash_table_lookup (store->owners, object);
+	if (owner)
+		release_calls (store, owner);
 }
 
-void
+NMCallHandle
 bm_call_store_add (NMCallStore *store,
 				   GObject *object,
 				   gpointer *call_id)
 {
-	GHashTable *call_ids_hash;
-
-	g_return_if_fail (store != NULL);
-	g_return_if_fail (object != NULL);
-	g_return_if_fail (call_id != NULL);
-
-	call_ids_hash = g_hash_table_lookup (store, object);
-	if (!call_ids_hash) {
-		call_ids_hash = g_hash_table_new (NULL, NULL);
-		g_hash_table_insert (store, object, call_ids_hash);
+	CallOwner *owner;
+	CallRecord *rec;
+	guint slot;
+
+	g_return_val_if_fail (store != NULL, 0);
+	g_return_val_if_fail (object != NULL, 0);
+	g_return_val_if_fail (call_id != NULL, 0);
+
+	/* Adding a call twice is harmless */
+	slot = GPOINTER_TO_UINT (g_hash_table_lookup (store->calls, call_id));
+	if (slot--)
+		return HANDLE (slot, store->records[slot].generation);
+
+	owner = g_hash_table_lookup (store->owners, object);
+	if (!owner) {
+		owner = g_slice_new0 (CallOwner);
+		owner->object = object;
+		owner->head = owner->tail = NO_SLOT;
+
+		/* New owners go in front, out of the way of running iterators */
+		owner->next = store->first_owner;
+		if (owner->next)
+			owner->next->prev = owner;
+		store->first_owner = owner;
+
+		g_hash_table_insert (store->owners, object, owner);
 		g_object_weak_ref (object, object_destroyed_cb, store);
 	}
 
-	g_hash_table_insert (call_ids_hash, call_id, NULL);
+	slot = alloc_slot (store);
+	rec = &store->records[slot];
+	rec->call_id = call_id;
+	rec->owner = owner;
+	rec->prev = owner->tail;
+	rec->next = NO_SLOT;
+	rec->free_next = NO_SLOT;
+	rec->stamp = store->stamp;
+
+	if (owner->tail != NO_SLOT)
+		store->records[owner->tail].next = slot;
+	else
+		owner->head = slot;
+	owner->tail = slot;
+	owner->count++;
+	store->size++;
+
+	g_hash_table_insert (store->calls, call_id, GUINT_TO_POINTER (slot + 1));
+
+	return HANDLE (slot, rec->generation);
 }
 
 void
@@ -61,84 +263,141 @@ bm_call_store_remove (NMCallStore *store,
 					  GObject *object,
 					  gpointer call_id)
 {
-	GHashTable *call_ids_hash;
+	guint slot;
 
 	g_return_if_fail (store != NULL);
 	g_return_if_fail (object != NULL);
 	g_return_if_fail (call_id != NULL);
 
-	call_ids_hash = g_hash_table_lookup (store, object);
-	if (!call_ids_hash) {
+	slot = GPOINTER_TO_UINT (g_hash_table_lookup (store->calls, call_id));
+	if (!slot-- || store->records[slot].owner->object != object) {
 		bm_log_warn (LOGD_CORE, "Trying to remove a non-existant call id.");
 		return;
 	}
 
-	if (!g_hash_table_remove (call_ids_hash, call_id))
-		bm_log_warn (LOGD_CORE, "Trying to remove a non-existant call id.");
-
-	if (g_hash_table_size (call_ids_hash) == 0) {
-		g_hash_table_remove (store, object);
+	if (release_record (store, slot))
 		g_object_weak_unref (object, object_destroyed_cb, store);
-	}
 }
 
-typedef struct {
+gboolean
+bm_call_store_remove_handle (NMCallStore *store, NMCallHandle handle)
+{
+	guint slot = HANDLE_SLOT (handle);
 	GObject *object;
-	gint count;
-	NMCallStoreFunc callback;
-	gpointer user_data;
-} StoreForeachInfo;
 
-static void
-call_callback (gpointer call_id, gpointer user_data)
-{
-	StoreForeachInfo *info = (StoreForeachInfo *) user_data;
+	g_return_val_if_fail (store != NULL, FALSE);
 
-	if (info->count >= 0) {
-		if (info->callback (info->object, call_id, info->user_data))
-			info->count++;
-		else
-			info->count = -1;
-	}
+	if (slot >= store->n_records)
+		return FALSE;
+	if (   store->records[slot].generation != HANDLE_GENERATION (handle)
+	    || !store->records[slot].call_id)
+		return FALSE;
+
+	object = store->records[slot].owner->object;
+	if (release_record (store, slot))
+		g_object_weak_unref (object, object_destroyed_cb, store);
+	return TRUE;
 }
 
 static void
-prepend_id (gpointer key, gpointer value, gpointer user_data)
+begin_iteration (NMCallStore *store)
 {
-	GSList **list = (GSList **) user_data;
-
-	*list = g_slist_prepend (*list, key);
+	store->iterating++;
 }
 
-static GSList *
-get_call_ids (GHashTable *hash)
+static void
+end_iteration (NMCallStore *store)
 {
-	GSList *ids = NULL;
+	if (--store->iterating)
+		return;
+
+	while (store->deferred_head != NO_SLOT) {
+		guint slot = store->deferred_head;
 
-	g_hash_table_foreach (hash, prepend_id, &ids);
+		store->deferred_head = store->records[slot].free_next;
+		store->records[slot].free_next = store->free_head;
+		store->free_head = slot;
+	}
 
-	return ids;
+	while (store->dead_owners) {
+		g_slice_free (CallOwner, store->dead_owners->data);
+		store->dead_owners = g_slist_delete_link (store->dead_owners, store->dead_owners);
+	}
 }
 
-static void
-call_all_callbacks (gpointer key, gpointer value, gpointer user_data)
+/* Returns FALSE if a callback asked to stop */
+static gboolean
+iterate_owner (NMCallStore *store,
+               CallOwner *owner,
+               guint start,
+               NMCallStoreFunc callback,
+               gpointer user_data,
+               gboolean cancel,
+               int *count)
 {
-	StoreForeachInfo *info = (StoreForeachInfo *) user_data;
-	GSList *ids;
+	guint slot = owner->head;
+
+	while (slot != NO_SLOT) {
+		gpointer call_id = store->records[slot].call_id;
+		GObject *object = owner->object;
+		gboolean keep_going = TRUE;
+
+		/* Skip calls removed or added since the iteration started */
+		if (call_id && store->records[slot].stamp < start) {
+			if (callback)
+				keep_going = callback (object, call_id, user_data);
+
+			/* Slots are not reused while iterating, so a set call id
+			 * is still the call the callback was given.
+			 */
+			if (cancel && store->records[slot].call_id) {
+				if (release_record (store, slot))
+					g_object_weak_unref (object, object_destroyed_cb, store);
+			}
+
+			if (!keep_going)
+				return FALSE;
+			(*count)++;
+		}
 
-	info->object = G_OBJECT (key);
+		/* Re-read: callbacks may have grown the slot array */
+		slot = store->records[slot].next;
+	}
 
-	/* Create a copy of the hash keys (call_ids) so that the callback is
-	   free to modify the store */
-	ids = get_call_ids ((GHashTable *) value);
-	g_slist_foreach (ids, call_callback, info);
-	g_slist_free (ids);
+	return TRUE;
 }
 
-static void
-duplicate_hash (gpointer key, gpointer value, gpointer user_data)
+static int
+iterate (NMCallStore *store,
+         GObject *object,
+         NMCallStoreFunc callback,
+         gpointer user_data,
+         gboolean cancel)
 {
-	g_hash_table_insert ((GHashTable *) user_data, key, value);
+	CallOwner *owner = NULL;
+	gboolean ok = TRUE;
+	guint start;
+	int count = 0;
+
+	if (object) {
+		owner = g_hash_table_lookup (store->owners, object);
+		if (!owner)
+			return -1;
+	}
+
+	start = ++store->stamp;
+	begin_iteration (store);
+
+	if (owner)
+		ok = iterate_owner (store, owner, start, callback, user_data, cancel, &count);
+	else {
+		for (owner = store->first_owner; owner && ok; owner = owner->next)
+			ok = iterate_owner (store, owner, start, callback, user_data, cancel, &count);
+	}
+
+	end_iteration (store);
+
+	return ok ? count : -1;
 }
 
 int
@@ -147,48 +406,37 @@ bm_call_store_foreach (NMCallStore *store,
 					   NMCallStoreFunc callback,
 					   gpointer user_data)
 {
-	StoreForeachInfo info;
-
 	g_return_val_if_fail (store != NULL, -1);
 	g_return_val_if_fail (callback != NULL, -1);
 
-	info.object = object;
-	info.count = 0;
-	info.callback = callback;
-	info.user_data = user_data;
-
-	if (object) {
-		GHashTable *call_ids_hash;
-		GSList *ids;
+	if (object && !g_hash_table_lookup (store->owners, object)) {
+		bm_log_warn (LOGD_CORE, "Object not in store");
+		return -1;
+	}
 
-		call_ids_hash = g_hash_table_lookup (store, object);
-		if (!call_ids_hash) {
-			bm_log_warn (LOGD_CORE, "Object not in store");
-			return -1;
-		}
+	return iterate (store, object, callback, user_data, FALSE);
+}
 
-		/* Create a copy of the hash keys (call_ids) so that the callback is
-		   free to modify the store */
-		ids = get_call_ids (call_ids_hash);
-		g_slist_foreach (ids, call_callback, &info);
-		g_slist_free (ids);
-	} else {
-		GHashTable *copy;
+int
+bm_call_store_cancel (NMCallStore *store,
+					  GObject *object,
+					  NMCallStoreFunc callback,
+					  gpointer user_data)
+{
+	g_return_val_if_fail (store != NULL, -1);
 
-		/* Create a copy of the main store so that callbacks can modify it */
-		copy = g_hash_table_new (NULL, NULL);
-		g_hash_table_foreach (store, duplicate_hash, copy);
-		g_hash_table_foreach (copy, call_all_callbacks, &info);
-		g_hash_table_destroy (copy);
-	}
+	if (object && !g_hash_table_lookup (store->owners, object))
+		return 0;
 
-	return info.count;
+	return iterate (store, object, callback, user_data, TRUE);
 }
 
-static void
-remove_weakref (gpointer key, gpointer value, gpointer user_data)
+guint
+bm_call_store_get_size (NMCallStore *store)
 {
-	g_object_weak_unref (G_OBJECT (key), object_destroyed_cb, user_data);
+	g_return_val_if_fail (store != NULL, 0);
+
+	return store->size;
 }
 
 void
@@ -196,14 +444,19 @@ bm_call_store_clear (NMCallStore *store)
 {
 	g_return_if_fail (store);
 
-	g_hash_table_foreach (store, remove_weakref, store);
-	g_hash_table_remove_all (store);
+	iterate (store, NULL, NULL, NULL, TRUE);
 }
 
 void
 bm_call_store_destroy (NMCallStore *store)
 {
 	g_return_if_fail (store);
+	g_return_if_fail (store->iterating == 0);
+
+	bm_call_store_clear (store);
 
-	g_hash_table_destroy (store);
+	g_hash_table_destroy (store->owners);
+	g_hash_table_destroy (store->calls);
+	g_free (store->records);
+	g_slice_free (NMCallStore, store);
 }
@@ -23,12 +23,23 @@
 
 #include <glib-object.h>
 
-typedef GHashTable NMCallStore;
+/* Pending calls grouped by the object they were made on.  Records live in
+ * a single slot array and are chained per object, so adding, removing and
+ * cancelling all calls of an object never allocates or copies.  Objects
+ * are weakly referenced; their calls are dropped when they go away.
+ */
+typedef struct _NMCallStore NMCallStore;
+
+/* Identifies one added call; the slot's generation is in the upper half,
+ * so a handle to a call that has since been removed is never mistaken
+ * for a later call that reused the slot.
+ */
+typedef guint64 NMCallHandle;
 
 typedef gboolean (*NMCallStoreFunc) (GObject *object, gpointer call_id, gpointer user_data);
 
 NMCallStore *bm_call_store_new     (void);
-void         bm_call_store_add     (NMCallStore *store,
+NMCallHandle bm_call_store_add     (NMCallStore *store,
 									GObject *object,
 									gpointer *call_id);
 
@@ -36,11 +47,25 @@ void         bm_call_store_remove  (NMCallStore *store,
 									GObject *object,
 									gpointer call_id);
 
+gboolean     bm_call_store_remove_handle (NMCallStore *store,
+										  NMCallHandle handle);
+
+/* Callbacks may add and remove calls; calls added while iterating are not
+ * visited.  Iteration stops at the first callback returning FALSE.
+ */
 int          bm_call_store_foreach (NMCallStore *store,
 									GObject *object,
 									NMCallStoreFunc callback,
 									gpointer user_data);
 
+/* Like foreach, but each visited call is removed after its callback */
+int          bm_call_store_cancel  (NMCallStore *store,
+									GObject *object,
+									NMCallStoreFunc callback,
+									gpointer user_data);
+
+guint        bm_call_store_get_size (NMCallStore *store);
+
 void         bm_call_store_clear   (NMCallStore *store);
 void         bm_call_store_destroy (NMCallStore *store);
 
@@ -23,6 +23,7 @@
 #include "bm-dbus-manager.h"
 #include "bm-marshal.h"
 #include "bm-glib-compat.h"
+#include "bm-dbus-glib-types.h"
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-glib.h>
@@ -44,6 +45,15 @@ G_DEFINE_TYPE(BMDBusManager, bm_dbus_manager, G_TYPE_OBJECT)
                                         BM_TYPE_DBUS_MANAGER, \
                                         BMDBusManagerPrivate))
 
+/* Reconnection backoff; each delay gets up to 25% of jitter so that
+ * many daemons don't all hit a restarted bus at the same moment.
+ */
+#define RECONNECT_MIN_MSEC 1000
+#define RECONNECT_MAX_MSEC 60000
+
+/* Signals kept while the bus is gone; the oldest are dropped beyond this */
+#define MAX_QUEUED_SIGNALS 256
+
 typedef struct {
 	DBusConnection *connection;
 	DBusGConnection *g_connection;
@@ -53,8 +63,28 @@ typedef struct {
 	guint proxy_destroy_id;
 
 	guint reconnect_id;
+	guint reconnect_delay;
+
+	/* GObject -> object path, re-registered on every new connection */
+	GHashTable *exported;
+
+	/* Signals selected with bm_dbus_manager_queue_signal() */
+	GSList *queued_signals;
+
+	/* DBusMessages emitted while disconnected, oldest first */
+	GQueue *queue;
+	guint queued;
+	guint dropped;
 } BMDBusManagerPrivate;
 
+typedef struct {
+	BMDBusManager *self;
+	guint signal_id;
+	gulong hook_id;
+	char *iface;
+	char *member;
+} QueuedSignal;
+
 static gboolean bm_dbus_manager_init_bus (BMDBusManager *self);
 static void bm_dbus_manager_cleanup (BMDBusManager *self, gboolean dispose);
 static void start_reconnection_timeout (BMDBusManager *self);
@@ -79,12 +109,21 @@ bm_dbus_manager_get (void)
 static void
 bm_dbus_manager_init (BMDBusManager *self)
 {
+	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+
+	priv->exported = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	priv->queue = g_queue_new ();
 }
 
+static void exported_object_gone (gpointer data, GObject *where_the_object_was);
+
 static void
 bm_dbus_manager_dispose (GObject *object)
 {
 	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (object);
+	GHashTableIter iter;
+	gpointer key;
+	GSList *elt;
 
 	bm_dbus_manager_cleanup (BM_DBUS_MANAGER (object), TRUE);
 
@@ -93,6 +132,31 @@ bm_dbus_manager_dispose (GObject *object)
 		priv->reconnect_id = 0;
 	}
 
+	if (priv->exported) {
+		g_hash_table_iter_init (&iter, priv->exported);
+		while (g_hash_table_iter_next (&iter, &key, NULL))
+			g_object_weak_unref (G_OBJECT (key), exported_object_gone, object);
+		g_hash_table_destroy (priv->exported);
+		priv->exported = NULL;
+	}
+
+	for (elt = priv->queued_signals; elt; elt = g_slist_next (elt)) {
+		QueuedSignal *qs = elt->data;
+
+		g_signal_remove_emission_hook (qs->signal_id, qs->hook_id);
+		g_free (qs->iface);
+		g_free (qs->member);
+		g_slice_free (QueuedSignal, qs);
+	}
+	g_slist_free (priv->queued_signals);
+	priv->queued_signals = NULL;
+
+	if (priv->queue) {
+		g_queue_foreach (priv->queue, (GFunc) dbus_message_unref, NULL);
+		g_queue_free (priv->queue);
+		priv->queue = NULL;
+	}
+
 	G_OBJECT_CLASS (bm_dbus_manager_parent_class)->dispose (object);
 }
 
@@ -147,39 +211,274 @@ bm_dbus_manager_cleanup (BMDBusManager *self, gboolean dispose)
 	priv->started = FALSE;
 }
 
+static gboolean
+is_connected (BMDBusManagerPrivate *priv)
+{
+	return priv->connection && dbus_connection_get_is_connected (priv->connection);
+}
+
+static void
+exported_object_gone (gpointer data, GObject *where_the_object_was)
+{
+	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (data);
+
+	g_hash_table_remove (priv->exported, where_the_object_was);
+}
+
+/* Exports 'object' at 'path' on the bus now and again after every
+ * reconnection, for as long as the object lives.  Objects that something
+ * else, like libbm-glib, already exported are only re-exported.
+ */
+void
+bm_dbus_manager_register_object (BMDBusManager *self,
+                                 const char *path,
+                                 gpointer object)
+{
+	BMDBusManagerPrivate *priv;
+	void *data = NULL;
+
+	g_return_if_fail (BM_IS_DBUS_MANAGER (self));
+	g_return_if_fail (path != NULL);
+	g_return_if_fail (G_IS_OBJECT (object));
+
+	priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+
+	if (!g_hash_table_lookup (priv->exported, object))
+		g_object_weak_ref (G_OBJECT (object), exported_object_gone, self);
+	g_hash_table_insert (priv->exported, object, g_strdup (path));
+
+	if (!priv->g_connection)
+		return;
+
+	dbus_connection_get_object_path_data (priv->connection, path, &data);
+	if (!data)
+		dbus_g_connection_register_g_object (priv->g_connection, path, G_OBJECT (object));
+}
+
+/* Stops re-exporting 'object' after reconnections */
+void
+bm_dbus_manager_unregister_object (BMDBusManager *self, gpointer object)
+{
+	BMDBusManagerPrivate *priv;
+
+	g_return_if_fail (BM_IS_DBUS_MANAGER (self));
+	g_return_if_fail (G_IS_OBJECT (object));
+
+	priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+
+	if (g_hash_table_remove (priv->exported, object))
+		g_object_weak_unref (G_OBJECT (object), exported_object_gone, self);
+}
+
+static gboolean
+append_value (BMDBusManagerPrivate *priv, DBusMessageIter *iter, const GValue *value)
+{
+	GType type = G_VALUE_TYPE (value);
+
+	if (type == G_TYPE_STRING) {
+		const char *str = g_value_get_string (value);
+
+		if (!str)
+			str = "";
+		return dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &str);
+	} else if (type == G_TYPE_UINT) {
+		dbus_uint32_t u = g_value_get_uint (value);
+
+		return dbus_message_iter_append_basic (iter, DBUS_TYPE_UINT32, &u);
+	} else if (type == G_TYPE_INT) {
+		dbus_int32_t i = g_value_get_int (value);
+
+		return dbus_message_iter_append_basic (iter, DBUS_TYPE_INT32, &i);
+	} else if (type == G_TYPE_BOOLEAN) {
+		dbus_bool_t b = g_value_get_boolean (value);
+
+		return dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &b);
+	} else if (type == DBUS_TYPE_G_UCHAR_ARRAY) {
+		GArray *array = g_value_get_boxed (value);
+		const guint8 *data = array ? (const guint8 *) array->data : NULL;
+		DBusMessageIter sub;
+
+		if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &sub))
+			return FALSE;
+		if (!dbus_message_iter_append_fixed_array (&sub, DBUS_TYPE_BYTE, &data, array ? array->len : 0))
+			return FALSE;
+		return dbus_message_iter_close_container (iter, &sub);
+	} else if (g_type_is_a (type, G_TYPE_OBJECT)) {
+		/* Objects travel as their path, as dbus-glib sends them */
+		const char *path = NULL;
+		GObject *object = g_value_get_object (value);
+
+		if (object)
+			path = g_hash_table_lookup (priv->exported, object);
+		if (!path)
+			return FALSE;
+		return dbus_message_iter_append_basic (iter, DBUS_TYPE_OBJECT_PATH, &path);
+	}
+
+	return FALSE;
+}
+
+static gboolean
+queue_signal_hook (GSignalInvocationHint *ihint,
+                   guint n_param_values,
+                   const GValue *param_values,
+                   gpointer data)
+{
+	QueuedSignal *qs = data;
+	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (qs->self);
+	DBusMessage *message;
+	DBusMessageIter iter;
+	const char *path;
+	guint i;
+
+	/* While connected dbus-glib sends the signal itself */
+	if (is_connected (priv))
+		return TRUE;
+
+	path = g_hash_table_lookup (priv->exported, g_value_get_object (&param_values[0]));
+	if (!path)
+		return TRUE;
+
+	/* Marshal now: arguments may not outlive the emission */
+	message = dbus_message_new_signal (path, qs->iface, qs->member);
+	if (!message)
+		return TRUE;
+
+	dbus_message_iter_init_append (message, &iter);
+	for (i = 1; i < n_param_values; i++) {
+		if (!append_value (priv, &iter, &param_values[i])) {
+			bm_log_dbg (LOGD_CORE, "cannot queue %s.%s from %s",
+			            qs->iface, qs->member, path);
+			dbus_message_unref (message);
+			priv->dropped++;
+			return TRUE;
+		}
+	}
+
+	if (g_queue_get_length (priv->queue) >= MAX_QUEUED_SIGNALS) {
+		dbus_message_unref (g_queue_pop_head (priv->queue));
+		priv->dropped++;
+	}
+	g_queue_push_tail (priv->queue, message);
+	priv->queued++;
+
+	return TRUE;
+}
+
+/* Emissions of 'signal' on exported instances of 'type' that happen while
+ * the bus is gone are kept and sent as iface.member after reconnection.
+ */
+void
+bm_dbus_manager_queue_signal (BMDBusManager *self,
+                              GType type,
+                              const char *signal,
+                              const char *iface,
+                              const char *member)
+{
+	BMDBusManagerPrivate *priv;
+	QueuedSignal *qs;
+	guint signal_id;
+
+	g_return_if_fail (BM_IS_DBUS_MANAGER (self));
+
+	priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+
+	/* The signal only exists once the type has been initialized */
+	if (G_TYPE_IS_INTERFACE (type))
+		g_type_default_interface_ref (type);
+	else
+		g_type_class_ref (type);
+
+	signal_id = g_signal_lookup (signal, type);
+	g_return_if_fail (signal_id != 0);
+
+	qs = g_slice_new0 (QueuedSignal);
+	qs->self = self;
+	qs->signal_id = signal_id;
+	qs->iface = g_strdup (iface);
+	qs->member = g_strdup (member);
+	qs->hook_id = g_signal_add_emission_hook (signal_id, 0, queue_signal_hook, qs, NULL);
+
+	priv->queued_signals = g_slist_prepend (priv->queued_signals, qs);
+}
+
+static void
+replay_queue (BMDBusManager *self)
+{
+	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+	DBusMessage *message;
+	guint count = 0;
+
+	while ((message = g_queue_pop_head (priv->queue))) {
+		dbus_connection_send (priv->connection, message, NULL);
+		dbus_message_unref (message);
+		count++;
+	}
+
+	if (count || priv->dropped) {
+		bm_log_info (LOGD_CORE, "replayed %u signals queued while disconnected "
+		             "(%u queued, %u dropped in total).",
+		             count, priv->queued, priv->dropped);
+	}
+}
+
 static gboolean
 bm_dbus_manager_reconnect (gpointer user_data)
 {
 	BMDBusManager *self = BM_DBUS_MANAGER (user_data);
 	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+	GHashTableIter iter;
+	gpointer key, value;
 
 	g_assert (self != NULL);
 
+	priv->reconnect_id = 0;
+
 	if (bm_dbus_manager_init_bus (self)) {
 		if (bm_dbus_manager_start_service (self)) {
 			bm_log_info (LOGD_CORE, "reconnected to the system bus.");
+			priv->reconnect_delay = 0;
+
+			/* Objects first, so the replayed signals have a sender
+			 * clients can introspect.
+			 */
+			g_hash_table_iter_init (&iter, priv->exported);
+			while (g_hash_table_iter_next (&iter, &key, &value))
+				dbus_g_connection_register_g_object (priv->g_connection, value, key);
+
 			g_signal_emit (self, signals[DBUS_CONNECTION_CHANGED],
 			               0, priv->connection);
-			priv->reconnect_id = 0;
+
+			replay_queue (self);
 			return FALSE;
 		}
 	}
 
 	/* Try again */
 	bm_dbus_manager_cleanup (self, FALSE);
-	return TRUE;
+	start_reconnection_timeout (self);
+	return FALSE;
 }
 
 static void
 start_reconnection_timeout (BMDBusManager *self)
 {
 	BMDBusManagerPrivate *priv = BM_DBUS_MANAGER_GET_PRIVATE (self);
+	gint32 jitter;
 
 	if (priv->reconnect_id)
 		g_source_remove (priv->reconnect_id);
 
+	if (!priv->reconnect_delay)
+		priv->reconnect_delay = RECONNECT_MIN_MSEC;
+	else
+		priv->reconnect_delay = MIN (priv->reconnect_delay * 2, RECONNECT_MAX_MSEC);
+
+	jitter = g_random_int_range (0, priv->reconnect_delay / 4 + 1);
+
 	/* Schedule timeout for reconnection attempts */
-	priv->reconnect_id = g_timeout_add_seconds (3, bm_dbus_manager_reconnect, self);
+	priv->reconnect_id = g_timeout_add (priv->reconnect_delay + jitter,
+	                                    bm_dbus_manager_reconnect, self);
 }
 
 char *
@@ -73,6 +73,19 @@ gboolean bm_dbus_manager_name_has_owner   (BMDBusManager *self,
 DBusConnection * bm_dbus_manager_get_dbus_connection (BMDBusManager *self);
 DBusGConnection * bm_dbus_manager_get_connection (BMDBusManager *self);
 
+void bm_dbus_manager_register_object      (BMDBusManager *self,
+                                           const char *path,
+                                           gpointer object);
+
+void bm_dbus_manager_unregister_object    (BMDBusManager *self,
+                                           gpointer object);
+
+void bm_dbus_manager_queue_signal         (BMDBusManager *self,
+                                           GType type,
+                                           const char *signal,
+                                           const char *iface,
+                                           const char *member);
+
 G_END_DECLS
 
 #endif /* __BM_DBUS_MANAGER_H__ */
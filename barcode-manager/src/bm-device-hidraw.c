@@ -21,20 +21,20 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
-//#include <net/ethernet.h>
+#include <time.h>
+#include <unistd.h>
 
-//#include "bm-glib-compat.h"
-//#include "bm-dbus-manager.h"
 #include "bm-device-hidraw.h"
 #include "bm-device-interface.h"
 #include "bm-device-private.h"
 #include "bm-logging.h"
 #include "bm-marshal.h"
 #include "bm-properties-changed-signal.h"
-//#include "bm-setting-connection.h"
-//#include "bm-setting-bluetooth.h"
+#include "bm-dbus-glib-types.h"
 #include "BarcodeManagerUtils.h"
 
 #include "bm-device-hidraw-glue.h"
@@ -43,142 +43,382 @@ G_DEFINE_TYPE (BMDeviceHidraw, bm_device_hidraw, BM_TYPE_DEVICE)
 
 #define BM_DEVICE_HIDRAW_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), BM_TYPE_DEVICE_HIDRAW, BMDeviceHidrawPrivate))
 
-typedef struct {
-    char *bdaddr;
-    char *name;
-    guint32 capabilities;
+/* Scanners send the scanned code in fixed size input reports; the
+ * payload starts after a 4 byte header and is padded with NULs.
+ */
+#define HIDRAW_REPORT_MAX     64
+#define HIDRAW_REPORT_HEADER  4
+
+/* Upper bound of reports handled per main loop iteration so that a
+ * chatty scanner can't starve other sources.
+ */
+#define HIDRAW_READS_PER_DISPATCH 16
 
-    gboolean connected;
-    gboolean have_iface;
+typedef gboolean (*HidrawSourceFunc) (GIOCondition condition, gpointer user_data);
 
-    DBusGProxy *type_proxy;
-    DBusGProxy *dev_proxy;
+typedef struct {
+	GSource source;
+	GPollFD pollfd;
+} HidrawSource;
 
-    guint32 timeout_id;
+typedef struct {
+	char *devnode;
 
-    guint32 bt_type;  /* BT type of the current connection */
+	int fd;
+	GSource *source;
 } BMDeviceHidrawPrivate;
 
+enum {
+	PROP_0,
+	PROP_DEVNODE,
+
+	LAST_PROP
+};
+
 enum {
 	PROPERTIES_CHANGED,
+	SCANNED,
 
 	LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
-BMDevice *
-bm_device_hidraw_new (const char *udi,
-					  const char *bdaddr,
-					  const char *name)
+/*****************************************************************************/
+
+/* The source only ever wakes the main loop when the hidraw node is readable
+ * (or went away); there is no timeout and no per-iteration work otherwise.
+ */
+static gboolean
+hidraw_source_prepare (GSource *source, gint *timeout)
+{
+	*timeout = -1;
+	return FALSE;
+}
+
+static gboolean
+hidraw_source_check (GSource *source)
 {
-	BMDevice *device;
+	HidrawSource *hsource = (HidrawSource *) source;
 
-	bm_log_dbg (LOGD_CORE, "udi = %s", udi);
-	bm_log_dbg (LOGD_CORE, "bdaddr = %s", bdaddr);
-	bm_log_dbg (LOGD_CORE, "name = %s", name);
+	return hsource->pollfd.revents != 0;
+}
 
-	g_return_val_if_fail (udi != NULL, NULL);
-	g_return_val_if_fail (bdaddr != NULL, NULL);
-	g_return_val_if_fail (name != NULL, NULL);
+static gboolean
+hidraw_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	HidrawSource *hsource = (HidrawSource *) source;
+	GIOCondition revents = hsource->pollfd.revents;
+
+	hsource->pollfd.revents = 0;
+
+	if (!callback)
+		return FALSE;
+
+	return ((HidrawSourceFunc) callback) (revents, user_data);
+}
+
+static GSourceFuncs hidraw_source_funcs = {
+	hidraw_source_prepare,
+	hidraw_source_check,
+	hidraw_source_dispatch,
+	NULL
+};
+
+static GSource *
+hidraw_source_new (int fd)
+{
+	HidrawSource *hsource;
+
+	hsource = (HidrawSource *) g_source_new (&hidraw_source_funcs, sizeof (HidrawSource));
+	hsource->pollfd.fd = fd;
+	hsource->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	g_source_add_poll (&hsource->source, &hsource->pollfd);
+
+	return &hsource->source;
+}
+
+/*****************************************************************************/
+
+static guint64
+now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+emit_scanned (BMDeviceHidraw *self, const guint8 *payload, gsize length, guint64 readable_us)
+{
+	GArray *data;
+	char *text = NULL;
+
+	data = g_array_sized_new (FALSE, FALSE, 1, length);
+	g_array_append_vals (data, payload, length);
+
+	/* D-Bus strings can't carry NULs, so those count as invalid too */
+	if (!memchr (payload, 0, length) && g_utf8_validate ((const char *) payload, length, NULL))
+		text = g_strndup ((const char *) payload, length);
+	else
+		bm_device_stats_inc (BM_DEVICE (self), BM_DEVICE_STAT_DECODE_FAILURE);
+
+	g_signal_emit (self, signals[SCANNED], 0, data, text ? text : "");
 
-	device = (BMDevice *) g_object_new (BM_TYPE_DEVICE_HIDRAW,
-										BM_DEVICE_INTERFACE_UDI, udi,
-										BM_DEVICE_INTERFACE_IFACE, bdaddr,
-										BM_DEVICE_INTERFACE_DRIVER, "hidraw",
-										BM_DEVICE_INTERFACE_TYPE_DESC, "Hidraw",
-										BM_DEVICE_INTERFACE_DEVICE_TYPE, BM_DEVICE_TYPE_HIDRAW,
-										NULL);
+	g_free (text);
+	g_array_free (data, TRUE);
 
-	bm_log_dbg (LOGD_HW, "(%s)", (device == NULL) ? "NULL" : "!= NULL");
+	bm_device_stats_scan (BM_DEVICE (self), length, (guint) (now_us () - readable_us));
+}
+
+static void hidraw_close (BMDeviceHidraw *self);
+
+static gboolean
+hidraw_readable_cb (GIOCondition condition, gpointer user_data)
+{
+	BMDeviceHidraw *self = BM_DEVICE_HIDRAW (user_data);
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (self);
+	const char *iface = bm_device_get_iface (BM_DEVICE (self));
+	guint8 report[HIDRAW_REPORT_MAX];
+	guint64 readable_us = now_us ();
+	int i;
+
+	for (i = 0; i < HIDRAW_READS_PER_DISPATCH; i++) {
+		ssize_t res;
+		gsize length;
+
+		res = read (priv->fd, report, sizeof (report));
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+
+			bm_log_warn (LOGD_HW, "(%s): error reading %s: (%d) %s",
+			             iface, priv->devnode, errno, strerror (errno));
+			bm_device_stats_inc (BM_DEVICE (self), BM_DEVICE_STAT_READ_ERROR);
+			goto fail;
+		}
+
+		if (res <= HIDRAW_REPORT_HEADER)
+			continue;
+
+		length = res - HIDRAW_REPORT_HEADER;
+		while (length > 0 && report[HIDRAW_REPORT_HEADER + length - 1] == 0)
+			length--;
+
+		if (length > 0)
+			emit_scanned (self, report + HIDRAW_REPORT_HEADER, length, readable_us);
+	}
+
+	/* If reports are still pending the fd stays readable and the source
+	 * fires again on the next iteration without an extra wakeup.
+	 */
+	if (!(condition & (G_IO_HUP | G_IO_ERR)))
+		return TRUE;
+
+	bm_log_info (LOGD_HW, "(%s): %s hung up", iface, priv->devnode);
+
+fail:
+	/* Returning FALSE destroys the source; just forget about it here */
+	g_source_unref (priv->source);
+	priv->source = NULL;
+	hidraw_close (self);
+
+	bm_device_state_changed (BM_DEVICE (self),
+	                         BM_DEVICE_STATE_UNAVAILABLE,
+	                         BM_DEVICE_STATE_REASON_REMOVED);
+	return FALSE;
+}
+
+static gboolean
+hidraw_open (BMDeviceHidraw *self)
+{
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (self);
+	const char *iface = bm_device_get_iface (BM_DEVICE (self));
+
+	if (priv->fd >= 0)
+		return TRUE;
+
+	priv->fd = open (priv->devnode, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (priv->fd < 0) {
+		bm_log_warn (LOGD_HW, "(%s): couldn't open %s: (%d) %s",
+		             iface, priv->devnode, errno, strerror (errno));
+		return FALSE;
+	}
+
+	priv->source = hidraw_source_new (priv->fd);
+	g_source_set_callback (priv->source, (GSourceFunc) hidraw_readable_cb, self, NULL);
+	g_source_attach (priv->source, NULL);
+
+	bm_log_info (LOGD_HW, "(%s): reading scans from %s", iface, priv->devnode);
+	return TRUE;
+}
+
+static void
+hidraw_close (BMDeviceHidraw *self)
+{
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (self);
+
+	if (priv->source) {
+		g_source_destroy (priv->source);
+		g_source_unref (priv->source);
+		priv->source = NULL;
+	}
+
+	if (priv->fd >= 0) {
+		close (priv->fd);
+		priv->fd = -1;
+	}
+}
+
+static void
+device_state_changed (BMDevice *device,
+                      BMDeviceState new_state,
+                      BMDeviceState old_state,
+                      BMDeviceStateReason reason,
+                      gpointer user_data)
+{
+	BMDeviceHidraw *self = BM_DEVICE_HIDRAW (device);
+
+	if (new_state == BM_DEVICE_STATE_ACTIVATED) {
+		if (!hidraw_open (self))
+			bm_device_state_changed (device,
+			                         BM_DEVICE_STATE_FAILED,
+			                         BM_DEVICE_STATE_REASON_CONFIG_FAILED);
+	} else if (old_state == BM_DEVICE_STATE_ACTIVATED)
+		hidraw_close (self);
+}
+
+/*****************************************************************************/
 
-	return device;
+BMDevice *
+bm_device_hidraw_new (const char *udi,
+                      const char *iface,
+                      const char *driver,
+                      const char *devnode)
+{
+	g_return_val_if_fail (udi != NULL, NULL);
+	g_return_val_if_fail (iface != NULL, NULL);
+	g_return_val_if_fail (driver != NULL, NULL);
+	g_return_val_if_fail (devnode != NULL, NULL);
+
+	return (BMDevice *) g_object_new (BM_TYPE_DEVICE_HIDRAW,
+	                                  BM_DEVICE_INTERFACE_UDI, udi,
+	                                  BM_DEVICE_INTERFACE_IFACE, iface,
+	                                  BM_DEVICE_INTERFACE_DRIVER, driver,
+	                                  BM_DEVICE_INTERFACE_TYPE_DESC, "Hidraw",
+	                                  BM_DEVICE_INTERFACE_DEVICE_TYPE, BM_DEVICE_TYPE_HIDRAW,
+	                                  BM_DEVICE_HIDRAW_DEVNODE, devnode,
+	                                  NULL);
+}
+
+const char *
+bm_device_hidraw_get_devnode (BMDeviceHidraw *self)
+{
+	g_return_val_if_fail (BM_IS_DEVICE_HIDRAW (self), NULL);
+
+	return BM_DEVICE_HIDRAW_GET_PRIVATE (self)->devnode;
 }
 
 static void
 bm_device_hidraw_init (BMDeviceHidraw *self)
 {
-	bm_log_dbg (LOGD_HW, "init called");
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (self);
+
+	priv->fd = -1;
 
-	//	g_signal_connect (self, "state-changed", G_CALLBACK (device_state_changed), NULL);
+	g_signal_connect (self, "state-changed", G_CALLBACK (device_state_changed), NULL);
 }
 
 static void
 set_property (GObject *object, guint prop_id,
               const GValue *value, GParamSpec *pspec)
 {
-    BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
-
-    switch (prop_id) {
-    default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-        break;
-    }
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
+
+	switch (prop_id) {
+	case PROP_DEVNODE:
+		/* construct-only */
+		priv->devnode = g_value_dup_string (value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
 }
 
 static void
 get_property (GObject *object, guint prop_id,
               GValue *value, GParamSpec *pspec)
 {
-    BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
-
-    switch (prop_id) {
-    default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-        break;
-    }
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
+
+	switch (prop_id) {
+	case PROP_DEVNODE:
+		g_value_set_string (value, priv->devnode);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
 }
 
 static void
-finalize (GObject *object)
+dispose (GObject *object)
 {
-    BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
-
-    if (priv->timeout_id) {
-        g_source_remove (priv->timeout_id);
-        priv->timeout_id = 0;
-    }
+	hidraw_close (BM_DEVICE_HIDRAW (object));
 
-    if (priv->type_proxy)
-        g_object_unref (priv->type_proxy);
+	G_OBJECT_CLASS (bm_device_hidraw_parent_class)->dispose (object);
+}
 
-    if (priv->dev_proxy)
-        g_object_unref (priv->dev_proxy);
+static void
+finalize (GObject *object)
+{
+	BMDeviceHidrawPrivate *priv = BM_DEVICE_HIDRAW_GET_PRIVATE (object);
 
-    g_free (priv->bdaddr);
-    g_free (priv->name);
+	g_free (priv->devnode);
 
-    G_OBJECT_CLASS (bm_device_hidraw_parent_class)->finalize (object);
+	G_OBJECT_CLASS (bm_device_hidraw_parent_class)->finalize (object);
 }
 
 static void
 bm_device_hidraw_class_init (BMDeviceHidrawClass *klass)
 {
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
-	BMDeviceClass *device_class = BM_DEVICE_CLASS (klass);
-
-	bm_log_dbg (LOGD_HW, "class init called");
 
 	g_type_class_add_private (object_class, sizeof (BMDeviceHidrawPrivate));
 
-	// object_class->constructor = constructor;
-	// object_class->dispose = dispose;
-
 	object_class->get_property = get_property;
 	object_class->set_property = set_property;
+	object_class->dispose = dispose;
 	object_class->finalize = finalize;
 
-	// device_class->get_generic_capabilities = real_get_generic_capabilities;
-
 	/* Properties */
+	g_object_class_install_property
+		(object_class, PROP_DEVNODE,
+		 g_param_spec_string (BM_DEVICE_HIDRAW_DEVNODE,
+		                      "Devnode",
+		                      "hidraw device node",
+		                      NULL,
+		                      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
 	/* Signals */
-    signals[PROPERTIES_CHANGED] =
-        bm_properties_changed_signal_new (object_class,
-                                          G_STRUCT_OFFSET (BMDeviceHidrawClass, properties_changed));
+	signals[PROPERTIES_CHANGED] =
+		bm_properties_changed_signal_new (object_class,
+		                                  G_STRUCT_OFFSET (BMDeviceHidrawClass, properties_changed));
+
+	signals[SCANNED] =
+		g_signal_new ("scanned",
+		              G_OBJECT_CLASS_TYPE (object_class),
+		              G_SIGNAL_RUN_FIRST,
+		              G_STRUCT_OFFSET (BMDeviceHidrawClass, scanned),
+		              NULL, NULL,
+		              _bm_marshal_VOID__BOXED_STRING,
+		              G_TYPE_NONE, 2,
+		              DBUS_TYPE_G_UCHAR_ARRAY, G_TYPE_STRING);
 
 	dbus_g_object_type_install_info (G_TYPE_FROM_CLASS (klass),
 	                                 &dbus_glib_bm_device_hidraw_object_info);
-
-	// dbus_g_error_domain_register (BM_HIDRAW_ERROR, NULL, BM_TYPE_HIDRAW_ERROR);
 }
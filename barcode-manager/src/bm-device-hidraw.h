@@ -33,6 +33,8 @@ G_BEGIN_DECLS
 #define BM_IS_DEVICE_HIDRAW_CLASS(klass)	(G_TYPE_CHECK_CLASS_TYPE ((klass),  BM_TYPE_DEVICE_HIDRAW))
 #define BM_DEVICE_HIDRAW_GET_CLASS(obj)	(G_TYPE_INSTANCE_GET_CLASS ((obj),  BM_TYPE_DEVICE_HIDRAW, BMDeviceHidrawClass))
 
+#define BM_DEVICE_HIDRAW_DEVNODE "devnode"
+
 typedef struct {
 	BMDevice parent;
 } BMDeviceHidraw;
@@ -41,13 +43,18 @@ typedef struct {
 	BMDeviceClass parent;
 
     void (*properties_changed) (BMDeviceHidraw *device, GHashTable *properties);
+
+	void (*scanned) (BMDeviceHidraw *device, GArray *data, const char *text);
 } BMDeviceHidrawClass;
 
 GType bm_device_hidraw_get_type (void);
 
 BMDevice *bm_device_hidraw_new (const char *udi,
-                            const char *bdaddr,
-                            const char *name);
+                                 const char *iface,
+                                 const char *driver,
+                                 const char *devnode);
+
+const char *bm_device_hidraw_get_devnode (BMDeviceHidraw *device);
 
 G_END_DECLS
 
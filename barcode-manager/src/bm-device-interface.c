@@ -128,6 +128,118 @@ bm_device_interface_init (gpointer g_iface)
 							  NULL,
 							  G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | BM_PROPERTY_PARAM_NO_EXPORT));
 
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_SCANS,
+							"Scans",
+							"Number of scans read from the device",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_SCAN_BYTES,
+							"ScanBytes",
+							"Payload bytes read from the device",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_READ_ERRORS,
+							"ReadErrors",
+							"Errors reading from the device",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_DECODE_FAILURES,
+							"DecodeFailures",
+							"Scans that could not be decoded as text",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_DUPLICATE_DROPS,
+							"DuplicateDrops",
+							"Repeated scans that were dropped",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_LAST_SCAN,
+							"LastScan",
+							"Time of the last scan, in seconds since the epoch",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_LATENCY_MEAN,
+							"LatencyMean",
+							"Moving average of the scan latency, in microseconds",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_LATENCY_MAX,
+							"LatencyMax",
+							"Highest scan latency, in microseconds",
+							0, G_MAXUINT32, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_string (BM_DEVICE_INTERFACE_VENDOR,
+							  "Vendor",
+							  "Hardware vendor name",
+							  NULL,
+							  G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_string (BM_DEVICE_INTERFACE_PRODUCT,
+							  "Product",
+							  "Hardware product name",
+							  NULL,
+							  G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_VENDOR_ID,
+							"VendorId",
+							"USB vendor ID",
+							0, G_MAXUINT16, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_uint (BM_DEVICE_INTERFACE_PRODUCT_ID,
+							"ProductId",
+							"USB product ID",
+							0, G_MAXUINT16, 0,
+							G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_string (BM_DEVICE_INTERFACE_SERIAL,
+							  "Serial",
+							  "Hardware serial number",
+							  NULL,
+							  G_PARAM_READABLE));
+
+	g_object_interface_install_property
+		(g_iface,
+		 g_param_spec_string (BM_DEVICE_INTERFACE_PORT_PATH,
+							  "PortPath",
+							  "USB port path",
+							  NULL,
+							  G_PARAM_READABLE));
+
 	/* Signals */
 	g_signal_new ("state-changed",
 				  iface_type,
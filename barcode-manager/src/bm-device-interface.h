@@ -52,6 +52,20 @@ typedef enum
 #define BM_DEVICE_INTERFACE_STATE            "state"
 #define BM_DEVICE_INTERFACE_DEVICE_TYPE      "device-type" /* ugh */
 #define BM_DEVICE_INTERFACE_TYPE_DESC        "type-desc"    /* Internal only */
+#define BM_DEVICE_INTERFACE_SCANS            "scans"
+#define BM_DEVICE_INTERFACE_SCAN_BYTES       "scan-bytes"
+#define BM_DEVICE_INTERFACE_READ_ERRORS      "read-errors"
+#define BM_DEVICE_INTERFACE_DECODE_FAILURES  "decode-failures"
+#define BM_DEVICE_INTERFACE_DUPLICATE_DROPS  "duplicate-drops"
+#define BM_DEVICE_INTERFACE_LAST_SCAN        "last-scan"
+#define BM_DEVICE_INTERFACE_LATENCY_MEAN     "latency-mean"
+#define BM_DEVICE_INTERFACE_LATENCY_MAX      "latency-max"
+#define BM_DEVICE_INTERFACE_VENDOR           "vendor"
+#define BM_DEVICE_INTERFACE_PRODUCT          "product"
+#define BM_DEVICE_INTERFACE_VENDOR_ID        "vendor-id"
+#define BM_DEVICE_INTERFACE_PRODUCT_ID       "product-id"
+#define BM_DEVICE_INTERFACE_SERIAL           "serial"
+#define BM_DEVICE_INTERFACE_PORT_PATH        "port-path"
 
 typedef enum {
 	BM_DEVICE_INTERFACE_PROP_FIRST = 0x1000,
@@ -63,6 +77,20 @@ typedef enum {
 	BM_DEVICE_INTERFACE_PROP_STATE,
 	BM_DEVICE_INTERFACE_PROP_DEVICE_TYPE,
 	BM_DEVICE_INTERFACE_PROP_TYPE_DESC,
+	BM_DEVICE_INTERFACE_PROP_SCANS,
+	BM_DEVICE_INTERFACE_PROP_SCAN_BYTES,
+	BM_DEVICE_INTERFACE_PROP_READ_ERRORS,
+	BM_DEVICE_INTERFACE_PROP_DECODE_FAILURES,
+	BM_DEVICE_INTERFACE_PROP_DUPLICATE_DROPS,
+	BM_DEVICE_INTERFACE_PROP_LAST_SCAN,
+	BM_DEVICE_INTERFACE_PROP_LATENCY_MEAN,
+	BM_DEVICE_INTERFACE_PROP_LATENCY_MAX,
+	BM_DEVICE_INTERFACE_PROP_VENDOR,
+	BM_DEVICE_INTERFACE_PROP_PRODUCT,
+	BM_DEVICE_INTERFACE_PROP_VENDOR_ID,
+	BM_DEVICE_INTERFACE_PROP_PRODUCT_ID,
+	BM_DEVICE_INTERFACE_PROP_SERIAL,
+	BM_DEVICE_INTERFACE_PROP_PORT_PATH,
 } BMDeviceInterfaceProp;
 
 typedef struct _BMDeviceInterface BMDeviceInterface;
@@ -46,4 +46,14 @@ gboolean bm_device_get_firmware_missing (BMDevice *self);
 
 void bm_device_set_firmware_missing (BMDevice *self, gboolean missing);
 
+typedef enum {
+	BM_DEVICE_STAT_READ_ERROR = 0,
+	BM_DEVICE_STAT_DECODE_FAILURE,
+	BM_DEVICE_STAT_DUPLICATE,
+} BMDeviceStat;
+
+void bm_device_stats_scan (BMDevice *self, guint bytes, guint latency_us);
+
+void bm_device_stats_inc (BMDevice *self, BMDeviceStat stat);
+
 #endif	/* BM_DEVICE_PRIVATE_H */
@@ -0,0 +1,241 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#include "bm-device-registry.h"
+
+typedef struct {
+	gpointer device;
+	char *iface;
+	char *udi;
+	char *path;
+
+	/* Slot in registry->devices */
+	guint index;
+} Entry;
+
+struct _BMDeviceRegistry {
+	/* Devices in add order; removed devices leave a NULL hole until the
+	 * array is compacted, so removal doesn't have to shift the tail.
+	 */
+	GPtrArray *devices;
+	guint holes;
+
+	GHashTable *by_device;
+	GHashTable *by_iface;
+	GHashTable *by_udi;
+	GHashTable *by_path;
+};
+
+static void
+entry_free (gpointer data)
+{
+	Entry *entry = data;
+
+	g_free (entry->iface);
+	g_free (entry->udi);
+	g_free (entry->path);
+	g_slice_free (Entry, entry);
+}
+
+BMDeviceRegistry *
+bm_device_registry_new (void)
+{
+	BMDeviceRegistry *registry;
+
+	registry = g_slice_new0 (BMDeviceRegistry);
+	registry->devices = g_ptr_array_new ();
+
+	/* The key indexes borrow their keys from the entries, which are owned
+	 * by by_device.
+	 */
+	registry->by_device = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, entry_free);
+	registry->by_iface = g_hash_table_new (g_str_hash, g_str_equal);
+	registry->by_udi = g_hash_table_new (g_str_hash, g_str_equal);
+	registry->by_path = g_hash_table_new (g_str_hash, g_str_equal);
+
+	return registry;
+}
+
+void
+bm_device_registry_free (BMDeviceRegistry *registry)
+{
+	g_return_if_fail (registry != NULL);
+
+	g_hash_table_destroy (registry->by_iface);
+	g_hash_table_destroy (registry->by_udi);
+	g_hash_table_destroy (registry->by_path);
+	g_hash_table_destroy (registry->by_device);
+	g_ptr_array_free (registry->devices, TRUE);
+	g_slice_free (BMDeviceRegistry, registry);
+}
+
+static void
+compact (BMDeviceRegistry *registry)
+{
+	guint i, j;
+
+	if (!registry->holes)
+		return;
+
+	for (i = 0, j = 0; i < registry->devices->len; i++) {
+		gpointer device = g_ptr_array_index (registry->devices, i);
+		Entry *entry;
+
+		if (!device)
+			continue;
+
+		entry = g_hash_table_lookup (registry->by_device, device);
+		entry->index = j;
+		registry->devices->pdata[j++] = device;
+	}
+
+	g_ptr_array_set_size (registry->devices, j);
+	registry->holes = 0;
+}
+
+gboolean
+bm_device_registry_add (BMDeviceRegistry *registry,
+                        gpointer device,
+                        const char *iface,
+                        const char *udi,
+                        const char *path)
+{
+	Entry *entry;
+
+	g_return_val_if_fail (registry != NULL, FALSE);
+	g_return_val_if_fail (device != NULL, FALSE);
+
+	if (g_hash_table_lookup (registry->by_device, device))
+		return FALSE;
+	if (iface && g_hash_table_lookup (registry->by_iface, iface))
+		return FALSE;
+	if (udi && g_hash_table_lookup (registry->by_udi, udi))
+		return FALSE;
+	if (path && g_hash_table_lookup (registry->by_path, path))
+		return FALSE;
+
+	/* Keep the holes bounded so the array stays proportional to the
+	 * number of devices even if nobody ever iterates.
+	 */
+	if (registry->holes > registry->devices->len / 2)
+		compact (registry);
+
+	entry = g_slice_new0 (Entry);
+	entry->device = device;
+	entry->iface = g_strdup (iface);
+	entry->udi = g_strdup (udi);
+	entry->path = g_strdup (path);
+	entry->index = registry->devices->len;
+
+	g_ptr_array_add (registry->devices, device);
+	g_hash_table_insert (registry->by_device, device, entry);
+	if (entry->iface)
+		g_hash_table_insert (registry->by_iface, entry->iface, entry);
+	if (entry->udi)
+		g_hash_table_insert (registry->by_udi, entry->udi, entry);
+	if (entry->path)
+		g_hash_table_insert (registry->by_path, entry->path, entry);
+
+	return TRUE;
+}
+
+gboolean
+bm_device_registry_remove (BMDeviceRegistry *registry, gpointer device)
+{
+	Entry *entry;
+
+	g_return_val_if_fail (registry != NULL, FALSE);
+	g_return_val_if_fail (device != NULL, FALSE);
+
+	entry = g_hash_table_lookup (registry->by_device, device);
+	if (!entry)
+		return FALSE;
+
+	if (entry->iface)
+		g_hash_table_remove (registry->by_iface, entry->iface);
+	if (entry->udi)
+		g_hash_table_remove (registry->by_udi, entry->udi);
+	if (entry->path)
+		g_hash_table_remove (registry->by_path, entry->path);
+
+	if (entry->index == registry->devices->len - 1)
+		g_ptr_array_set_size (registry->devices, entry->index);
+	else {
+		registry->devices->pdata[entry->index] = NULL;
+		registry->holes++;
+	}
+
+	/* Frees the entry */
+	g_hash_table_remove (registry->by_device, device);
+	return TRUE;
+}
+
+static gpointer
+lookup (GHashTable *index, const char *key)
+{
+	Entry *entry;
+
+	if (!key)
+		return NULL;
+
+	entry = g_hash_table_lookup (index, key);
+	return entry ? entry->device : NULL;
+}
+
+gpointer
+bm_device_registry_lookup_iface (BMDeviceRegistry *registry, const char *iface)
+{
+	g_return_val_if_fail (registry != NULL, NULL);
+
+	return lookup (registry->by_iface, iface);
+}
+
+gpointer
+bm_device_registry_lookup_udi (BMDeviceRegistry *registry, const char *udi)
+{
+	g_return_val_if_fail (registry != NULL, NULL);
+
+	return lookup (registry->by_udi, udi);
+}
+
+gpointer
+bm_device_registry_lookup_path (BMDeviceRegistry *registry, const char *path)
+{
+	g_return_val_if_fail (registry != NULL, NULL);
+
+	return lookup (registry->by_path, path);
+}
+
+guint
+bm_device_registry_get_size (BMDeviceRegistry *registry)
+{
+	g_return_val_if_fail (registry != NULL, 0);
+
+	return g_hash_table_size (registry->by_device);
+}
+
+const GPtrArray *
+bm_device_registry_get_devices (BMDeviceRegistry *registry)
+{
+	g_return_val_if_fail (registry != NULL, NULL);
+
+	compact (registry);
+	return registry->devices;
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#ifndef BM_DEVICE_REGISTRY_H
+#define BM_DEVICE_REGISTRY_H
+
+#include <glib.h>
+
+/* Set of known devices, indexed by interface name, UDI and object path.
+ * Lookups, additions and removals are O(1); iteration follows the order
+ * in which devices were added.  Devices are opaque pointers and are not
+ * referenced by the registry.
+ */
+typedef struct _BMDeviceRegistry BMDeviceRegistry;
+
+BMDeviceRegistry *bm_device_registry_new          (void);
+void              bm_device_registry_free         (BMDeviceRegistry *registry);
+
+gboolean          bm_device_registry_add          (BMDeviceRegistry *registry,
+                                                   gpointer device,
+                                                   const char *iface,
+                                                   const char *udi,
+                                                   const char *path);
+
+gboolean          bm_device_registry_remove       (BMDeviceRegistry *registry,
+                                                   gpointer device);
+
+gpointer          bm_device_registry_lookup_iface (BMDeviceRegistry *registry,
+                                                   const char *iface);
+gpointer          bm_device_registry_lookup_udi   (BMDeviceRegistry *registry,
+                                                   const char *udi);
+gpointer          bm_device_registry_lookup_path  (BMDeviceRegistry *registry,
+                                                   const char *path);
+
+guint             bm_device_registry_get_size     (BMDeviceRegistry *registry);
+
+/* Dense array of devices in the order they were added; owned by the
+ * registry and only valid until the next add or remove.
+ */
+const GPtrArray * bm_device_registry_get_devices  (BMDeviceRegistry *registry);
+
+#endif /* BM_DEVICE_REGISTRY_H */
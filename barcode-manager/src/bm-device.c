@@ -33,6 +33,7 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "bm-glib-compat.h"
 #include "bm-device-interface.h"
@@ -60,6 +61,41 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 #define BM_DEVICE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), BM_TYPE_DEVICE, BMDevicePrivate))
 
+/* Scan statistics.  These are bumped from the read path with atomic ops
+ * and only turned into property notifications by stats_publish(), at most
+ * once per stats_interval.
+ */
+typedef struct {
+	volatile gint scans;
+	volatile gint bytes;
+	volatile gint read_errors;
+	volatile gint decode_failures;
+	volatile gint duplicates;
+	volatile gint last_scan;      /* seconds since the epoch */
+	volatile gint latency_mean;   /* usec, moving average */
+	volatile gint latency_max;    /* usec */
+} BMDeviceStats;
+
+static const struct {
+	gsize offset;
+	const char *property;
+} stats_properties[] = {
+	{ G_STRUCT_OFFSET (BMDeviceStats, scans),           BM_DEVICE_INTERFACE_SCANS },
+	{ G_STRUCT_OFFSET (BMDeviceStats, bytes),           BM_DEVICE_INTERFACE_SCAN_BYTES },
+	{ G_STRUCT_OFFSET (BMDeviceStats, read_errors),     BM_DEVICE_INTERFACE_READ_ERRORS },
+	{ G_STRUCT_OFFSET (BMDeviceStats, decode_failures), BM_DEVICE_INTERFACE_DECODE_FAILURES },
+	{ G_STRUCT_OFFSET (BMDeviceStats, duplicates),      BM_DEVICE_INTERFACE_DUPLICATE_DROPS },
+	{ G_STRUCT_OFFSET (BMDeviceStats, last_scan),       BM_DEVICE_INTERFACE_LAST_SCAN },
+	{ G_STRUCT_OFFSET (BMDeviceStats, latency_mean),    BM_DEVICE_INTERFACE_LATENCY_MEAN },
+	{ G_STRUCT_OFFSET (BMDeviceStats, latency_max),     BM_DEVICE_INTERFACE_LATENCY_MAX },
+};
+
+#define STATS_FIELD(stats, i) \
+	((volatile gint *) (((guint8 *) (stats)) + stats_properties[i].offset))
+
+/* Milliseconds between two publications of a device's statistics */
+static guint stats_interval = 1000;
+
 typedef struct {
 	gboolean disposed;
 	gboolean initialized;
@@ -82,6 +118,13 @@ typedef struct {
 
 	/* inhibit autoconnect feature */
 	gboolean	autoconnect_inhibit;
+
+	BMDeviceHwInfo *hw_info;
+
+	BMDeviceStats stats;
+	BMDeviceStats published;
+	volatile gint stats_pending;
+	guint         stats_id;
 } BMDevicePrivate;
 
 static gboolean spec_match_list (BMDeviceInterface *device, const GSList *specs);
@@ -175,6 +218,11 @@ dispose (GObject *object)
 
     priv->disposed = TRUE;
 
+	if (priv->stats_id) {
+		g_source_remove (priv->stats_id);
+		priv->stats_id = 0;
+	}
+
 	// FIXME more here
 
  out:
@@ -191,6 +239,8 @@ finalize (GObject *object)
     g_free (priv->iface);
     g_free (priv->driver);
     g_free (priv->type_desc);
+    if (priv->hw_info)
+        bm_device_hw_info_unref (priv->hw_info);
 
     G_OBJECT_CLASS (bm_device_parent_class)->finalize (object);
 }
@@ -236,6 +286,14 @@ bm_device_get_path (BMDevice *self)
 	return BM_DEVICE_GET_PRIVATE (self)->path;
 }
 
+const char *
+bm_device_get_udi (BMDevice *self)
+{
+	g_return_val_if_fail (self != NULL, NULL);
+
+	return BM_DEVICE_GET_PRIVATE (self)->udi;
+}
+
 /*
  * Get/set functions for iface
  */
@@ -261,6 +319,77 @@ bm_device_get_driver (BMDevice *self)
 }
 
 
+/*
+ * Hardware information
+ */
+BMDeviceHwInfo *
+bm_device_hw_info_new (void)
+{
+	BMDeviceHwInfo *info;
+
+	info = g_slice_new0 (BMDeviceHwInfo);
+	info->refcount = 1;
+	return info;
+}
+
+BMDeviceHwInfo *
+bm_device_hw_info_ref (BMDeviceHwInfo *info)
+{
+	g_return_val_if_fail (info != NULL, NULL);
+
+	info->refcount++;
+	return info;
+}
+
+void
+bm_device_hw_info_unref (BMDeviceHwInfo *info)
+{
+	g_return_if_fail (info != NULL);
+
+	if (--info->refcount > 0)
+		return;
+
+	g_free (info->driver);
+	g_free (info->vendor);
+	g_free (info->product);
+	g_free (info->serial);
+	g_free (info->port);
+	g_slice_free (BMDeviceHwInfo, info);
+}
+
+void
+bm_device_set_hw_info (BMDevice *self, BMDeviceHwInfo *info)
+{
+	BMDevicePrivate *priv;
+
+	g_return_if_fail (BM_IS_DEVICE (self));
+
+	priv = BM_DEVICE_GET_PRIVATE (self);
+	if (info)
+		bm_device_hw_info_ref (info);
+	if (priv->hw_info)
+		bm_device_hw_info_unref (priv->hw_info);
+	priv->hw_info = info;
+
+	g_object_freeze_notify (G_OBJECT (self));
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_VENDOR);
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_PRODUCT);
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_VENDOR_ID);
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_PRODUCT_ID);
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_SERIAL);
+	g_object_notify (G_OBJECT (self), BM_DEVICE_INTERFACE_PORT_PATH);
+	g_object_thaw_notify (G_OBJECT (self));
+}
+
+const BMDeviceHwInfo *
+bm_device_get_hw_info (BMDevice *self)
+{
+	g_return_val_if_fail (BM_IS_DEVICE (self), NULL);
+
+	return BM_DEVICE_GET_PRIVATE (self)->hw_info;
+}
+
+
 /*
  * Get/set functions for type
  */
@@ -319,6 +448,144 @@ bm_device_get_type_desc (BMDevice *self)
 	return BM_DEVICE_GET_PRIVATE (self)->type_desc;
 }
 
+/*
+ * Scan statistics
+ */
+void
+bm_device_set_stats_interval (guint msec)
+{
+	stats_interval = msec;
+}
+
+static gboolean
+stats_publish (gpointer user_data)
+{
+	BMDevice *self = BM_DEVICE (user_data);
+	BMDevicePrivate *priv = BM_DEVICE_GET_PRIVATE (self);
+	int i;
+
+	priv->stats_id = 0;
+
+	/* Anything counted from here on schedules the next publication */
+	g_atomic_int_set (&priv->stats_pending, 0);
+
+	/* Frozen so all changed counters go out in one PropertiesChanged */
+	g_object_freeze_notify (G_OBJECT (self));
+	for (i = 0; i < G_N_ELEMENTS (stats_properties); i++) {
+		gint value = g_atomic_int_get (STATS_FIELD (&priv->stats, i));
+
+		if (value != *STATS_FIELD (&priv->published, i)) {
+			*STATS_FIELD (&priv->published, i) = value;
+			g_object_notify (G_OBJECT (self), stats_properties[i].property);
+		}
+	}
+	g_object_thaw_notify (G_OBJECT (self));
+
+	return FALSE;
+}
+
+static void
+stats_changed (BMDevice *self)
+{
+	BMDevicePrivate *priv = BM_DEVICE_GET_PRIVATE (self);
+
+	if (!g_atomic_int_compare_and_exchange (&priv->stats_pending, 0, 1))
+		return;
+
+	if (stats_interval)
+		priv->stats_id = g_timeout_add (stats_interval, stats_publish, self);
+	else
+		priv->stats_id = g_idle_add (stats_publish, self);
+}
+
+void
+bm_device_stats_scan (BMDevice *self, guint bytes, guint latency_us)
+{
+	BMDevicePrivate *priv;
+	gint mean, max;
+
+	g_return_if_fail (BM_IS_DEVICE (self));
+
+	priv = BM_DEVICE_GET_PRIVATE (self);
+
+	g_atomic_int_inc (&priv->stats.scans);
+	g_atomic_int_add (&priv->stats.bytes, bytes);
+	g_atomic_int_set (&priv->stats.last_scan, (gint) time (NULL));
+
+	/* Exponential moving average with a weight of 1/8 per sample */
+	do {
+		mean = g_atomic_int_get (&priv->stats.latency_mean);
+	} while (!g_atomic_int_compare_and_exchange (&priv->stats.latency_mean,
+	                                             mean,
+	                                             mean + ((gint) latency_us - mean) / 8));
+
+	do {
+		max = g_atomic_int_get (&priv->stats.latency_max);
+	} while (   (gint) latency_us > max
+	         && !g_atomic_int_compare_and_exchange (&priv->stats.latency_max, max, latency_us));
+
+	stats_changed (self);
+}
+
+void
+bm_device_stats_inc (BMDevice *self, BMDeviceStat stat)
+{
+	BMDevicePrivate *priv;
+
+	g_return_if_fail (BM_IS_DEVICE (self));
+
+	priv = BM_DEVICE_GET_PRIVATE (self);
+
+	switch (stat) {
+	case BM_DEVICE_STAT_READ_ERROR:
+		g_atomic_int_inc (&priv->stats.read_errors);
+		break;
+	case BM_DEVICE_STAT_DECODE_FAILURE:
+		g_atomic_int_inc (&priv->stats.decode_failures);
+		break;
+	case BM_DEVICE_STAT_DUPLICATE:
+		g_atomic_int_inc (&priv->stats.duplicates);
+		break;
+	default:
+		g_return_if_reached ();
+	}
+
+	stats_changed (self);
+}
+
+BMDeviceState
+bm_device_get_state (BMDevice *device)
+{
+	g_return_val_if_fail (BM_IS_DEVICE (device), BM_DEVICE_STATE_UNKNOWN);
+
+	return BM_DEVICE_GET_PRIVATE (device)->state;
+}
+
+void
+bm_device_state_changed (BMDevice *device,
+                         BMDeviceState state,
+                         BMDeviceStateReason reason)
+{
+	BMDevicePrivate *priv;
+	BMDeviceState old_state;
+
+	g_return_if_fail (BM_IS_DEVICE (device));
+
+	priv = BM_DEVICE_GET_PRIVATE (device);
+
+	old_state = priv->state;
+	if (state == old_state)
+		return;
+
+	priv->state = state;
+
+	bm_log_info (LOGD_DEVICE, "(%s): device state change: %d -> %d (reason %d)",
+	             priv->iface, old_state, state, reason);
+
+	g_signal_emit_by_name (device, "state-changed", state, old_state, reason);
+	g_object_notify (G_OBJECT (device), BM_DEVICE_INTERFACE_STATE);
+}
+
 /*                                                                                                                                                            
  * nm_device_is_activating                                                                                                                                    
  *                                                                                                                                                            
@@ -448,6 +715,48 @@ get_property (GObject *object, guint prop_id,
 	case BM_DEVICE_INTERFACE_PROP_TYPE_DESC:
 		g_value_set_string (value, priv->type_desc);
 		break;
+	case BM_DEVICE_INTERFACE_PROP_SCANS:
+		g_value_set_uint (value, priv->published.scans);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_SCAN_BYTES:
+		g_value_set_uint (value, priv->published.bytes);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_READ_ERRORS:
+		g_value_set_uint (value, priv->published.read_errors);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_DECODE_FAILURES:
+		g_value_set_uint (value, priv->published.decode_failures);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_DUPLICATE_DROPS:
+		g_value_set_uint (value, priv->published.duplicates);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_LAST_SCAN:
+		g_value_set_uint (value, priv->published.last_scan);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_LATENCY_MEAN:
+		g_value_set_uint (value, priv->published.latency_mean);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_LATENCY_MAX:
+		g_value_set_uint (value, priv->published.latency_max);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_VENDOR:
+		g_value_set_string (value, priv->hw_info ? priv->hw_info->vendor : NULL);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_PRODUCT:
+		g_value_set_string (value, priv->hw_info ? priv->hw_info->product : NULL);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_VENDOR_ID:
+		g_value_set_uint (value, priv->hw_info ? priv->hw_info->vendor_id : 0);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_PRODUCT_ID:
+		g_value_set_uint (value, priv->hw_info ? priv->hw_info->product_id : 0);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_SERIAL:
+		g_value_set_string (value, priv->hw_info ? priv->hw_info->serial : NULL);
+		break;
+	case BM_DEVICE_INTERFACE_PROP_PORT_PATH:
+		g_value_set_string (value, priv->hw_info ? priv->hw_info->port : NULL);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -502,6 +811,62 @@ bm_device_class_init (BMDeviceClass *klass)
 									  BM_DEVICE_INTERFACE_PROP_TYPE_DESC,
 									  BM_DEVICE_INTERFACE_TYPE_DESC);
 
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_SCANS,
+									  BM_DEVICE_INTERFACE_SCANS);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_SCAN_BYTES,
+									  BM_DEVICE_INTERFACE_SCAN_BYTES);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_READ_ERRORS,
+									  BM_DEVICE_INTERFACE_READ_ERRORS);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_DECODE_FAILURES,
+									  BM_DEVICE_INTERFACE_DECODE_FAILURES);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_DUPLICATE_DROPS,
+									  BM_DEVICE_INTERFACE_DUPLICATE_DROPS);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_LAST_SCAN,
+									  BM_DEVICE_INTERFACE_LAST_SCAN);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_LATENCY_MEAN,
+									  BM_DEVICE_INTERFACE_LATENCY_MEAN);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_LATENCY_MAX,
+									  BM_DEVICE_INTERFACE_LATENCY_MAX);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_VENDOR,
+									  BM_DEVICE_INTERFACE_VENDOR);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_PRODUCT,
+									  BM_DEVICE_INTERFACE_PRODUCT);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_VENDOR_ID,
+									  BM_DEVICE_INTERFACE_VENDOR_ID);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_PRODUCT_ID,
+									  BM_DEVICE_INTERFACE_PRODUCT_ID);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_SERIAL,
+									  BM_DEVICE_INTERFACE_SERIAL);
+
+	g_object_class_override_property (object_class,
+									  BM_DEVICE_INTERFACE_PROP_PORT_PATH,
+									  BM_DEVICE_INTERFACE_PORT_PATH);
+
 	signals[AUTOCONNECT_ALLOWED] =
 		g_signal_new ("autoconnect-allowed",
 		              G_OBJECT_CLASS_TYPE (object_class),
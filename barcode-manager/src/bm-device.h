@@ -40,6 +40,21 @@ typedef struct {
 	GObject parent;
 } BMDevice;
 
+/* Identification of the hardware behind a device, gathered from udev once
+ * per add and shared between the udev manager's cache and the device.
+ */
+typedef struct {
+	gint refcount;
+
+	char *driver;
+	guint vendor_id;
+	guint product_id;
+	char *vendor;
+	char *product;
+	char *serial;
+	char *port;      /* USB port path, like "2-1.4" */
+} BMDeviceHwInfo;
+
 typedef struct {
 	GObjectClass parent;
 
@@ -68,6 +83,7 @@ GType bm_device_get_type (void);
 const char *    bm_device_get_path (BMDevice *dev);
 void            bm_device_set_path (BMDevice *dev, const char *path);
 
+const char *	bm_device_get_udi		(BMDevice *dev);
 const char *	bm_device_get_iface		(BMDevice *dev);
 const char *	bm_device_get_driver	(BMDevice *dev);
 const char *	bm_device_get_type_desc (BMDevice *dev);
@@ -88,6 +104,15 @@ BMConnection * bm_device_get_best_auto_connection (BMDevice *dev,
 
 BMDeviceState bm_device_get_state (BMDevice *device);
 
+void bm_device_set_stats_interval (guint msec);
+
+BMDeviceHwInfo *bm_device_hw_info_new   (void);
+BMDeviceHwInfo *bm_device_hw_info_ref   (BMDeviceHwInfo *info);
+void            bm_device_hw_info_unref (BMDeviceHwInfo *info);
+
+void                  bm_device_set_hw_info (BMDevice *dev, BMDeviceHwInfo *info);
+const BMDeviceHwInfo *bm_device_get_hw_info (BMDevice *dev);
+
 G_END_DECLS
 
 #endif	/* BM_DEVICE_H */
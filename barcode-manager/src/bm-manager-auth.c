@@ -23,6 +23,11 @@
 
 #include <dbus/dbus-glib-lowlevel.h>
 #include <string.h>
+#include <time.h>
+
+/* How long a polkit answer for a (subject, action) pair is reused */
+#define AUTH_CACHE_TTL_SEC 30
+#define AUTH_CACHE_MAX_ENTRIES 512
 
 struct BMAuthChain {
 	guint32 refcount;
@@ -43,9 +48,150 @@ typedef struct {
 	BMAuthChain *chain;
 	GCancellable *cancellable;
 	char *permission;
+	gboolean allow_interaction;
+	gboolean interactive;
 	gboolean disposed;
+
+	/* Pending delivery of a cached result */
+	guint idle_id;
+	BMAuthCallResult cached_result;
 } PolkitCall;
 
+/* Results of non-interactive checks, keyed by subject and action.  The
+ * subject is the caller's unique bus name, which is never reused, so the
+ * uid doesn't have to be looked up first.
+ */
+typedef struct {
+	PolkitAuthority *authority;
+	gulong changed_id;
+	GHashTable *entries;
+
+	/* Lookups answered from the cache, and those that went to polkit */
+	guint hits;
+	guint misses;
+} AuthCache;
+
+typedef struct {
+	BMAuthCallResult result;
+	guint64 expires;
+} AuthCacheEntry;
+
+static AuthCache auth_cache;
+
+static guint64
+now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+auth_cache_entry_free (gpointer data)
+{
+	g_slice_free (AuthCacheEntry, data);
+}
+
+static void
+auth_cache_changed_cb (PolkitAuthority *authority, gpointer user_data)
+{
+	/* Policy, sessions or temporary authorizations changed */
+	bm_log_dbg (LOGD_CORE, "polkit authority changed; dropping %u cached results "
+	            "(%u hits, %u misses so far)",
+	            g_hash_table_size (auth_cache.entries),
+	            auth_cache.hits, auth_cache.misses);
+	g_hash_table_remove_all (auth_cache.entries);
+}
+
+static void
+auth_cache_attach (PolkitAuthority *authority)
+{
+	if (auth_cache.authority == authority)
+		return;
+
+	if (!auth_cache.entries) {
+		auth_cache.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+		                                            g_free, auth_cache_entry_free);
+	}
+
+	if (auth_cache.authority) {
+		g_signal_handler_disconnect (auth_cache.authority, auth_cache.changed_id);
+		g_object_unref (auth_cache.authority);
+		g_hash_table_remove_all (auth_cache.entries);
+	}
+
+	auth_cache.authority = g_object_ref (authority);
+	auth_cache.changed_id = g_signal_connect (authority, "changed",
+	                                          G_CALLBACK (auth_cache_changed_cb), NULL);
+}
+
+static char *
+auth_cache_key (const char *subject, const char *permission)
+{
+	return g_strconcat (subject, " ", permission, NULL);
+}
+
+static gboolean
+auth_cache_lookup (PolkitAuthority *authority,
+                   const char *subject,
+                   const char *permission,
+                   BMAuthCallResult *out_result)
+{
+	AuthCacheEntry *entry;
+	char *key;
+	gboolean found = FALSE;
+
+	auth_cache_attach (authority);
+
+	key = auth_cache_key (subject, permission);
+	entry = g_hash_table_lookup (auth_cache.entries, key);
+	if (entry) {
+		if (entry->expires > now_us ()) {
+			*out_result = entry->result;
+			found = TRUE;
+		} else
+			g_hash_table_remove (auth_cache.entries, key);
+	}
+	g_free (key);
+
+	if (found)
+		auth_cache.hits++;
+	else
+		auth_cache.misses++;
+	return found;
+}
+
+static gboolean
+remove_expired (gpointer key, gpointer value, gpointer user_data)
+{
+	return ((AuthCacheEntry *) value)->expires <= *(guint64 *) user_data;
+}
+
+static void
+auth_cache_store (PolkitAuthority *authority,
+                  const char *subject,
+                  const char *permission,
+                  BMAuthCallResult result)
+{
+	AuthCacheEntry *entry;
+	guint64 now = now_us ();
+
+	auth_cache_attach (authority);
+
+	/* Entries of callers that left the bus are only dropped here */
+	if (g_hash_table_size (auth_cache.entries) >= AUTH_CACHE_MAX_ENTRIES) {
+		g_hash_table_foreach_remove (auth_cache.entries, remove_expired, &now);
+		if (g_hash_table_size (auth_cache.entries) >= AUTH_CACHE_MAX_ENTRIES)
+			g_hash_table_remove_all (auth_cache.entries);
+	}
+
+	entry = g_slice_new (AuthCacheEntry);
+	entry->result = result;
+	entry->expires = now + (guint64) AUTH_CACHE_TTL_SEC * G_USEC_PER_SEC;
+	g_hash_table_insert (auth_cache.entries, auth_cache_key (subject, permission), entry);
+}
+
 typedef struct {
 	gpointer data;
 	GDestroyNotify destroy;
@@ -177,9 +323,19 @@ bm_auth_chain_check_done (BMAuthChain *self)
 	}
 }
 
+static void polkit_call_free (PolkitCall *call);
+
 static void
 polkit_call_cancel (PolkitCall *call)
 {
+	/* A cached result has no polkit request to wait for */
+	if (call->idle_id) {
+		g_source_remove (call->idle_id);
+		call->idle_id = 0;
+		polkit_call_free (call);
+		return;
+	}
+
 	call->disposed = TRUE;
 	g_cancellable_cancel (call->cancellable);
 }
@@ -198,6 +354,52 @@ polkit_call_free (PolkitCall *call)
 	g_free (call);
 }
 
+static void pk_call_cb (GObject *object, GAsyncResult *result, gpointer user_data);
+
+static void
+check_authorization (PolkitCall *call)
+{
+	BMAuthChain *chain = call->chain;
+	PolkitSubject *subject;
+	PolkitCheckAuthorizationFlags flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
+
+	subject = polkit_system_bus_name_new (chain->owner);
+
+	if (call->interactive)
+		flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
+
+	polkit_authority_check_authorization (chain->authority,
+	                                      subject,
+	                                      call->permission,
+	                                      NULL,
+	                                      flags,
+	                                      call->cancellable,
+	                                      pk_call_cb,
+	                                      call);
+	g_object_unref (subject);
+}
+
+static void
+finish_call (PolkitCall *call, GError *error, BMAuthCallResult result)
+{
+	BMAuthChain *chain = call->chain;
+
+	chain->calls = g_slist_remove (chain->calls, call);
+	chain->call_func (chain, call->permission, error, result, chain->user_data);
+	bm_auth_chain_check_done (chain);
+	polkit_call_free (call);
+}
+
+static gboolean
+cached_call_cb (gpointer user_data)
+{
+	PolkitCall *call = user_data;
+
+	call->idle_id = 0;
+	finish_call (call, NULL, call->cached_result);
+	return FALSE;
+}
+
 static void
 pk_call_cb (GObject *object, GAsyncResult *result, gpointer user_data)
 {
@@ -214,7 +416,6 @@ pk_call_cb (GObject *object, GAsyncResult *result, gpointer user_data)
 	}
 
 	chain = call->chain;
-	chain->calls = g_slist_remove (chain->calls, call);
 
 	pk_result = polkit_authority_check_authorization_finish (chain->authority,
 	                                                         result,
@@ -238,13 +439,22 @@ pk_call_cb (GObject *object, GAsyncResult *result, gpointer user_data)
 			call_result = BM_AUTH_CALL_RESULT_NO;
 	}
 
-	chain->call_func (chain, call->permission, error, call_result, chain->user_data);
-	bm_auth_chain_check_done (chain);
-
-	g_clear_error (&error);
-	polkit_call_free (call);
 	if (pk_result)
 		g_object_unref (pk_result);
+
+	if (!error && !call->interactive) {
+		/* Only answers that needed no authentication are reusable */
+		if (call_result != BM_AUTH_CALL_RESULT_AUTH)
+			auth_cache_store (chain->authority, chain->owner, call->permission, call_result);
+		else if (call->allow_interaction) {
+			call->interactive = TRUE;
+			check_authorization (call);
+			return;
+		}
+	}
+
+	finish_call (call, error, call_result);
+	g_clear_error (&error);
 }
 
 gboolean
@@ -253,36 +463,31 @@ bm_auth_chain_add_call (BMAuthChain *self,
                         gboolean allow_interaction)
 {
 	PolkitCall *call;
-	PolkitSubject *subject;
-	PolkitCheckAuthorizationFlags flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
 
 	g_return_val_if_fail (self != NULL, FALSE);
 	g_return_val_if_fail (self->owner != NULL, FALSE);
 	g_return_val_if_fail (permission != NULL, FALSE);
 
-	subject = polkit_system_bus_name_new (self->owner);
-	if (!subject)
-		return FALSE;
-
 	call = g_malloc0 (sizeof (PolkitCall));
 	call->chain = self;
 	call->permission = g_strdup (permission);
+	call->allow_interaction = allow_interaction;
 	call->cancellable = g_cancellable_new ();
 
 	self->calls = g_slist_append (self->calls, call);
 
-	if (allow_interaction)
-		flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
+	/* Cached answers are still delivered from the main loop, so callers
+	 * can finish adding calls before the chain completes.
+	 */
+	if (auth_cache_lookup (self->authority, self->owner, permission, &call->cached_result)) {
+		call->idle_id = g_idle_add (cached_call_cb, call);
+		return TRUE;
+	}
 
-	polkit_authority_check_authorization (self->authority,
-	                                      subject,
-	                                      permission,
-	                                      NULL,
-	                                      flags,
-	                                      call->cancellable,
-	                                      pk_call_cb,
-	                                      call);
-	g_object_unref (subject);
+	/* Ask without interaction first; only a challenge is repeated with
+	 * interaction allowed, and that answer is never cached.
+	 */
+	check_authorization (call);
 	return TRUE;
 }
 
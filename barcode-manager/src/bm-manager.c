@@ -32,6 +32,10 @@
 #include "bm-dbus-manager.h"
 #include "bm-device-bt.h"
 #include "bm-device-hidraw.h"
+#include "bm-device-private.h"
+#include "bm-bt-index.h"
+#include "bm-device-registry.h"
+#include "bm-state-file.h"
 #include "bm-system.h"
 #include "bm-properties-changed-signal.h"
 #include "bm-setting-bluetooth.h"
@@ -55,6 +59,17 @@ static gboolean impl_manager_set_logging (BMManager *manager,
                                           const char *domains,
                                           GError **error);
 
+static gboolean impl_manager_set_logging_callsite (BMManager *manager,
+                                                   const char *pattern,
+                                                   const char *mode,
+                                                   guint rate,
+                                                   GError **error);
+
+static gboolean impl_manager_get_logging_callsites (BMManager *manager,
+                                                    char ***callsites,
+                                                    guint32 *dropped,
+                                                    GError **error);
+
 #include "bm-manager-glue.h"
 
 static void udev_device_added_cb (BMUdevManager *udev_mgr,
@@ -66,7 +81,12 @@ static void udev_device_removed_cb (BMUdevManager *udev_mgr,
                                     GUdevDevice *device,
                                     gpointer user_data);
 
-static void add_device (BMManager *self, BMDevice *device);
+static void udev_batch_done_cb (BMUdevManager *udev_mgr,
+                                gpointer user_data);
+
+static void add_device (BMManager *self, BMDevice *device, const char *identity);
+
+static void load_device_ids (BMManager *self);
 
 static const char *internal_activate_device (BMManager *manager,
                                              BMDevice *device,
@@ -76,20 +96,28 @@ static const char *internal_activate_device (BMManager *manager,
                                              gboolean assumed,
                                              GError **error);
 
-static GSList * remove_one_device (BMManager *manager,
-                                   GSList *list,
-                                   BMDevice *device,
-                                   gboolean quitting);
+static void remove_one_device (BMManager *manager,
+                               BMDevice *device,
+                               gboolean quitting);
 
 static BMDevice *bm_manager_get_device_by_udi (BMManager *manager, const char *udi);
 
 typedef struct {
 	char *config_file;
-	char *state_file;
+	BMStateFile *state_file;
 
-	GSList *devices;
+	BMDeviceRegistry *devices;
 	BMState state;
 
+	/* Set while a batch of udev events is processed; the state is updated
+	 * once at the end instead of for every device.
+	 */
+	gboolean in_udev_batch;
+
+	/* Device identity -> object path id, persisted in the state file */
+	GHashTable *device_ids;
+	guint next_device_id;
+
 	BMDBusManager *dbus_mgr;
 	BMUdevManager *udev_mgr;
 
@@ -100,6 +128,9 @@ typedef struct {
 
 	GHashTable *system_connections;
 	BMSysconfigSettings *sys_settings;
+
+	/* Bluetooth connections of both scopes by device address */
+	BMBtIndex *bt_connections;
 	char *hostname;
 
 	GSList *secrets_calls;
@@ -219,10 +250,8 @@ bm_manager_error_get_type (void)
 	return etype;
 }
 
-/* Removes a device from a device list; returns the start of the new device list */
-static GSList *
+static void
 remove_one_device (BMManager *manager,
-                   GSList *list,
                    BMDevice *device,
                    gboolean quitting)
 {
@@ -244,11 +273,14 @@ remove_one_device (BMManager *manager,
 		}
 	}
 
+	/* Stops reading from the device, if it was */
+	bm_device_state_changed (device, BM_DEVICE_STATE_UNMANAGED, BM_DEVICE_STATE_REASON_REMOVED);
+
+	bm_device_registry_remove (priv->devices, device);
+
 	bm_sysconfig_settings_device_removed (priv->sys_settings, device);
 	g_signal_emit (manager, signals[DEVICE_REMOVED], 0, device);
 	g_object_unref (device);
-
-	return g_slist_remove (list, device);
 }
 
 BMState
@@ -265,6 +297,9 @@ emit_removed (gpointer key, gpointer value, gpointer user_data)
 	BMManager *manager = BM_MANAGER (user_data);
 	BMConnection *connection = BM_CONNECTION (value);
 
+	/* Callers drop the connections right after */
+	bm_bt_index_remove (BM_MANAGER_GET_PRIVATE (manager)->bt_connections, connection);
+
 	g_signal_emit (manager, signals[CONNECTION_REMOVED], 0,
 	               connection,
 	               bm_connection_get_scope (connection));
@@ -334,6 +369,67 @@ free_get_settings_info (gpointer data)
 	g_slice_free (GetSettingsInfo, data);	
 }
 
+/* Adds the user connection at 'proxy's path with 'settings' unless the same
+ * connection is already known.  Returns TRUE if it was added.
+ */
+static gboolean
+user_add_connection (BMManager *manager,
+                     DBusGProxy *proxy,
+                     GHashTable *settings,
+                     gboolean emit_added)
+{
+	BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (manager);
+	const char *path = dbus_g_proxy_get_path (proxy);
+	GError *error = NULL;
+	BMConnection *connection, *existing;
+
+	connection = bm_connection_new_from_hash (settings, &error);
+	if (connection == NULL) {
+		bm_log_warn (LOGD_USER_SET, "invalid connection: '%s' / '%s' invalid: %d",
+		             g_type_name (bm_connection_lookup_setting_type_by_quark (error->domain)),
+		             error->message, error->code);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	bm_connection_set_path (connection, path);
+	bm_connection_set_scope (connection, BM_CONNECTION_SCOPE_USER);
+
+	/* Add the new connection to the internal hashes only if the same
+	 * connection isn't already there.
+	 */
+	existing = g_hash_table_lookup (priv->user_connections, path);
+	if (existing && bm_connection_compare (existing, connection, BM_SETTING_COMPARE_FLAG_EXACT)) {
+		g_object_unref (connection);
+		return FALSE;
+	}
+
+	if (existing)
+		bm_bt_index_remove (priv->bt_connections, existing);
+	g_hash_table_insert (priv->user_connections,
+	                     g_strdup (path),
+	                     connection);
+	bm_bt_index_update (priv->bt_connections, connection);
+
+	/* Attach the D-Bus proxy representing the remote BMConnection
+	 * to the local BMConnection object to ensure it stays alive to
+	 * continue delivering signals.  It'll be destroyed once the
+	 * BMConnection is destroyed.
+	 */
+	g_object_set_data_full (G_OBJECT (connection),
+	                        "proxy",
+	                        g_object_ref (proxy),
+	                        g_object_unref);
+
+	if (emit_added) {
+		g_signal_emit (manager, signals[CONNECTION_ADDED], 0, connection, BM_CONNECTION_SCOPE_USER);
+		/* Update the Bluetooth connections for that single new connection */
+		// FIXME bluez_manager_resync_devices (manager);
+	}
+
+	return TRUE;
+}
+
 static void
 user_connection_get_settings_cb  (DBusGProxy *proxy,
                                   DBusGProxyCall *call_id,
@@ -342,8 +438,6 @@ user_connection_get_settings_cb  (DBusGProxy *proxy,
 	GetSettingsInfo *info = (GetSettingsInfo *) user_data;
 	GError *err = NULL;
 	GHashTable *settings = NULL;
-	BMConnection *connection;
-	BMManager *manager;
 
 	g_return_if_fail (info != NULL);
 
@@ -356,59 +450,11 @@ user_connection_get_settings_cb  (DBusGProxy *proxy,
 		goto out;
 	}
 
-	manager = info->manager;
-	connection = info->connection;
- 	if (connection == NULL) {
-		const char *path = dbus_g_proxy_get_path (proxy);
-		BMManagerPrivate *priv;
-		GError *error = NULL;
-		BMConnection *existing = NULL;
-
-		connection = bm_connection_new_from_hash (settings, &error);
-		if (connection == NULL) {
-			bm_log_warn (LOGD_USER_SET, "invalid connection: '%s' / '%s' invalid: %d",
-			             g_type_name (bm_connection_lookup_setting_type_by_quark (error->domain)),
-			             error->message, error->code);
-			g_error_free (error);
-			goto out;
-		}
-
-		bm_connection_set_path (connection, path);
-		bm_connection_set_scope (connection, BM_CONNECTION_SCOPE_USER);
-
-		/* Add the new connection to the internal hashes only if the same
-		 * connection isn't already there.
-		 */
-		priv = BM_MANAGER_GET_PRIVATE (manager);
-
-		existing = g_hash_table_lookup (priv->user_connections, path);
-		if (!existing || !bm_connection_compare (existing, connection, BM_SETTING_COMPARE_FLAG_EXACT)) {
-			g_hash_table_insert (priv->user_connections,
-			                     g_strdup (path),
-			                     connection);
-			existing = NULL;
-
-			/* Attach the D-Bus proxy representing the remote BMConnection
-			 * to the local BMConnection object to ensure it stays alive to
-			 * continue delivering signals.  It'll be destroyed once the
-			 * BMConnection is destroyed.
-			 */
-			g_object_set_data_full (G_OBJECT (connection),
-			                        "proxy",
-			                        g_object_ref (info->proxy),
-									g_object_unref);
-		} else
-			g_object_unref (connection);
-
+	if (info->connection == NULL) {
 		/* If the connection-added signal is supposed to be batched, don't
-		 * emit the single connection-added here.  Also, don't emit the signal
-		 * if the connection wasn't actually added to the system or user hashes.
+		 * emit the single connection-added here.
 		 */
-		if (!info->calls && !existing) {
-			g_signal_emit (manager, signals[CONNECTION_ADDED], 0, connection, BM_CONNECTION_SCOPE_USER);
-			/* Update the Bluetooth connections for that single new connection */
-			// FIXME bluez_manager_resync_devices (manager);
-		}
+		user_add_connection (info->manager, info->proxy, settings, !info->calls);
 	} else {
 		// FIXME: merge settings? or just replace?
 		bm_log_dbg (LOGD_USER_SET, "implement merge settings");
@@ -431,6 +477,7 @@ remove_connection (BMManager *manager,
      * was created.
      */
     g_object_ref (connection);
+    bm_bt_index_remove (BM_MANAGER_GET_PRIVATE (manager)->bt_connections, connection);
     g_hash_table_remove (hash, bm_connection_get_path (connection));
     g_signal_emit (manager, signals[CONNECTION_REMOVED], 0,
                    connection,
@@ -489,6 +536,9 @@ user_connection_updated_cb (DBusGProxy *proxy,
 
 	valid = bm_connection_replace_settings (old_connection, settings, NULL);
 	if (valid) {
+		/* The address or type may have changed */
+		bm_bt_index_update (priv->bt_connections, old_connection);
+
 		g_signal_emit (manager, signals[CONNECTION_UPDATED], 0,
 		               old_connection,
 		               bm_connection_get_scope (old_connection));
@@ -499,15 +549,18 @@ user_connection_updated_cb (DBusGProxy *proxy,
 	}
 }
 
-static void
-user_internal_new_connection_cb (BMManager *manager,
-                                 const char *path,
-                                 guint32 *counter)
+static void user_connection_updated_cb (DBusGProxy *proxy, GHashTable *settings, gpointer user_data);
+static void user_connection_removed_cb (DBusGProxy *proxy, gpointer user_data);
+
+/* Creates the proxy for the user connection at 'path' and hooks up its
+ * change notifications.
+ */
+static DBusGProxy *
+user_connection_proxy_new (BMManager *manager, const char *path)
 {
-	GetSettingsInfo *info;
+	BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (manager);
 	DBusGProxy *con_proxy;
 	DBusGConnection *g_connection;
-	BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (manager);
 
 	g_connection = bm_dbus_manager_get_connection (priv->dbus_mgr);
 	con_proxy = dbus_g_proxy_new_for_name (g_connection,
@@ -516,7 +569,7 @@ user_internal_new_connection_cb (BMManager *manager,
 	                                       BM_DBUS_IFACE_SETTINGS_CONNECTION);
 	if (!con_proxy) {
 		bm_log_err (LOGD_USER_SET, "could not init user connection proxy");
-		return;
+		return NULL;
 	}
 
 	dbus_g_proxy_add_signal (con_proxy, "Updated",
@@ -532,6 +585,20 @@ user_internal_new_connection_cb (BMManager *manager,
 	                             G_CALLBACK (user_connection_removed_cb),
 	                             manager,
 	                             NULL);
+	return con_proxy;
+}
+
+static void
+user_internal_new_connection_cb (BMManager *manager,
+                                 const char *path,
+                                 guint32 *counter)
+{
+	GetSettingsInfo *info;
+	DBusGProxy *con_proxy;
+
+	con_proxy = user_connection_proxy_new (manager, path);
+	if (!con_proxy)
+		return;
 
 	info = g_slice_new0 (GetSettingsInfo);
 	info->manager = g_object_ref (manager);
@@ -580,6 +647,55 @@ user_list_connections_cb  (DBusGProxy *proxy,
 	g_ptr_array_free (ops, TRUE);
 }
 
+static void
+user_get_all_connections_cb (DBusGProxy *proxy,
+                             DBusGProxyCall *call_id,
+                             gpointer user_data)
+{
+	BMManager *manager = BM_MANAGER (user_data);
+	GError *err = NULL;
+	GHashTable *connections = NULL;
+	GHashTableIter iter;
+	const char *path;
+	GHashTable *settings;
+	guint added = 0;
+
+	if (!dbus_g_proxy_end_call (proxy, call_id, &err,
+	                            DBUS_TYPE_G_MAP_OF_MAP_OF_MAP_OF_VARIANT, &connections,
+	                            G_TYPE_INVALID)) {
+		/* Older settings services can only list connections and have
+		 * their settings fetched one at a time.
+		 */
+		bm_log_dbg (LOGD_USER_SET, "GetAllConnections failed (%s); listing connections instead",
+		            err && err->message ? err->message : "(unknown)");
+		g_clear_error (&err);
+
+		dbus_g_proxy_begin_call (proxy, "ListConnections",
+		                         user_list_connections_cb,
+		                         manager,
+		                         NULL,
+		                         G_TYPE_INVALID);
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, connections);
+	while (g_hash_table_iter_next (&iter, (gpointer) &path, (gpointer) &settings)) {
+		DBusGProxy *con_proxy;
+
+		con_proxy = user_connection_proxy_new (manager, path);
+		if (!con_proxy)
+			continue;
+
+		if (user_add_connection (manager, con_proxy, settings, FALSE))
+			added++;
+		g_object_unref (con_proxy);
+	}
+	g_hash_table_destroy (connections);
+
+	bm_log_dbg (LOGD_USER_SET, "got %u user connections in one call", added);
+	g_signal_emit (manager, signals[CONNECTIONS_ADDED], 0, BM_CONNECTION_SCOPE_USER);
+}
+
 static void
 user_proxy_destroyed_cb (DBusGProxy *proxy, BMManager *self)
 {
@@ -671,9 +787,9 @@ user_proxy_auth_done (BMAuthChain *chain,
                           G_CALLBACK (user_proxy_destroyed_cb),
                           self);
 
-        /* Request user connections */
-        dbus_g_proxy_begin_call (priv->user_proxy, "ListConnections",
-                                 user_list_connections_cb,
+        /* Request user connections, with all their settings at once */
+        dbus_g_proxy_begin_call (priv->user_proxy, "GetAllConnections",
+                                 user_get_all_connections_cb,
                                  self,
                                  NULL,
                                  G_TYPE_INVALID);
@@ -762,13 +878,13 @@ system_query_connections (BMManager *manager)
 static BMDevice *
 bm_manager_get_device_by_path (BMManager *manager, const char *path)
 {
-	GSList *iter;
+	return bm_device_registry_lookup_path (BM_MANAGER_GET_PRIVATE (manager)->devices, path);
+}
 
-	for (iter = BM_MANAGER_GET_PRIVATE (manager)->devices; iter; iter = iter->next) {
-		if (!strcmp (bm_device_get_path (BM_DEVICE (iter->data)), path))
-			return BM_DEVICE (iter->data);
-	}
-	return NULL;
+static BMDevice *
+bm_manager_get_device_by_udi (BMManager *manager, const char *udi)
+{
+	return bm_device_registry_lookup_udi (BM_MANAGER_GET_PRIVATE (manager)->devices, udi);
 }
 
 static void
@@ -792,128 +908,13 @@ bm_manager_name_owner_changed (BMDBusManager *mgr,
 	}
 }
 
-/* Store value into key-file; supported types: boolean, int, string */
-static gboolean
-write_value_to_state_file (const char *filename,
-                           const char *group,
-                           const char *key,
-                           GType value_type,
-                           gpointer value,
-                           GError **error)
-{
-	GKeyFile *key_file;
-	char *data;
-	gsize len = 0;
-	gboolean ret = FALSE;
-
-	g_return_val_if_fail (filename != NULL, FALSE);
-	g_return_val_if_fail (group != NULL, FALSE);
-	g_return_val_if_fail (key != NULL, FALSE);
-	g_return_val_if_fail (value_type == G_TYPE_BOOLEAN ||
-	                      value_type == G_TYPE_INT ||
-	                      value_type == G_TYPE_STRING,
-	                      FALSE);
-
-	key_file = g_key_file_new ();
-	if (!key_file)
-		return FALSE;
-
-	g_key_file_set_list_separator (key_file, ',');
-	g_key_file_load_from_file (key_file, filename, G_KEY_FILE_KEEP_COMMENTS, NULL);
-	switch (value_type) {
-	case G_TYPE_BOOLEAN:
-		g_key_file_set_boolean (key_file, group, key, *((gboolean *) value));
-		break;
-	case G_TYPE_INT:
-		g_key_file_set_integer (key_file, group, key, *((gint *) value));
-		break;
-	case G_TYPE_STRING:
-		g_key_file_set_string (key_file, group, key, *((const gchar **) value));
-		break;
-	}
-
-	data = g_key_file_to_data (key_file, &len, NULL);
-	if (data) {
-		ret = g_file_set_contents (filename, data, len, error);
-		g_free (data);
-	}
-	g_key_file_free (key_file);
-
-	return ret;
-}
-
-static gboolean
-bdaddr_matches_connection (BMSettingBluetooth *s_bt, const char *bdaddr)
-{
-	const GByteArray *arr;
-	gboolean ret = FALSE;
-
-	arr = bm_setting_bluetooth_get_bdaddr (s_bt);
-
-	if (   arr != NULL 
-	       && arr->len == ETH_ALEN) {
-		char *str;
-
-		str = g_strdup_printf ("%02X:%02X:%02X:%02X:%02X:%02X",
-				       arr->data[0],
-				       arr->data[1],
-				       arr->data[2],
-				       arr->data[3],
-				       arr->data[4],
-				       arr->data[5]);
-		ret = g_str_equal (str, bdaddr);
-		g_free (str);
-	}
-
-	return ret;
-}
-
 static BMConnection *
 bluez_manager_find_connection (BMManager *manager,
                                const char *bdaddr,
                                guint32 capabilities)
 {
-	BMConnection *found = NULL;
-	GSList *connections, *l;
-
-	connections = bm_manager_get_connections (manager, BM_CONNECTION_SCOPE_SYSTEM);
-	connections = g_slist_concat (connections, bm_manager_get_connections (manager, BM_CONNECTION_SCOPE_USER));
-
-	for (l = connections; l != NULL; l = l->next) {
-		BMConnection *candidate = BM_CONNECTION (l->data);
-		BMSettingConnection *s_con;
-		BMSettingBluetooth *s_bt;
-		const char *con_type;
-		const char *bt_type;
-
-		s_con = BM_SETTING_CONNECTION (bm_connection_get_setting (candidate, BM_TYPE_SETTING_CONNECTION));
-		g_assert (s_con);
-		con_type = bm_setting_connection_get_connection_type (s_con);
-		g_assert (con_type);
-		if (!g_str_equal (con_type, BM_SETTING_BLUETOOTH_SETTING_NAME))
-			continue;
-
-		s_bt = (BMSettingBluetooth *) bm_connection_get_setting (candidate, BM_TYPE_SETTING_BLUETOOTH);
-		if (!s_bt)
-			continue;
-
-		if (!bdaddr_matches_connection (s_bt, bdaddr))
-			continue;
-
-		bt_type = bm_setting_bluetooth_get_connection_type (s_bt);
-		if (   g_str_equal (bt_type, BM_SETTING_BLUETOOTH_TYPE_DUN)
-		    && !(capabilities & BM_BT_CAPABILITY_DUN))
-		    	continue;
-		if (   g_str_equal (bt_type, BM_SETTING_BLUETOOTH_TYPE_PANU)
-		    && !(capabilities & BM_BT_CAPABILITY_NAP))
-		    	continue;
-
-		found = candidate;
-		break;
-	}
-
-	g_slist_free (connections);
-	return found;
+	return bm_bt_index_lookup (BM_MANAGER_GET_PRIVATE (manager)->bt_connections,
+	                           bdaddr, capabilities);
 }
 
 static gboolean
@@ -934,6 +935,32 @@ impl_manager_set_logging (BMManager *manager,
 	return FALSE;
 }
 
+static gboolean
+impl_manager_set_logging_callsite (BMManager *manager,
+                                   const char *pattern,
+                                   const char *mode,
+                                   guint rate,
+                                   GError **error)
+{
+	if (bm_logging_set_callsite (pattern, mode, rate, error)) {
+		bm_log_info (LOGD_CORE, "logging: call sites '%s' mode '%s' rate %u",
+		             pattern, mode, rate);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static gboolean
+impl_manager_get_logging_callsites (BMManager *manager,
+                                    char ***callsites,
+                                    guint32 *dropped,
+                                    GError **error)
+{
+	*callsites = bm_logging_get_callsites ();
+	*dropped = bm_logging_get_dropped ();
+	return TRUE;
+}
+
 void
 bm_manager_start (BMManager *self)
 {
@@ -1070,14 +1097,29 @@ bm_manager_get (const char *config_file,
 		return NULL;
 	}
 	bm_settings_service_export (BM_SETTINGS_SERVICE (priv->sys_settings));
+	bm_dbus_manager_register_object (priv->dbus_mgr, BM_DBUS_PATH_SETTINGS, priv->sys_settings);
 
 	priv->config_file = g_strdup (config_file);
 
-	priv->state_file = g_strdup (state_file);
+	if (state_file)
+		priv->state_file = bm_state_file_new (state_file);
+	load_device_ids (singleton);
 
-	dbus_g_connection_register_g_object (bm_dbus_manager_get_connection (priv->dbus_mgr),
-	                                     BM_DBUS_PATH,
-	                                     G_OBJECT (singleton));
+	bm_dbus_manager_register_object (priv->dbus_mgr, BM_DBUS_PATH, singleton);
+
+	/* Events clients can't recover by re-reading properties survive a
+	 * bus restart.
+	 */
+	bm_dbus_manager_queue_signal (priv->dbus_mgr, BM_TYPE_MANAGER, "state-changed",
+	                              BM_DBUS_INTERFACE, "StateChanged");
+	bm_dbus_manager_queue_signal (priv->dbus_mgr, BM_TYPE_MANAGER, "device-added",
+	                              BM_DBUS_INTERFACE, "DeviceAdded");
+	bm_dbus_manager_queue_signal (priv->dbus_mgr, BM_TYPE_MANAGER, "device-removed",
+	                              BM_DBUS_INTERFACE, "DeviceRemoved");
+	bm_dbus_manager_queue_signal (priv->dbus_mgr, BM_TYPE_DEVICE_INTERFACE, "state-changed",
+	                              BM_DBUS_INTERFACE_DEVICE, "StateChanged");
+	bm_dbus_manager_queue_signal (priv->dbus_mgr, BM_TYPE_DEVICE_HIDRAW, "scanned",
+	                              BM_DBUS_INTERFACE_DEVICE_HIDRAW, "Scanned");
 
 	g_signal_connect (priv->dbus_mgr,
 	                  "name-owner-changed",
@@ -1094,6 +1136,10 @@ bm_manager_get (const char *config_file,
                       "device-removed",
                       G_CALLBACK (udev_device_removed_cb),
                       singleton);
+    g_signal_connect (priv->udev_mgr,
+                      "batch-done",
+                      G_CALLBACK (udev_batch_done_cb),
+                      singleton);
 
 	return singleton;
 }
@@ -1122,9 +1168,18 @@ dispose (GObject *object)
 	g_hash_table_destroy (priv->system_connections);
 	priv->system_connections = NULL;
 
+	bm_bt_index_free (priv->bt_connections);
+	priv->bt_connections = NULL;
+
 	g_free (priv->hostname);
 	g_free (priv->config_file);
 
+	/* Writes out anything still pending */
+	if (priv->state_file) {
+		bm_state_file_free (priv->state_file);
+		priv->state_file = NULL;
+	}
+
 	if (priv->sys_settings) {
 		g_object_unref (priv->sys_settings);
 		priv->sys_settings = NULL;
@@ -1139,6 +1194,11 @@ dispose (GObject *object)
 	}
 	g_object_unref (priv->dbus_mgr);
 
+	bm_device_registry_free (priv->devices);
+	priv->devices = NULL;
+	g_hash_table_destroy (priv->device_ids);
+	priv->device_ids = NULL;
+
 	// FIXME G_OBJECT_CLASS (bm_manager_parent_class)->dispose (object);
 }
 
@@ -1198,6 +1258,9 @@ bm_manager_init (BMManager *manager)
 	priv->sleeping = FALSE;
 	priv->state = BM_STATE_DISCONNECTED;
 
+	priv->devices = bm_device_registry_new ();
+	priv->device_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
 	priv->dbus_mgr = bm_dbus_manager_get ();
 
 	priv->user_connections = g_hash_table_new_full (g_str_hash,
@@ -1210,6 +1273,8 @@ bm_manager_init (BMManager *manager)
 	                                                  g_free,
 	                                                  g_object_unref);
 
+	priv->bt_connections = bm_bt_index_new ();
+
 	g_connection = bm_dbus_manager_get_connection (priv->dbus_mgr);
 }
 
@@ -1376,10 +1441,11 @@ bm_manager_update_state (BMManager *manager)
     if (manager_sleeping (manager))
         new_state = BM_STATE_ASLEEP;
     else {
-        GSList *iter;
+        const GPtrArray *devices = bm_device_registry_get_devices (priv->devices);
+        guint i;
 
-        for (iter = priv->devices; iter; iter = iter->next) {
-            BMDevice *dev = BM_DEVICE (iter->data);
+        for (i = 0; i < devices->len; i++) {
+            BMDevice *dev = BM_DEVICE (g_ptr_array_index (devices, i));
 
             if (bm_device_get_state (dev) == BM_DEVICE_STATE_ACTIVATED) {
                 new_state = BM_STATE_CONNECTED;
@@ -1406,16 +1472,22 @@ do_sleep_wake (BMManager *self)
 {
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
     const GSList *unmanaged_specs;
-    GSList *iter;
+    const GPtrArray *devices;
+    guint i;
 
     if (manager_sleeping (self)) {
         bm_log_info (LOGD_SUSPEND, "sleeping or disabling...");
 
+        bm_udev_manager_suspend (priv->udev_mgr);
     } else {
         bm_log_info (LOGD_SUSPEND, "waking up and re-enabling...");
 
+        /* Pick up devices that came or went while we were away */
+        bm_udev_manager_resume (priv->udev_mgr);
+
         /* Re-manage managed devices */
-        for (iter = priv->devices; iter; iter = iter->next) {
+        devices = bm_device_registry_get_devices (priv->devices);
+        for (i = 0; i < devices->len; i++) {
 			//            BMDevice *device = BM_DEVICE (iter->data);
             // guint i;
         }
@@ -1431,21 +1503,10 @@ static void
 _internal_enable (BMManager *self, gboolean enable)
 {
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
-    GError *err = NULL;
 
     /* Update "NetworkingEnabled" key in state file */
-    if (priv->state_file) {
-		if (!write_value_to_state_file (priv->state_file,
-                                        "main", "NetworkingEnabled",
-                                        G_TYPE_BOOLEAN, (gpointer) &enable,
-										&err)) {
-            /* Not a hard error */
-            bm_log_warn (LOGD_SUSPEND, "writing to state file %s failed: (%d) %s.",
-                         priv->state_file,
-                         err ? err->code : -1,
-                         (err && err->message) ? err->message : "unknown");
-        }
-    }
+    if (priv->state_file)
+        bm_state_file_set_boolean (priv->state_file, "main", "NetworkingEnabled", enable);
 
     bm_log_info (LOGD_SUSPEND, "%s requested (sleeping: %s  enabled: %s)",
                  enable ? "enable" : "disable",
@@ -1573,14 +1634,16 @@ static gboolean
 impl_manager_get_devices (BMManager *manager, GPtrArray **devices, GError **err)
 {
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (manager);
-    GSList *iter;
+    const GPtrArray *known;
+    guint i;
 
 	bm_log_dbg (LOGD_CORE, "impl_manager_get_devices");
 
-    *devices = g_ptr_array_sized_new (g_slist_length (priv->devices));
+    known = bm_device_registry_get_devices (priv->devices);
+    *devices = g_ptr_array_sized_new (known->len);
 
-    for (iter = priv->devices; iter; iter = iter->next)
-        g_ptr_array_add (*devices, g_strdup (bm_device_get_path (BM_DEVICE (iter->data))));
+    for (i = 0; i < known->len; i++)
+        g_ptr_array_add (*devices, g_strdup (bm_device_get_path (BM_DEVICE (g_ptr_array_index (known, i)))));
 
     return TRUE;
 }
@@ -1589,16 +1652,8 @@ static BMDevice *
 find_device_by_iface (BMManager *self, const gchar *iface)
 {
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
-    GSList *iter;
-
-    for (iter = priv->devices; iter; iter = g_slist_next (iter)) {
-        BMDevice *device = BM_DEVICE (iter->data);
-        const gchar *d_iface = bm_device_get_iface (device);
-        if (!strcmp (d_iface, iface))
-            return device;
-    }
 
-    return NULL;
+    return bm_device_registry_lookup_iface (priv->devices, iface);
 }
 
 static void
@@ -1609,6 +1664,7 @@ manager_device_state_changed (BMDevice *device,
                               gpointer user_data)
 {
     BMManager *manager = BM_MANAGER (user_data);
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (manager);
 
     switch (new_state) {
     case BM_DEVICE_STATE_UNMANAGED:
@@ -1622,7 +1678,8 @@ manager_device_state_changed (BMDevice *device,
         break;
     }
 
-    bm_manager_update_state (manager);
+    if (!priv->in_udev_batch)
+        bm_manager_update_state (manager);
 
     if (new_state == BM_DEVICE_STATE_ACTIVATED) {
         // TODO update_active_connection_timestamp (manager, device);
@@ -1630,30 +1687,111 @@ manager_device_state_changed (BMDevice *device,
 }
 
 static void
-add_device (BMManager *self, BMDevice *device)
+load_device_ids (BMManager *self)
+{
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
+    char **keys;
+    gsize i, len = 0;
+
+    if (!priv->state_file)
+        return;
+
+    keys = bm_state_file_get_keys (priv->state_file, "devices", &len);
+    for (i = 0; i < len; i++) {
+        GError *error = NULL;
+        gint id;
+
+        id = bm_state_file_get_integer (priv->state_file, "devices", keys[i], &error);
+        if (error || id < 0) {
+            bm_log_warn (LOGD_CORE, "ignoring invalid device id for '%s' in state file", keys[i]);
+            g_clear_error (&error);
+            continue;
+        }
+
+        g_hash_table_insert (priv->device_ids, g_strdup (keys[i]), GUINT_TO_POINTER (id));
+        priv->next_device_id = MAX (priv->next_device_id, (guint) id + 1);
+    }
+
+    g_strfreev (keys);
+}
+
+/* Picks the object path id for a new device.  Devices with an identity get
+ * the same id every time they appear, so clients can keep their proxies
+ * across replugs and restarts; others get a fresh one.  Nothing is recorded
+ * until commit_device_id(), so a device that is then rejected uses up no id.
+ * '*identity' is cleared if the device's id must not be remembered.
+ */
+static guint
+reserve_device_id (BMManager *self, const char **identity)
+{
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
+    gpointer value;
+    char *path;
+    gboolean in_use;
+
+    if (*identity && g_hash_table_lookup_extended (priv->device_ids, *identity, NULL, &value)) {
+        path = g_strdup_printf (BM_DBUS_PATH "/Devices/%u", GPOINTER_TO_UINT (value));
+        in_use = bm_device_registry_lookup_path (priv->devices, path) != NULL;
+        g_free (path);
+        if (!in_use)
+            return GPOINTER_TO_UINT (value);
+
+        /* Another device with the same identity is still around */
+        *identity = NULL;
+    }
+
+    return priv->next_device_id;
+}
+
+static void
+commit_device_id (BMManager *self, const char *identity, guint id)
+{
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
+
+    /* Remembered ids are all below next_device_id */
+    if (id != priv->next_device_id)
+        return;
+
+    priv->next_device_id++;
+
+    if (identity) {
+        g_hash_table_insert (priv->device_ids, g_strdup (identity), GUINT_TO_POINTER (id));
+
+        if (priv->state_file)
+            bm_state_file_set_integer (priv->state_file, "devices", identity, id);
+    }
+}
+
+static void
+add_device (BMManager *self, BMDevice *device, const char *identity)
 {
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
     const char *iface, *driver, *type_desc;
     char *path;
-    static guint32 devcount = 0;
     const GSList *unmanaged_specs;
     BMConnection *existing = NULL;
     GHashTableIter iter;
     gpointer value;
     gboolean managed = FALSE, enabled = FALSE;
+    guint id;
 
     iface = bm_device_get_iface (device);
 	// FIXME   g_assert (iface);
 
     bm_log_info (LOGD_HW, "%s new device", iface);
 
-	/* FIXME more checks here
-    if (!BM_IS_DEVICE_MODEM (device) && find_device_by_iface (self, iface)) {
+    /* The object path is an index key, so assign it before registering */
+    id = reserve_device_id (self, &identity);
+    path = g_strdup_printf (BM_DBUS_PATH "/Devices/%u", id);
+    bm_device_set_path (device, path);
+
+    if (!bm_device_registry_add (priv->devices, device, iface, bm_device_get_udi (device), path)) {
+        bm_log_warn (LOGD_HW, "(%s): device already known, ignoring", iface);
         g_object_unref (device);
+        g_free (path);
         return;
-		}*/
-
-    priv->devices = g_slist_append (priv->devices, device);
+    }
+    commit_device_id (self, identity, id);
 
     g_signal_connect (device, "state-changed",
                       G_CALLBACK (manager_device_state_changed),
@@ -1674,18 +1812,18 @@ add_device (BMManager *self, BMDevice *device)
     bm_log_info (LOGD_HW, "(%s): new %s device (driver: '%s')",
                  iface, type_desc, driver);
 
-    path = g_strdup_printf ("/org/freedesktop/BarcodeManager/Devices/%d", devcount++);
-    bm_device_set_path (device, path);
-    dbus_g_connection_register_g_object (bm_dbus_manager_get_connection (priv->dbus_mgr),
-                                         path,
-                                         G_OBJECT (device));
+    bm_dbus_manager_register_object (priv->dbus_mgr, path, device);
     bm_log_info (LOGD_CORE, "(%s): exported as %s", iface, path);
     g_free (path);
 
     bm_sysconfig_settings_device_added (priv->sys_settings, device);
     g_signal_emit (self, signals[DEVICE_ADDED], 0, device);
 
-	// FIXME process states here
+    /* hidraw scanners need no configuration; start reading right away so
+     * scans are emitted from the device's object path.
+     */
+    if (BM_IS_DEVICE_HIDRAW (device) && !manager_sleeping (self))
+        bm_device_state_changed (device, BM_DEVICE_STATE_ACTIVATED, BM_DEVICE_STATE_REASON_NOW_MANAGED);
 }
 
 static void
@@ -1695,13 +1833,20 @@ udev_device_added_cb (BMUdevManager *udev_mgr,
                       gpointer user_data)
 {
     BMManager *self = BM_MANAGER (user_data);
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
     GObject *device;
 
+    priv->in_udev_batch = TRUE;
+
     device = creator_fn (udev_mgr, udev_device, manager_sleeping (self));
 
     if (device) {
+        char *identity;
+
 		bm_log_dbg (LOGD_HW, "processing..");
-        add_device (self, BM_DEVICE (device));
+        identity = bm_udev_manager_get_device_identity (udev_mgr, udev_device);
+        add_device (self, BM_DEVICE (device), identity);
+        g_free (identity);
 	} else {
 		bm_log_dbg (LOGD_HW, "skipping..");
 	}
@@ -1716,9 +1861,23 @@ udev_device_removed_cb (BMUdevManager *manager,
     BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
     BMDevice *device;
 
+    priv->in_udev_batch = TRUE;
+
 	device = find_device_by_iface (self, g_udev_device_get_name (udev_device));
 
     if (device)
-        priv->devices = remove_one_device (self, priv->devices, device, FALSE);
+        remove_one_device (self, device, FALSE);
+}
+
+static void
+udev_batch_done_cb (BMUdevManager *udev_mgr, gpointer user_data)
+{
+    BMManager *self = BM_MANAGER (user_data);
+    BMManagerPrivate *priv = BM_MANAGER_GET_PRIVATE (self);
+
+    if (priv->in_udev_batch) {
+        priv->in_udev_batch = FALSE;
+        bm_manager_update_state (self);
+    }
 }
 
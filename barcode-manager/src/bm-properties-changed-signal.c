@@ -26,32 +26,145 @@
 #include "bm-properties-changed-signal.h"
 #include "bm-dbus-glib-types.h"
 
-#define BM_DBUS_PROPERTY_CHANGED "BM_DBUS_PROPERTY_CHANGED"
+/* Upper bound on how long a change may wait for the main loop to go idle
+ * before PropertiesChanged is sent anyway; 0 waits for idle only.
+ */
+static guint max_delay = 100;
 
+/* Per-class table of exported properties, built on the first notify of an
+ * instance of the class.
+ */
+typedef struct {
+	guint n_props;
+	GParamSpec **pspecs;
+	char **names;          /* D-Bus names, like "ScanBytes" */
+	GHashTable *index;     /* GParamSpec -> index + 1 */
+	guint signal_id;
+} ClassInfo;
+
+/* Per-object state; notify only sets a bit in 'dirty', the values are read
+ * when the signal is emitted.
+ */
 typedef struct {
+	ClassInfo *klass;
+	guint32 *dirty;
+	GValue *values;
 	GHashTable *hash;
-	gulong signal_id;
 	guint idle_id;
+	guint timeout_id;
 } PropertiesChangedInfo;
 
-static void
-destroy_value (gpointer data)
+#define DIRTY_WORDS(n) (((n) + 31) / 32)
+
+static GQuark
+class_info_quark (void)
 {
-	GValue *val = (GValue *) data;
+	static GQuark quark = 0;
 
-	g_value_unset (val);
-	g_slice_free (GValue, val);
+	if (!quark)
+		quark = g_quark_from_static_string ("bm-properties-changed-class-info");
+	return quark;
+}
+
+static GQuark
+info_quark (void)
+{
+	static GQuark quark = 0;
+
+	if (!quark)
+		quark = g_quark_from_static_string ("bm-properties-changed-info");
+	return quark;
+}
+
+static char*
+uscore_to_wincaps (const char *uscore)
+{
+	const char *p;
+	GString *str;
+	gboolean last_was_uscore;
+
+	last_was_uscore = TRUE;
+  
+	str = g_string_new (NULL);
+	p = uscore;
+	while (p && *p) {
+		if (*p == '-' || *p == '_')
+			last_was_uscore = TRUE;
+		else {
+			if (last_was_uscore) {
+				g_string_append_c (str, g_ascii_toupper (*p));
+				last_was_uscore = FALSE;
+			} else
+				g_string_append_c (str, *p);
+		}
+		++p;
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static ClassInfo *
+class_info_get (GObject *object)
+{
+	GType type = G_OBJECT_TYPE (object);
+	ClassInfo *klass;
+	GParamSpec **pspecs;
+	guint n_pspecs, i;
+
+	klass = g_type_get_qdata (type, class_info_quark ());
+	if (klass)
+		return klass;
+
+	pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (object), &n_pspecs);
+
+	klass = g_new0 (ClassInfo, 1);
+	klass->pspecs = g_new0 (GParamSpec *, n_pspecs);
+	klass->names = g_new0 (char *, n_pspecs + 1);
+	klass->index = g_hash_table_new (g_direct_hash, g_direct_equal);
+	klass->signal_id = g_signal_lookup ("properties-changed", type);
+	g_assert (klass->signal_id);
+
+	for (i = 0; i < n_pspecs; i++) {
+		GParamSpec *pspec = pspecs[i];
+		GParamSpec *target;
+		guint n = klass->n_props;
+
+		if (pspec->flags & BM_PROPERTY_PARAM_NO_EXPORT)
+			continue;
+		if (!(pspec->flags & G_PARAM_READABLE))
+			continue;
+
+		klass->pspecs[n] = pspec;
+		klass->names[n] = uscore_to_wincaps (pspec->name);
+		g_hash_table_insert (klass->index, pspec, GUINT_TO_POINTER (n + 1));
+
+		/* Notifications for overridden properties arrive with the
+		 * interface's pspec.
+		 */
+		target = g_param_spec_get_redirect_target (pspec);
+		if (target)
+			g_hash_table_insert (klass->index, target, GUINT_TO_POINTER (n + 1));
+
+		klass->n_props++;
+	}
+	g_free (pspecs);
+
+	/* Lives as long as the type does */
+	g_type_set_qdata (type, class_info_quark (), klass);
+	return klass;
 }
 
 static PropertiesChangedInfo *
-properties_changed_info_new (void)
+properties_changed_info_new (ClassInfo *klass)
 {
 	PropertiesChangedInfo *info;
 
 	info = g_slice_new0 (PropertiesChangedInfo);
-	info->hash = g_hash_table_new_full (g_str_hash, g_str_equal, 
-								 (GDestroyNotify) g_free,
-								 destroy_value);
+	info->klass = klass;
+	info->dirty = g_new0 (guint32, DIRTY_WORDS (klass->n_props));
+	info->values = g_new0 (GValue, klass->n_props);
+	/* Keys are the class' names, values point into info->values */
+	info->hash = g_hash_table_new (g_str_hash, g_str_equal);
 	return info;
 }
 
@@ -62,8 +175,12 @@ properties_changed_info_destroy (gpointer data)
 
 	if (info->idle_id)
 		g_source_remove (info->idle_id);
+	if (info->timeout_id)
+		g_source_remove (info->timeout_id);
 
 	g_hash_table_destroy (info->hash);
+	g_free (info->values);
+	g_free (info->dirty);
 	g_slice_free (PropertiesChangedInfo, info);
 }
 
@@ -94,13 +211,23 @@ add_to_string (gpointer key, gpointer value, gpointer user_data)
 }
 #endif
 
-static gboolean
-properties_changed (gpointer data)
+static void
+properties_changed (GObject *object, PropertiesChangedInfo *info)
 {
-	GObject *object = G_OBJECT (data);
-	PropertiesChangedInfo *info = (PropertiesChangedInfo *) g_object_get_data (object, BM_DBUS_PROPERTY_CHANGED);
+	ClassInfo *klass = info->klass;
+	guint i;
 
-	g_assert (info);
+	for (i = 0; i < klass->n_props; i++) {
+		GValue *value = &info->values[i];
+
+		if (!(info->dirty[i / 32] & (1U << (i % 32))))
+			continue;
+
+		g_value_init (value, klass->pspecs[i]->value_type);
+		g_object_get_property (object, klass->pspecs[i]->name, value);
+		g_hash_table_insert (info->hash, klass->names[i], value);
+	}
+	memset (info->dirty, 0, DIRTY_WORDS (klass->n_props) * sizeof (guint32));
 
 #ifdef DEBUG
 	{
@@ -110,75 +237,79 @@ properties_changed (gpointer data)
 	}
 #endif
 
-	g_signal_emit (object, info->signal_id, 0, info->hash);
-	g_hash_table_remove_all (info->hash);
+	g_signal_emit (object, klass->signal_id, 0, info->hash);
 
-	return FALSE;
+	g_hash_table_remove_all (info->hash);
+	for (i = 0; i < klass->n_props; i++) {
+		if (G_IS_VALUE (&info->values[i]))
+			g_value_unset (&info->values[i]);
+	}
 }
 
-static void
-idle_id_reset (gpointer data)
+static gboolean
+properties_changed_idle (gpointer data)
 {
 	GObject *object = G_OBJECT (data);
-	PropertiesChangedInfo *info = (PropertiesChangedInfo *) g_object_get_data (object, BM_DBUS_PROPERTY_CHANGED);
+	PropertiesChangedInfo *info = g_object_get_qdata (object, info_quark ());
 
-	/* info is unset when the object is being destroyed */
-	if (info)
-		info->idle_id = 0;
+	info->idle_id = 0;
+	if (info->timeout_id) {
+		g_source_remove (info->timeout_id);
+		info->timeout_id = 0;
+	}
+
+	properties_changed (object, info);
+	return FALSE;
 }
 
-static char*
-uscore_to_wincaps (const char *uscore)
+static gboolean
+properties_changed_timeout (gpointer data)
 {
-	const char *p;
-	GString *str;
-	gboolean last_was_uscore;
+	GObject *object = G_OBJECT (data);
+	PropertiesChangedInfo *info = g_object_get_qdata (object, info_quark ());
 
-	last_was_uscore = TRUE;
-  
-	str = g_string_new (NULL);
-	p = uscore;
-	while (p && *p) {
-		if (*p == '-' || *p == '_')
-			last_was_uscore = TRUE;
-		else {
-			if (last_was_uscore) {
-				g_string_append_c (str, g_ascii_toupper (*p));
-				last_was_uscore = FALSE;
-			} else
-				g_string_append_c (str, *p);
-		}
-		++p;
+	info->timeout_id = 0;
+	if (info->idle_id) {
+		g_source_remove (info->idle_id);
+		info->idle_id = 0;
 	}
 
-	return g_string_free (str, FALSE);
+	properties_changed (object, info);
+	return FALSE;
 }
 
 static void
 notify (GObject *object, GParamSpec *pspec)
 {
 	PropertiesChangedInfo *info;
-	GValue *value;
+	guint i;
 
 	/* Ignore properties that shouldn't be exported */
 	if (pspec->flags & BM_PROPERTY_PARAM_NO_EXPORT)
 		return;
 
-	info = (PropertiesChangedInfo *) g_object_get_data (object, BM_DBUS_PROPERTY_CHANGED);
+	info = g_object_get_qdata (object, info_quark ());
 	if (!info) {
-		info = properties_changed_info_new ();
-		g_object_set_data_full (object, BM_DBUS_PROPERTY_CHANGED, info, properties_changed_info_destroy);
-		info->signal_id = g_signal_lookup ("properties-changed", G_OBJECT_TYPE (object));
-		g_assert (info->signal_id);
+		info = properties_changed_info_new (class_info_get (object));
+		g_object_set_qdata_full (object, info_quark (), info, properties_changed_info_destroy);
 	}
 
-	value = g_slice_new0 (GValue);
-	g_value_init (value, pspec->value_type);
-	g_object_get_property (object, pspec->name, value);
-	g_hash_table_insert (info->hash, uscore_to_wincaps (pspec->name), value);
+	i = GPOINTER_TO_UINT (g_hash_table_lookup (info->klass->index, pspec));
+	if (!i--)
+		return;
+
+	info->dirty[i / 32] |= 1U << (i % 32);
 
 	if (!info->idle_id)
-		info->idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, properties_changed, object, idle_id_reset);
+		info->idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, properties_changed_idle, object, NULL);
+	if (max_delay && !info->timeout_id)
+		info->timeout_id = g_timeout_add (max_delay, properties_changed_timeout, object);
+}
+
+void
+bm_properties_changed_signal_set_max_delay (guint msec)
+{
+	max_delay = msec;
 }
 
 guint
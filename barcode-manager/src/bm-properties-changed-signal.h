@@ -29,4 +29,6 @@
 guint bm_properties_changed_signal_new (GObjectClass *object_class,
 								guint class_offset);
 
+void bm_properties_changed_signal_set_max_delay (guint msec);
+
 #endif /* _BM_PROPERTIES_CHANGED_SIGNAL_H_ */
@@ -0,0 +1,292 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bm-state-file.h"
+#include "bm-logging.h"
+
+/* How long changes are collected before they are written out */
+#define STATE_FILE_FLUSH_MSEC 1000
+
+struct _BMStateFile {
+	char *filename;
+	GKeyFile *key_file;
+
+	gboolean dirty;
+	guint flush_id;
+
+	/* Shared with the writer thread.  'pending' is the latest contents
+	 * not yet picked up by the writer; older ones are simply replaced.
+	 */
+	GMutex *lock;
+	GThread *writer;
+	gboolean writing;
+	char *pending;
+	gsize pending_len;
+};
+
+BMStateFile *
+bm_state_file_new (const char *filename)
+{
+	BMStateFile *state;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	state = g_slice_new0 (BMStateFile);
+	state->filename = g_strdup (filename);
+	state->lock = g_mutex_new ();
+
+	state->key_file = g_key_file_new ();
+	g_key_file_set_list_separator (state->key_file, ',');
+	g_key_file_load_from_file (state->key_file, filename, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+	return state;
+}
+
+char **
+bm_state_file_get_keys (BMStateFile *state, const char *group, gsize *length)
+{
+	g_return_val_if_fail (state != NULL, NULL);
+	g_return_val_if_fail (group != NULL, NULL);
+
+	return g_key_file_get_keys (state->key_file, group, length, NULL);
+}
+
+gint
+bm_state_file_get_integer (BMStateFile *state,
+                           const char *group,
+                           const char *key,
+                           GError **error)
+{
+	g_return_val_if_fail (state != NULL, 0);
+
+	return g_key_file_get_integer (state->key_file, group, key, error);
+}
+
+/* Writes 'data' next to the state file, syncs it and renames it over the
+ * state file, so a crash leaves either the old or the new contents.
+ */
+static gboolean
+write_atomically (const char *filename, const char *data, gsize len)
+{
+	char *tmp;
+	int fd, errsv = 0;
+	gssize written;
+	gsize done = 0;
+
+	tmp = g_strdup_printf ("%s.XXXXXX", filename);
+	fd = g_mkstemp (tmp);
+	if (fd < 0) {
+		bm_log_warn (LOGD_CORE, "couldn't create temporary file for %s: %s",
+		             filename, strerror (errno));
+		g_free (tmp);
+		return FALSE;
+	}
+
+	while (done < len) {
+		written = write (fd, data + done, len - done);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			errsv = errno;
+			break;
+		}
+		done += written;
+	}
+
+	/* g_mkstemp() creates the file private to us */
+	if (!errsv && fchmod (fd, 0644) < 0)
+		errsv = errno;
+	if (!errsv && fsync (fd) < 0)
+		errsv = errno;
+	if (close (fd) < 0 && !errsv)
+		errsv = errno;
+	if (!errsv && rename (tmp, filename) < 0)
+		errsv = errno;
+
+	if (errsv) {
+		bm_log_warn (LOGD_CORE, "writing to state file %s failed: (%d) %s.",
+		             filename, errsv, strerror (errsv));
+		unlink (tmp);
+	}
+
+	g_free (tmp);
+	return errsv == 0;
+}
+
+static gpointer
+writer_thread (gpointer user_data)
+{
+	BMStateFile *state = user_data;
+	char *data;
+	gsize len;
+
+	for (;;) {
+		g_mutex_lock (state->lock);
+		data = state->pending;
+		len = state->pending_len;
+		state->pending = NULL;
+		if (!data) {
+			state->writing = FALSE;
+			g_mutex_unlock (state->lock);
+			break;
+		}
+		g_mutex_unlock (state->lock);
+
+		write_atomically (state->filename, data, len);
+		g_free (data);
+	}
+
+	return NULL;
+}
+
+/* Hands the current contents to the writer thread, starting it if it
+ * isn't already running.
+ */
+static void
+queue_write (BMStateFile *state)
+{
+	GError *error = NULL;
+	gboolean start = FALSE;
+	char *data;
+	gsize len = 0;
+
+	state->dirty = FALSE;
+
+	data = g_key_file_to_data (state->key_file, &len, NULL);
+	if (!data)
+		return;
+
+	g_mutex_lock (state->lock);
+	g_free (state->pending);
+	state->pending = data;
+	state->pending_len = len;
+	if (!state->writing)
+		start = state->writing = TRUE;
+	g_mutex_unlock (state->lock);
+
+	/* A running writer picks up the new contents when it's done */
+	if (!start)
+		return;
+
+	/* The previous writer found nothing left to do and is exiting */
+	if (state->writer)
+		g_thread_join (state->writer);
+
+	state->writer = g_thread_create (writer_thread, state, TRUE, &error);
+	if (!state->writer) {
+		bm_log_warn (LOGD_CORE, "couldn't start state file writer: %s; writing synchronously",
+		             error && error->message ? error->message : "unknown");
+		g_clear_error (&error);
+		writer_thread (state);
+	}
+}
+
+static gboolean
+flush_cb (gpointer user_data)
+{
+	BMStateFile *state = user_data;
+
+	state->flush_id = 0;
+	if (state->dirty)
+		queue_write (state);
+	return FALSE;
+}
+
+static void
+mark_dirty (BMStateFile *state)
+{
+	state->dirty = TRUE;
+	if (!state->flush_id)
+		state->flush_id = g_timeout_add (STATE_FILE_FLUSH_MSEC, flush_cb, state);
+}
+
+void
+bm_state_file_flush (BMStateFile *state)
+{
+	g_return_if_fail (state != NULL);
+
+	if (state->flush_id) {
+		g_source_remove (state->flush_id);
+		state->flush_id = 0;
+	}
+	if (state->dirty)
+		queue_write (state);
+
+	if (state->writer) {
+		g_thread_join (state->writer);
+		state->writer = NULL;
+	}
+}
+
+void
+bm_state_file_free (BMStateFile *state)
+{
+	g_return_if_fail (state != NULL);
+
+	bm_state_file_flush (state);
+
+	g_key_file_free (state->key_file);
+	g_mutex_free (state->lock);
+	g_free (state->filename);
+	g_slice_free (BMStateFile, state);
+}
+
+void
+bm_state_file_set_boolean (BMStateFile *state,
+                           const char *group,
+                           const char *key,
+                           gboolean value)
+{
+	GError *error = NULL;
+
+	g_return_if_fail (state != NULL);
+
+	if (   g_key_file_get_boolean (state->key_file, group, key, &error) == !!value
+	    && !error)
+		return;
+	g_clear_error (&error);
+
+	g_key_file_set_boolean (state->key_file, group, key, value);
+	mark_dirty (state);
+}
+
+void
+bm_state_file_set_integer (BMStateFile *state,
+                           const char *group,
+                           const char *key,
+                           gint value)
+{
+	GError *error = NULL;
+
+	g_return_if_fail (state != NULL);
+
+	if (g_key_file_get_integer (state->key_file, group, key, &error) == value && !error)
+		return;
+	g_clear_error (&error);
+
+	g_key_file_set_integer (state->key_file, group, key, value);
+	mark_dirty (state);
+}
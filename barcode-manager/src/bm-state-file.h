@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#ifndef BM_STATE_FILE_H
+#define BM_STATE_FILE_H
+
+#include <glib.h>
+
+/* In-memory copy of the daemon's state file.  Setters only change memory;
+ * changes are written back from a worker thread a moment later, so bursts
+ * of updates cost one write.  Writes replace the file atomically.
+ */
+typedef struct _BMStateFile BMStateFile;
+
+BMStateFile *bm_state_file_new         (const char *filename);
+
+/* Writes out pending changes before freeing */
+void         bm_state_file_free        (BMStateFile *state);
+
+char **      bm_state_file_get_keys    (BMStateFile *state,
+                                        const char *group,
+                                        gsize *length);
+gint         bm_state_file_get_integer (BMStateFile *state,
+                                        const char *group,
+                                        const char *key,
+                                        GError **error);
+
+void         bm_state_file_set_boolean (BMStateFile *state,
+                                        const char *group,
+                                        const char *key,
+                                        gboolean value);
+void         bm_state_file_set_integer (BMStateFile *state,
+                                        const char *group,
+                                        const char *key,
+                                        gint value);
+
+/* Writes pending changes now and waits until they're on disk */
+void         bm_state_file_flush       (BMStateFile *state);
+
+#endif /* BM_STATE_FILE_H */
@@ -36,9 +36,37 @@
 #include "bm-logging.h"
 #include "BarcodeManagerUtils.h"
 
+/* How long uevents are collected before a batch is processed */
+#define UEVENT_BATCH_MSEC 100
+
+/* Counts every uevent the kernel has sent */
+#define UEVENT_SEQNUM_FILE "/sys/kernel/uevent_seqnum"
+
+/* Events queued for one sysfs path within a batch */
+typedef struct {
+	char *path;
+	GUdevDevice *remove;
+	GUdevDevice *add;
+} PendingEvent;
+
 typedef struct {
 	GUdevClient *client;
 
+	/* Queued uevents, in the order their paths first appeared */
+	GQueue *pending;
+	GHashTable *pending_by_path;
+	guint batch_id;
+
+	/* sysfs path -> BMDeviceHwInfo, filled on add and dropped on remove */
+	GHashTable *hw_info;
+
+	/* sysfs path -> GUdevDevice for every device announced as added */
+	GHashTable *present;
+
+	/* Kernel uevent sequence number when we were suspended */
+	gboolean suspended;
+	guint64 suspend_seqnum;
+
 	gboolean disposed;
 } BMUdevManagerPrivate;
 
@@ -49,6 +77,7 @@ G_DEFINE_TYPE (BMUdevManager, bm_udev_manager, G_TYPE_OBJECT)
 enum {
 	DEVICE_ADDED,
 	DEVICE_REMOVED,
+	BATCH_DONE,
 
 	LAST_SIGNAL
 };
@@ -61,14 +90,149 @@ bm_udev_manager_new (void)
 	return BM_UDEV_MANAGER (g_object_new (BM_TYPE_UDEV_MANAGER, NULL));
 }
 
+/* Like udev's ID_*_ENC properties: "\x20" escapes, everything else verbatim */
+static char *
+get_decoded_property (GUdevDevice *device, const char *property)
+{
+	const char *p;
+	GString *str;
+
+	p = g_udev_device_get_property (device, property);
+	if (!p)
+		return NULL;
+
+	str = g_string_sized_new (strlen (p));
+	while (*p) {
+		if (p[0] == '\\' && p[1] == 'x'
+		    && g_ascii_isxdigit (p[2]) && g_ascii_isxdigit (p[3])) {
+			g_string_append_c (str, (g_ascii_xdigit_value (p[2]) << 4)
+			                        | g_ascii_xdigit_value (p[3]));
+			p += 4;
+		} else
+			g_string_append_c (str, *p++);
+	}
+	return g_string_free (str, FALSE);
+}
+
+static guint
+get_sysfs_attr_as_hex (GUdevDevice *device, const char *attr)
+{
+	const char *str;
+
+	str = g_udev_device_get_sysfs_attr (device, attr);
+	return str ? (guint) strtoul (str, NULL, 16) : 0;
+}
+
+/* Gathers everything we want to know about the hardware behind 'device' in
+ * one walk up its ancestry, so that nobody has to go back to udev and sysfs
+ * for it later.
+ */
+static BMDeviceHwInfo *
+hw_info_new (GUdevDevice *device)
+{
+	BMDeviceHwInfo *info;
+	GUdevDevice *iter, *parent, *usb = NULL;
+	const char *driver, *subsys;
+	gboolean ibmebus = FALSE;
+	guint depth;
+
+	info = bm_device_hw_info_new ();
+
+	/* Walk up to the USB device, or to the root for anything else */
+	iter = g_object_ref (device);
+	for (depth = 0; iter; depth++) {
+		subsys = g_udev_device_get_subsystem (iter);
+
+		/* The driver comes from the device or its parent, or from the
+		 * grandparent if the parent is an ibmebus device.
+		 */
+		if (!info->driver && (depth < 2 || (depth == 2 && ibmebus))) {
+			driver = g_udev_device_get_driver (iter);
+			if (driver)
+				info->driver = g_strdup (driver);
+		}
+		if (depth == 1)
+			ibmebus = !g_strcmp0 (subsys, "ibmebus");
+
+		if (!info->vendor)
+			info->vendor = get_decoded_property (iter, "ID_VENDOR_ENC");
+		if (!info->product)
+			info->product = get_decoded_property (iter, "ID_MODEL_ENC");
+		if (!info->vendor)
+			info->vendor = g_strdup (g_udev_device_get_property (iter, "ID_VENDOR_FROM_DATABASE"));
+		if (!info->product)
+			info->product = g_strdup (g_udev_device_get_property (iter, "ID_MODEL_FROM_DATABASE"));
+
+		if (   !g_strcmp0 (subsys, "usb")
+		    && !g_strcmp0 (g_udev_device_get_devtype (iter), "usb_device")) {
+			usb = iter;
+			break;
+		}
+
+		parent = g_udev_device_get_parent (iter);
+		g_object_unref (iter);
+		iter = parent;
+	}
+
+	if (usb) {
+		info->vendor_id = get_sysfs_attr_as_hex (usb, "idVendor");
+		info->product_id = get_sysfs_attr_as_hex (usb, "idProduct");
+		info->serial = g_strdup (g_udev_device_get_sysfs_attr (usb, "serial"));
+		/* The usb_device's name is its port path, like "2-1.4" */
+		info->port = g_strdup (g_udev_device_get_name (usb));
+
+		/* Fall back to the strings the device reports itself */
+		if (!info->vendor)
+			info->vendor = g_strdup (g_udev_device_get_sysfs_attr (usb, "manufacturer"));
+		if (!info->product)
+			info->product = g_strdup (g_udev_device_get_sysfs_attr (usb, "product"));
+
+		g_object_unref (usb);
+	}
+
+	return info;
+}
+
+/* Returns the cached hardware information for 'device', looking it up if
+ * this is the first time the device is seen.
+ */
+static BMDeviceHwInfo *
+get_hw_info (BMUdevManager *self, GUdevDevice *device)
+{
+	BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	BMDeviceHwInfo *info;
+	const char *path;
+
+	path = g_udev_device_get_sysfs_path (device);
+	g_return_val_if_fail (path != NULL, NULL);
+
+	info = g_hash_table_lookup (priv->hw_info, path);
+	if (!info) {
+		info = hw_info_new (device);
+		g_hash_table_insert (priv->hw_info, g_strdup (path), info);
+	}
+	return info;
+}
+
+static void
+invalidate_hw_info (BMUdevManager *self, GUdevDevice *device)
+{
+	BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	const char *path;
+
+	path = g_udev_device_get_sysfs_path (device);
+	if (path)
+		g_hash_table_remove (priv->hw_info, path);
+}
+
 static GObject *
 device_creator (BMUdevManager *manager,
                 GUdevDevice *udev_device,
                 gboolean sleeping)
 {
-	GObject *device = NULL;
-	const char *ifname, *driver, *path, *subsys;
-	GUdevDevice *parent = NULL, *grandparent = NULL;
+	GObject *device;
+	const char *ifname, *path, *devnode;
+	BMDeviceHwInfo *info;
 
 	ifname = g_udev_device_get_name (udev_device);
 	g_assert (ifname);
@@ -82,41 +246,23 @@ device_creator (BMUdevManager *manager,
 		return NULL;
 	}
 
-	driver = g_udev_device_get_driver (udev_device);
-
-	if (!driver) {
-		/* Try the parent */
-		parent = g_udev_device_get_parent (udev_device);
-		if (parent) {
-			driver = g_udev_device_get_driver (parent);
-			if (!driver) {
-				/* try the grandparent only if it's an ibmebus device */
-				subsys = g_udev_device_get_subsystem (parent);
-				if (subsys && !strcmp (subsys, "ibmebus")) {
-					grandparent = g_udev_device_get_parent (parent);
-					if (grandparent)
-						driver = g_udev_device_get_driver (grandparent);
-				}
-			}
-		}
+	devnode = g_udev_device_get_device_file (udev_device);
+	if (!devnode) {
+		bm_log_warn (LOGD_HW, "%s: couldn't determine device node; ignoring...", path);
+		return NULL;
 	}
 
-	if (!driver) {
+	info = get_hw_info (manager, udev_device);
+	if (!info->driver) {
 		bm_log_warn (LOGD_HW, "%s: couldn't determine device driver; ignoring...", path);
-		goto out;
+		return NULL;
 	} else {
-		bm_log_dbg(LOGD_HW, "device driver: %s for %s", driver, path);
+		bm_log_dbg(LOGD_HW, "device driver: %s for %s", info->driver, path);
 	}
 
-	bm_log_dbg(LOGD_HW, "before bm_device_hidraw_new");
-	device = (GObject *) bm_device_hidraw_new (path, ifname, driver);
-	bm_log_dbg(LOGD_HW, "after bm_device_hidraw_new");
-
-out:
-	if (grandparent)
-		g_object_unref (grandparent);
-	if (parent)
-		g_object_unref (parent);
+	device = (GObject *) bm_device_hidraw_new (path, ifname, info->driver, devnode);
+	if (device)
+		bm_device_set_hw_info (BM_DEVICE (device), info);
 
 	return device;
 }
@@ -124,6 +270,7 @@ out:
 static void
 udev_add (BMUdevManager *self, GUdevDevice *device)
 {
+    BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
     gint etype;
     const char *iface;
     const char *devtype;
@@ -157,15 +304,52 @@ udev_add (BMUdevManager *self, GUdevDevice *device)
         return;
     }
 
+    /* Whatever was at this path before may not be what's there now */
+    invalidate_hw_info (self, device);
+
+    g_hash_table_insert (priv->present,
+                         g_strdup (g_udev_device_get_sysfs_path (device)),
+                         g_object_ref (device));
+
     g_signal_emit (self, signals[DEVICE_ADDED], 0, device, device_creator);
 }
 
 static void
 udev_remove (BMUdevManager *self, GUdevDevice *device)
 {
+	BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+
 	bm_log_dbg (LOGD_HW, "processing interface with type %s", g_udev_device_get_property (device, "DEVTYPE"));
 
 	g_signal_emit (self, signals[DEVICE_REMOVED], 0, device);
+	invalidate_hw_info (self, device);
+	g_hash_table_remove (priv->present, g_udev_device_get_sysfs_path (device));
+}
+
+/* Identifies the physical scanner behind a device across replugs and
+ * restarts as "<vendor>:<product>:<serial>:<usb port path>".  Returns NULL
+ * for devices that aren't on USB.
+ */
+char *
+bm_udev_manager_get_device_identity (BMUdevManager *self, GUdevDevice *device)
+{
+	BMDeviceHwInfo *info;
+	char *identity;
+
+	g_return_val_if_fail (BM_IS_UDEV_MANAGER (self), NULL);
+	g_return_val_if_fail (device != NULL, NULL);
+
+	info = get_hw_info (self, device);
+	if (!info || !info->port)
+		return NULL;
+
+	identity = g_strdup_printf ("%04x:%04x:%s:%s",
+	                            info->vendor_id, info->product_id,
+	                            info->serial ? info->serial : "",
+	                            info->port);
+	/* Serials are free-form, but the identity is used as a state file key */
+	g_strcanon (identity, G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS ":-._", '_');
+	return identity;
 }
 
 void
@@ -183,6 +367,197 @@ bm_udev_manager_query_devices (BMUdevManager *self)
 		g_object_unref (G_UDEV_DEVICE (iter->data));
 	}
 	g_list_free (devices);
+
+	g_signal_emit (self, signals[BATCH_DONE], 0);
+}
+
+static void
+pending_event_free (PendingEvent *event)
+{
+	if (event->remove)
+		g_object_unref (event->remove);
+	if (event->add)
+		g_object_unref (event->add);
+	g_free (event->path);
+	g_slice_free (PendingEvent, event);
+}
+
+static gboolean
+process_batch (gpointer user_data)
+{
+	BMUdevManager *self = BM_UDEV_MANAGER (user_data);
+	BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	GQueue *batch;
+	PendingEvent *event;
+	guint added = 0, removed = 0;
+
+	priv->batch_id = 0;
+
+	/* Events arriving while the batch is processed go into the next one */
+	batch = priv->pending;
+	priv->pending = g_queue_new ();
+	g_hash_table_remove_all (priv->pending_by_path);
+
+	while ((event = g_queue_pop_head (batch))) {
+		if (event->remove) {
+			udev_remove (self, event->remove);
+			removed++;
+		}
+		if (event->add) {
+			udev_add (self, event->add);
+			added++;
+		}
+		pending_event_free (event);
+	}
+	g_queue_free (batch);
+
+	bm_log_dbg (LOGD_HW, "processed uevent batch: %u added, %u removed", added, removed);
+	g_signal_emit (self, signals[BATCH_DONE], 0);
+
+	return FALSE;
+}
+
+/* Queues an event for the next batch.  An add followed by a remove of the
+ * same node cancels out; a remove followed by an add is kept as both since
+ * the node may now be a different device.
+ */
+static void
+queue_uevent (BMUdevManager *self, GUdevDevice *device, gboolean add)
+{
+	BMUdevManagerPrivate *priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	const char *path;
+	PendingEvent *event;
+
+	path = g_udev_device_get_sysfs_path (device);
+	g_return_if_fail (path != NULL);
+
+	event = g_hash_table_lookup (priv->pending_by_path, path);
+	if (!event) {
+		event = g_slice_new0 (PendingEvent);
+		event->path = g_strdup (path);
+		g_hash_table_insert (priv->pending_by_path, event->path, event);
+		g_queue_push_tail (priv->pending, event);
+	}
+
+	if (add) {
+		if (event->add)
+			g_object_unref (event->add);
+		event->add = g_object_ref (device);
+	} else if (event->add) {
+		g_object_unref (event->add);
+		event->add = NULL;
+	} else if (!event->remove)
+		event->remove = g_object_ref (device);
+
+	if (!priv->batch_id)
+		priv->batch_id = g_timeout_add (UEVENT_BATCH_MSEC, process_batch, self);
+}
+
+static guint64
+read_uevent_seqnum (void)
+{
+	char *contents = NULL;
+	guint64 seqnum = 0;
+
+	if (g_file_get_contents (UEVENT_SEQNUM_FILE, &contents, NULL, NULL))
+		seqnum = g_ascii_strtoull (contents, NULL, 10);
+	g_free (contents);
+	return seqnum;
+}
+
+/* Remembers where the kernel's uevent stream was when devices stopped being
+ * managed, so bm_udev_manager_resume() can tell whether anything happened
+ * in between.
+ */
+void
+bm_udev_manager_suspend (BMUdevManager *self)
+{
+	BMUdevManagerPrivate *priv;
+
+	g_return_if_fail (BM_IS_UDEV_MANAGER (self));
+
+	priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	priv->suspended = TRUE;
+	priv->suspend_seqnum = read_uevent_seqnum ();
+
+	bm_log_dbg (LOGD_SUSPEND, "suspending at uevent seqnum %" G_GUINT64_FORMAT,
+	            priv->suspend_seqnum);
+}
+
+/* Brings the device set back in sync after bm_udev_manager_suspend().
+ * Uevents can be lost while the system sleeps, so compare what udev has now
+ * with what was announced before and only add or remove the difference.
+ * If the kernel sent no uevents at all in between there's nothing to do.
+ */
+void
+bm_udev_manager_resume (BMUdevManager *self)
+{
+	BMUdevManagerPrivate *priv;
+	GHashTable *current;
+	GHashTableIter iter;
+	GList *devices, *list_iter;
+	GUdevDevice *device;
+	const char *path;
+	guint64 seqnum;
+	guint added = 0, removed = 0;
+
+	g_return_if_fail (BM_IS_UDEV_MANAGER (self));
+
+	priv = BM_UDEV_MANAGER_GET_PRIVATE (self);
+	if (!priv->suspended)
+		return;
+	priv->suspended = FALSE;
+
+	seqnum = read_uevent_seqnum ();
+	if (seqnum && seqnum == priv->suspend_seqnum) {
+		bm_log_dbg (LOGD_SUSPEND, "no uevents while suspended; devices unchanged");
+		return;
+	}
+
+	bm_log_dbg (LOGD_SUSPEND, "uevent seqnum %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT
+	            "; checking for changed devices",
+	            priv->suspend_seqnum, seqnum);
+
+	/* Paths are borrowed from the devices, which live until the end */
+	current = g_hash_table_new (g_str_hash, g_str_equal);
+	devices = g_udev_client_query_by_subsystem (priv->client, "hidraw");
+	for (list_iter = devices; list_iter; list_iter = g_list_next (list_iter)) {
+		path = g_udev_device_get_sysfs_path (G_UDEV_DEVICE (list_iter->data));
+		if (path)
+			g_hash_table_insert (current, (gpointer) path, list_iter->data);
+	}
+
+	/* Removals go first so that a reused interface name is freed before
+	 * the new device claims it.
+	 */
+	g_hash_table_iter_init (&iter, priv->present);
+	while (g_hash_table_iter_next (&iter, (gpointer) &path, (gpointer) &device)) {
+		if (!g_hash_table_lookup (current, path)) {
+			queue_uevent (self, device, FALSE);
+			removed++;
+		}
+	}
+
+	for (list_iter = devices; list_iter; list_iter = g_list_next (list_iter)) {
+		device = G_UDEV_DEVICE (list_iter->data);
+		path = g_udev_device_get_sysfs_path (device);
+		if (path && !g_hash_table_lookup (priv->present, path)) {
+			queue_uevent (self, device, TRUE);
+			added++;
+		}
+	}
+
+	g_hash_table_destroy (current);
+	g_list_foreach (devices, (GFunc) g_object_unref, NULL);
+	g_list_free (devices);
+
+	bm_log_info (LOGD_SUSPEND, "resume: %u device(s) added, %u removed", added, removed);
+
+	/* Don't make the wakeup wait for the batch timer */
+	if (priv->batch_id) {
+		g_source_remove (priv->batch_id);
+		process_batch (self);
+	}
 }
 
 static void
@@ -203,11 +578,10 @@ handle_uevent (GUdevClient *client,
 	bm_log_dbg (LOGD_HW, "UDEV event: action '%s' subsys '%s' device '%s'",
 	            action, subsys, g_udev_device_get_name (device));
 
-	if (!strcmp (action, "add")) {
-		udev_add (self, device);
-	} else if (!strcmp (action, "remove")) {
-		udev_remove (self, device);
-	}
+	if (!strcmp (action, "add"))
+		queue_uevent (self, device, TRUE);
+	else if (!strcmp (action, "remove"))
+		queue_uevent (self, device, FALSE);
 }
 
 static void
@@ -218,6 +592,12 @@ bm_udev_manager_init (BMUdevManager *self)
 	GList *iter;
 	guint32 i;
 
+	priv->pending = g_queue_new ();
+	priv->pending_by_path = g_hash_table_new (g_str_hash, g_str_equal);
+	priv->hw_info = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+	                                       (GDestroyNotify) bm_device_hw_info_unref);
+	priv->present = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
 	priv->client = g_udev_client_new (subsys);
 	g_signal_connect (priv->client, "uevent", G_CALLBACK (handle_uevent), self);
 }
@@ -234,6 +614,14 @@ dispose (GObject *object)
 	}
 	priv->disposed = TRUE;
 
+	if (priv->batch_id)
+		g_source_remove (priv->batch_id);
+	g_hash_table_destroy (priv->pending_by_path);
+	g_queue_foreach (priv->pending, (GFunc) pending_event_free, NULL);
+	g_queue_free (priv->pending);
+	g_hash_table_destroy (priv->hw_info);
+	g_hash_table_destroy (priv->present);
+
 	g_object_unref (priv->client);
 
 	G_OBJECT_CLASS (bm_udev_manager_parent_class)->dispose (object);	
@@ -267,5 +655,14 @@ bm_udev_manager_class_init (BMUdevManagerClass *klass)
 					  NULL, NULL,
 					  g_cclosure_marshal_VOID__POINTER,
 					  G_TYPE_NONE, 1, G_TYPE_POINTER);
+
+	signals[BATCH_DONE] =
+		g_signal_new ("batch-done",
+					  G_OBJECT_CLASS_TYPE (object_class),
+					  G_SIGNAL_RUN_FIRST,
+					  G_STRUCT_OFFSET (BMUdevManagerClass, batch_done),
+					  NULL, NULL,
+					  g_cclosure_marshal_VOID__VOID,
+					  G_TYPE_NONE, 0);
 }
 
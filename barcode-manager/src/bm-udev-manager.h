@@ -54,6 +54,9 @@ typedef struct {
 
 	void (*device_removed) (BMUdevManager *manager, GUdevDevice *device);
 
+	/* Emitted after each batch of device-added and device-removed */
+	void (*batch_done) (BMUdevManager *manager);
+
 } BMUdevManagerClass;
 
 GType bm_udev_manager_get_type (void);
@@ -62,5 +65,11 @@ BMUdevManager *bm_udev_manager_new (void);
 
 void bm_udev_manager_query_devices (BMUdevManager *manager);
 
+void bm_udev_manager_suspend (BMUdevManager *manager);
+void bm_udev_manager_resume  (BMUdevManager *manager);
+
+char *bm_udev_manager_get_device_identity (BMUdevManager *manager,
+                                           GUdevDevice *device);
+
 #endif /* BM_UDEV_MANAGER_H */
 
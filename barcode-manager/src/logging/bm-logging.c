@@ -32,6 +32,8 @@
 #include <execinfo.h>
 #include <strings.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <glib/gi18n.h>
 
@@ -90,6 +92,7 @@ static const LogDesc domain_descs[] = {
 enum {
     BM_LOGGING_ERROR_UNKNOWN_LEVEL = 0,
     BM_LOGGING_ERROR_UNKNOWN_DOMAIN = 1,
+    BM_LOGGING_ERROR_UNKNOWN_MODE = 2,
 };
 
 #define ENUM_ENTRY(NAME, DESC) { NAME, "" #NAME "", DESC }
@@ -113,6 +116,7 @@ bm_logging_error_get_type (void)
         static const GEnumValue values[] = {
             ENUM_ENTRY (BM_LOGGING_ERROR_UNKNOWN_LEVEL,  "UnknownLevel"),
             ENUM_ENTRY (BM_LOGGING_ERROR_UNKNOWN_DOMAIN, "UnknownDomain"),
+            ENUM_ENTRY (BM_LOGGING_ERROR_UNKNOWN_MODE,   "UnknownMode"),
             { 0, 0, 0 }
         };
         etype = g_enum_register_static ("NMLoggingError", values);
@@ -122,6 +126,39 @@ bm_logging_error_get_type (void)
 
 /************************************************************************/
 
+enum {
+	CALLSITE_DEFAULT = 0,
+	CALLSITE_ON,
+	CALLSITE_OFF
+};
+
+typedef struct {
+	char *pattern;
+	GPatternSpec *spec;
+	guint32 domain;    /* for "@DOMAIN" patterns */
+	int mode;
+	guint rate;
+} CallsiteRule;
+
+/* Bumped whenever the level, domains or call site rules change, which
+ * makes every call site recompute whether it logs the next time it runs.
+ */
+volatile gint _bm_log_generation = 1;
+
+static pthread_mutex_t callsite_lock = PTHREAD_MUTEX_INITIALIZER;
+static BMLogCallsite *callsites;
+static GSList *callsite_rules;
+
+static void
+callsites_changed (void)
+{
+	pthread_mutex_lock (&callsite_lock);
+	g_atomic_int_inc (&_bm_log_generation);
+	pthread_mutex_unlock (&callsite_lock);
+}
+
+/************************************************************************/
+
 gboolean
 bm_logging_setup (const char *level, const char *domains, GError **error)
 {
@@ -176,6 +213,162 @@ bm_logging_setup (const char *level, const char *domains, GError **error)
 		log_domains = new_domains;
 	}
 
+	callsites_changed ();
+	return TRUE;
+}
+
+static gboolean
+callsite_rule_matches (CallsiteRule *rule, BMLogCallsite *site)
+{
+	if (rule->spec == NULL)
+		return !!(site->domain & rule->domain);
+
+	return    g_pattern_match_string (rule->spec, site->loc)
+	       || g_pattern_match_string (rule->spec, site->func);
+}
+
+gboolean
+_bm_log_callsite_update (BMLogCallsite *site, guint32 domain, guint32 level)
+{
+	GSList *iter;
+	int mode = CALLSITE_DEFAULT;
+	guint rate = 0;
+
+	pthread_mutex_lock (&callsite_lock);
+
+	if (!site->level) {
+		site->domain = domain;
+		site->level = level;
+		site->next = callsites;
+		callsites = site;
+	}
+
+	/* The last matching rule wins */
+	for (iter = callsite_rules; iter; iter = g_slist_next (iter)) {
+		CallsiteRule *rule = iter->data;
+
+		if (callsite_rule_matches (rule, site)) {
+			mode = rule->mode;
+			rate = rule->rate;
+		}
+	}
+
+	if (mode == CALLSITE_ON)
+		site->enabled = TRUE;
+	else if (mode == CALLSITE_OFF)
+		site->enabled = FALSE;
+	else
+		site->enabled = (log_level & site->level) && (log_domains & site->domain);
+
+	if (site->rate != rate) {
+		site->rate = rate;
+		site->refilled = 0;
+	}
+
+	g_atomic_int_set (&site->generation, _bm_log_generation);
+	pthread_mutex_unlock (&callsite_lock);
+
+	return site->enabled;
+}
+
+/* Returns "file.c:line function (on|off)" for each call site reached so far */
+char **
+bm_logging_get_callsites (void)
+{
+	BMLogCallsite *site;
+	GPtrArray *array;
+
+	array = g_ptr_array_new ();
+
+	pthread_mutex_lock (&callsite_lock);
+	for (site = callsites; site; site = site->next) {
+		g_ptr_array_add (array, g_strdup_printf ("%s %s (%s)",
+		                                         site->loc, site->func,
+		                                         site->enabled ? "on" : "off"));
+	}
+	pthread_mutex_unlock (&callsite_lock);
+
+	g_ptr_array_add (array, NULL);
+	return (char **) g_ptr_array_free (array, FALSE);
+}
+
+/* Adds a rule for the call sites matching 'pattern', which is either a
+ * glob matched against "file.c:line" and the function name, or "@DOMAIN".
+ * 'mode' is "on" or "off" to log regardless of level and domains, or
+ * "default"; 'rate' limits matching sites to that many messages per second.
+ * A rule for the same pattern replaces the previous one.
+ */
+gboolean
+bm_logging_set_callsite (const char *pattern,
+                         const char *mode,
+                         guint rate,
+                         GError **error)
+{
+	CallsiteRule *rule;
+	GSList *iter;
+	guint32 domain = 0;
+	int new_mode;
+
+	g_return_val_if_fail (pattern != NULL, FALSE);
+	g_return_val_if_fail (mode != NULL, FALSE);
+
+	if (!strcasecmp (mode, "on"))
+		new_mode = CALLSITE_ON;
+	else if (!strcasecmp (mode, "off"))
+		new_mode = CALLSITE_OFF;
+	else if (!strcasecmp (mode, "default"))
+		new_mode = CALLSITE_DEFAULT;
+	else {
+		g_set_error (error, BM_LOGGING_ERROR, BM_LOGGING_ERROR_UNKNOWN_MODE,
+		             _("Unknown call site mode '%s'"), mode);
+		return FALSE;
+	}
+
+	if (pattern[0] == '@') {
+		const LogDesc *diter;
+
+		for (diter = &domain_descs[0]; diter->name; diter++) {
+			if (!strcasecmp (diter->name, pattern + 1)) {
+				domain = diter->num;
+				break;
+			}
+		}
+
+		if (!diter->name) {
+			g_set_error (error, BM_LOGGING_ERROR, BM_LOGGING_ERROR_UNKNOWN_DOMAIN,
+			             _("Unknown log domain '%s'"), pattern + 1);
+			return FALSE;
+		}
+	}
+
+	pthread_mutex_lock (&callsite_lock);
+
+	for (iter = callsite_rules; iter; iter = g_slist_next (iter)) {
+		rule = iter->data;
+
+		if (!strcmp (rule->pattern, pattern)) {
+			callsite_rules = g_slist_delete_link (callsite_rules, iter);
+			if (rule->spec)
+				g_pattern_spec_free (rule->spec);
+			g_free (rule->pattern);
+			g_slice_free (CallsiteRule, rule);
+			break;
+		}
+	}
+
+	if (new_mode != CALLSITE_DEFAULT || rate) {
+		rule = g_slice_new0 (CallsiteRule);
+		rule->pattern = g_strdup (pattern);
+		rule->spec = domain ? NULL : g_pattern_spec_new (pattern);
+		rule->domain = domain;
+		rule->mode = new_mode;
+		rule->rate = rate;
+		callsite_rules = g_slist_append (callsite_rules, rule);
+	}
+
+	g_atomic_int_inc (&_bm_log_generation);
+	pthread_mutex_unlock (&callsite_lock);
+
 	return TRUE;
 }
 
@@ -215,37 +408,253 @@ bm_logging_level_enabled (guint32 level)
 	return !!(log_level & level);
 }
 
+/* Messages are formatted by the caller into a slot of a bounded ring and
+ * written to syslog by a separate thread, so a slow syslog socket doesn't
+ * stall the main loop.  Producers claim slots with a compare-and-swap on
+ * 'head'; each slot's sequence number tells the writer when it has been
+ * filled and the producers when it has been drained (see Vyukov's bounded
+ * MPMC queue).
+ */
+
+#define LOG_RING_SIZE 512  /* must be a power of two */
+#define LOG_MSG_MAX   480
+
+typedef struct {
+	volatile gint seq;
+	guint32 level;
+	const char *loc;
+	const char *func;
+	struct timespec ts;
+	char msg[LOG_MSG_MAX];
+} LogRecord;
+
+static LogRecord log_ring[LOG_RING_SIZE];
+static volatile gint log_head;
+static volatile gint log_tail;
+
+/* Messages dropped because the ring was full, in total and since the
+ * writer last reported it; errors and warnings are written synchronously
+ * instead of being dropped.
+ */
+static volatile gint log_dropped_total;
+static volatile gint log_dropped;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static volatile gint writer_running;
+static volatile gint writer_sleeping;
+static volatile gint writer_quit;
+
+static void
+write_record (guint32 level,
+              const char *loc,
+              const char *func,
+              const struct timespec *ts,
+              const char *msg)
+{
+	long usec = ts->tv_nsec / 1000;
+
+	if (level == LOGL_DEBUG)
+		syslog (LOG_INFO, "<debug> [%ld.%ld] [%s] %s(): %s", (long) ts->tv_sec, usec, loc, func, msg);
+	else if (level == LOGL_INFO)
+		syslog (LOG_INFO, "<info> %s", msg);
+	else if (level == LOGL_WARN)
+		syslog (LOG_WARNING, "<warn> %s", msg);
+	else if (level == LOGL_ERR)
+		syslog (LOG_ERR, "<error> [%ld.%ld] [%s] %s(): %s", (long) ts->tv_sec, usec, loc, func, msg);
+}
+
+static gboolean
+ring_is_empty (void)
+{
+	return g_atomic_int_get (&log_tail) == g_atomic_int_get (&log_head);
+}
+
+static gpointer
+writer_thread_func (gpointer data)
+{
+	for (;;) {
+		gint tail = g_atomic_int_get (&log_tail);
+		LogRecord *rec = &log_ring[tail & (LOG_RING_SIZE - 1)];
+		gint dropped;
+
+		if (g_atomic_int_get (&rec->seq) == (gint) ((guint) tail + 1)) {
+			write_record (rec->level, rec->loc, rec->func, &rec->ts, rec->msg);
+			g_atomic_int_set (&rec->seq, (gint) ((guint) tail + LOG_RING_SIZE));
+			g_atomic_int_set (&log_tail, (gint) ((guint) tail + 1));
+			continue;
+		}
+
+		dropped = g_atomic_int_get (&log_dropped);
+		if (dropped && g_atomic_int_compare_and_exchange (&log_dropped, dropped, 0))
+			syslog (LOG_WARNING, "<warn> logging: dropped %d messages", dropped);
+
+		if (g_atomic_int_get (&writer_quit) && ring_is_empty ())
+			break;
+
+		/* Producers only signal while we're flagged as sleeping, and the
+		 * flag is set before the ring is checked once more, so a record
+		 * published in between can't be missed.  The timeout covers a
+		 * producer that claimed a slot but hasn't filled it yet.
+		 */
+		pthread_mutex_lock (&writer_lock);
+		g_atomic_int_set (&writer_sleeping, 1);
+		if (ring_is_empty () && !g_atomic_int_get (&writer_quit)) {
+			struct timespec deadline;
+
+			clock_gettime (CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += 100 * 1000 * 1000;
+			if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000 * 1000 * 1000;
+			}
+			pthread_cond_timedwait (&writer_cond, &writer_lock, &deadline);
+		} else {
+			/* Slot claimed but not filled yet */
+			pthread_mutex_unlock (&writer_lock);
+			g_atomic_int_set (&writer_sleeping, 0);
+			sched_yield ();
+			continue;
+		}
+		g_atomic_int_set (&writer_sleeping, 0);
+		pthread_mutex_unlock (&writer_lock);
+	}
+
+	return NULL;
+}
+
+static void
+wake_writer (void)
+{
+	if (!g_atomic_int_get (&writer_sleeping))
+		return;
+
+	pthread_mutex_lock (&writer_lock);
+	pthread_cond_signal (&writer_cond);
+	pthread_mutex_unlock (&writer_lock);
+}
+
+/* Waits a little for the writer to catch up, for when the process is
+ * about to die.
+ */
+static void
+drain_ring (void)
+{
+	int i;
+
+	if (!g_atomic_int_get (&writer_running))
+		return;
+
+	wake_writer ();
+	for (i = 0; i < 100 && !ring_is_empty (); i++)
+		usleep (1000);
+}
+
+static gboolean
+callsite_take_token (BMLogCallsite *site)
+{
+	struct timespec now;
+	gint64 now_us;
+
+	if (!site->rate)
+		return TRUE;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	now_us = (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000;
+
+	/* Allows bursts of up to one second's worth of messages */
+	if (site->refilled)
+		site->tokens = MIN (site->rate, site->tokens + (now_us - site->refilled) * site->rate / 1e6);
+	else
+		site->tokens = site->rate;
+	site->refilled = now_us;
+
+	if (site->tokens < 1.0) {
+		site->suppressed++;
+		return FALSE;
+	}
+
+	site->tokens -= 1.0;
+	return TRUE;
+}
+
+static void
+format_message (char *buf, gsize size, guint suppressed, const char *fmt, va_list args)
+{
+	gsize len;
+
+	g_vsnprintf (buf, size, fmt, args);
+	if (suppressed) {
+		len = strlen (buf);
+		g_snprintf (buf + len, size - len, " (%u similar messages suppressed)", suppressed);
+	}
+}
+
 void
-_bm_log (const char *loc,
-         const char *func,
-         guint32 domain,
-         guint32 level,
-         const char *fmt,
-         ...)
+_bm_log (BMLogCallsite *site, const char *fmt, ...)
 {
 	va_list args;
-	char *msg;
-	GTimeVal tv;
-
-	if (!(log_level & level) || !(log_domains & domain))
+	LogRecord *rec;
+	struct timespec ts;
+	char msg[LOG_MSG_MAX];
+	guint32 level = site->level;
+	guint suppressed;
+	gint head;
+
+	if (!callsite_take_token (site))
 		return;
+	suppressed = site->suppressed;
+	site->suppressed = 0;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+
+	if (!g_atomic_int_get (&writer_running))
+		goto sync;
+
+	for (;;) {
+		gint diff;
+
+		head = g_atomic_int_get (&log_head);
+		rec = &log_ring[head & (LOG_RING_SIZE - 1)];
+		diff = (gint) ((guint) g_atomic_int_get (&rec->seq) - (guint) head);
+
+		if (diff == 0) {
+			if (g_atomic_int_compare_and_exchange (&log_head, head, (gint) ((guint) head + 1)))
+				break;
+		} else if (diff < 0) {
+			/* Full */
+			if (level & (LOGL_ERR | LOGL_WARN))
+				goto sync;
+			g_atomic_int_inc (&log_dropped);
+			g_atomic_int_inc (&log_dropped_total);
+			return;
+		}
+	}
 
+	rec->level = level;
+	rec->loc = site->loc;
+	rec->func = site->func;
+	rec->ts = ts;
 	va_start (args, fmt);
-	msg = g_strdup_vprintf (fmt, args);
+	format_message (rec->msg, sizeof (rec->msg), suppressed, fmt, args);
 	va_end (args);
 
-	if ((log_level & LOGL_DEBUG) && (level == LOGL_DEBUG)) {
-		g_get_current_time (&tv);
-		syslog (LOG_INFO, "<debug> [%ld.%ld] [%s] %s(): %s", tv.tv_sec, tv.tv_usec, loc, func, msg);
-	} else if ((log_level & LOGL_INFO) && (level == LOGL_INFO))
-		syslog (LOG_INFO, "<info> %s", msg);
-	else if ((log_level & LOGL_WARN) && (level == LOGL_WARN))
-		syslog (LOG_WARNING, "<warn> %s", msg);
-	else if ((log_level & LOGL_ERR) && (level == LOGL_ERR)) {
-		g_get_current_time (&tv);
-		syslog (LOG_ERR, "<error> [%ld.%ld] [%s] %s(): %s", tv.tv_sec, tv.tv_usec, loc, func, msg);
-	}
-	g_free (msg);
+	g_atomic_int_set (&rec->seq, (gint) ((guint) head + 1));
+	wake_writer ();
+	return;
+
+sync:
+	va_start (args, fmt);
+	format_message (msg, sizeof (msg), suppressed, fmt, args);
+	va_end (args);
+	write_record (level, site->loc, site->func, &ts, msg);
+}
+
+guint32
+bm_logging_get_dropped (void)
+{
+	return g_atomic_int_get (&log_dropped_total);
 }
 
 /************************************************************************/
@@ -322,6 +731,8 @@ bm_logging_backtrace (void)
 	 * we get much better information out of it.  Otherwise
 	 * fall back to execinfo.
 	 */
+	drain_ring ();
+
 	if (stat (LIBEXECDIR"/bm-crash-logger", &s) == 0)
 		fallback = crashlogger_get_backtrace () ? FALSE : TRUE;
 
@@ -366,6 +777,8 @@ bm_log_handler (const gchar *log_domain,
 void
 bm_logging_start (gboolean become_daemon)
 {
+	int i;
+
 	if (become_daemon)
 		openlog (G_LOG_DOMAIN, LOG_PID, LOG_DAEMON);
 	else
@@ -375,10 +788,27 @@ bm_logging_start (gboolean become_daemon)
 	                   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL | G_LOG_FLAG_RECURSION,
 	                   bm_log_handler,
 	                   NULL);
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+
+	if (pthread_create (&writer_thread, NULL, writer_thread_func, NULL) == 0)
+		g_atomic_int_set (&writer_running, 1);
+	else
+		syslog (LOG_WARNING, "<warn> logging: could not start writer thread, logging synchronously");
 }
 
 void
 bm_logging_shutdown (void)
 {
+	if (g_atomic_int_get (&writer_running)) {
+		g_atomic_int_set (&writer_quit, 1);
+		pthread_mutex_lock (&writer_lock);
+		pthread_cond_signal (&writer_cond);
+		pthread_mutex_unlock (&writer_lock);
+		pthread_join (writer_thread, NULL);
+		g_atomic_int_set (&writer_running, 0);
+	}
+
 	closelog ();
 }
@@ -69,31 +69,59 @@ GQuark bm_logging_error_quark    (void);
 GType  bm_logging_error_get_type (void);
 
 
-#define bm_log_err(domain, ...) \
-	_bm_log (G_STRLOC, G_STRFUNC, domain, LOGL_ERR, ## __VA_ARGS__ )
+/* Every bm_log_*() call site gets a static BMLogCallsite, registered the
+ * first time it is reached.  Whether the site logs is cached in the site
+ * and only recomputed when the logging setup changes, so a disabled site
+ * costs a single comparison.
+ */
+typedef struct _BMLogCallsite BMLogCallsite;
 
-#define bm_log_warn(domain, ...) \
-	_bm_log (G_STRLOC, G_STRFUNC, domain, LOGL_WARN, ## __VA_ARGS__ )
+struct _BMLogCallsite {
+	const char *loc;
+	const char *func;
+	guint32 domain;
+	guint32 level;
 
-#define bm_log_info(domain, ...) \
-	_bm_log (G_STRLOC, G_STRFUNC, domain, LOGL_INFO, ## __VA_ARGS__ )
+	gint generation;
+	gboolean enabled;
 
-#define bm_log_dbg(domain, ...) \
-	_bm_log (G_STRLOC, G_STRFUNC, domain, LOGL_DEBUG, ## __VA_ARGS__ )
+	/* Token bucket; rate is in messages per second, 0 is unlimited */
+	guint rate;
+	gdouble tokens;
+	gint64 refilled;
+	guint suppressed;
 
-#define bm_log(domain, level, ...) \
-	_bm_log (G_STRLOC, G_STRFUNC, domain, level, ## __VA_ARGS__ )
+	BMLogCallsite *next;
+};
 
-void _bm_log (const char *loc,
-              const char *func,
-              guint32 domain,
-              guint32 level,
+extern volatile gint _bm_log_generation;
+
+#define bm_log(domain, level, ...) \
+	G_STMT_START { \
+		static BMLogCallsite _bm_log_site = { G_STRLOC, G_STRFUNC }; \
+		if (_bm_log_site.generation == _bm_log_generation \
+		    ? _bm_log_site.enabled \
+		    : _bm_log_callsite_update (&_bm_log_site, domain, level)) \
+			_bm_log (&_bm_log_site, ## __VA_ARGS__ ); \
+	} G_STMT_END
+
+#define bm_log_err(domain, ...)  bm_log (domain, LOGL_ERR, ## __VA_ARGS__ )
+#define bm_log_warn(domain, ...) bm_log (domain, LOGL_WARN, ## __VA_ARGS__ )
+#define bm_log_info(domain, ...) bm_log (domain, LOGL_INFO, ## __VA_ARGS__ )
+#define bm_log_dbg(domain, ...)  bm_log (domain, LOGL_DEBUG, ## __VA_ARGS__ )
+
+gboolean _bm_log_callsite_update (BMLogCallsite *site,
+                                  guint32 domain,
+                                  guint32 level);
+
+void _bm_log (BMLogCallsite *site,
               const char *fmt,
-              ...) __attribute__((__format__ (__printf__, 5, 6)));
+              ...) __attribute__((__format__ (__printf__, 2, 3)));
 
 const char *bm_logging_level_to_string (void);
 char *bm_logging_domains_to_string (void);
 gboolean bm_logging_level_enabled (guint32 level);
+guint32 bm_logging_get_dropped (void);
 
 /* Undefine the bm-utils.h logging stuff to ensure errors */
 #undef bm_print_backtrace
@@ -108,6 +136,11 @@ gboolean bm_logging_level_enabled (guint32 level);
 #undef bm_error_str
 
 gboolean bm_logging_setup     (const char *level, const char *domains, GError **error);
+gboolean bm_logging_set_callsite (const char *pattern,
+                                  const char *mode,
+                                  guint rate,
+                                  GError **error);
+char   **bm_logging_get_callsites (void);
 void     bm_logging_start     (gboolean become_daemon);
 void     bm_logging_backtrace (void);
 void     bm_logging_shutdown  (void);
@@ -38,6 +38,8 @@
 #include "BarcodeManager.h"
 #include "BarcodeManagerUtils.h"
 #include "bm-manager.h"
+#include "bm-device.h"
+#include "bm-properties-changed-signal.h"
 #include "bm-policy.h"
 #include "bm-system.h"
 #include "bm-dbus-manager.h"
@@ -229,6 +231,8 @@ parse_config_file (const char *filename,
                    char ***dns_plugins,
                    char **log_level,
                    char **log_domains,
+                   int *stats_interval,
+                   int *properties_delay,
                    GError **error)
 {
 	GKeyFile *config;
@@ -254,6 +258,11 @@ parse_config_file (const char *filename,
 	*log_level = g_key_file_get_value (config, "logging", "level", NULL);
 	*log_domains = g_key_file_get_value (config, "logging", "domains", NULL);
 
+	if (g_key_file_has_key (config, "main", "stats-interval", NULL))
+		*stats_interval = g_key_file_get_integer (config, "main", "stats-interval", NULL);
+	if (g_key_file_has_key (config, "main", "properties-changed-delay", NULL))
+		*properties_delay = g_key_file_get_integer (config, "main", "properties-changed-delay", NULL);
+
 	g_key_file_free (config);
 	return TRUE;
 }
@@ -338,6 +347,7 @@ main (int argc, char *argv[])
 	GError *error = NULL;
 	gboolean wrote_pidfile = FALSE;
 	char *cfg_log_level = NULL, *cfg_log_domains = NULL;
+	int stats_interval = -1, properties_delay = -1;
 
 	GOptionEntry options[] = {
 		{ "no-daemon", 0, 0, G_OPTION_ARG_NONE, &become_daemon, "Don't become a daemon", NULL },
@@ -400,7 +410,7 @@ main (int argc, char *argv[])
 
 	/* Parse the config file */
 	if (config) {
-		if (!parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &error)) {
+		if (!parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &stats_interval, &properties_delay, &error)) {
 			fprintf (stderr, "Config file %s invalid: (%d) %s\n",
 			         config,
 			         error ? error->code : -1,
@@ -420,7 +430,7 @@ main (int argc, char *argv[])
 		/* Try deprecated bm-system-settings.conf first */
 		if (g_file_test (BM_OLD_SYSTEM_CONF_FILE, G_FILE_TEST_EXISTS)) {
 			config = g_strdup (BM_OLD_SYSTEM_CONF_FILE);
-			parsed = parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &error);
+			parsed = parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &stats_interval, &properties_delay, &error);
 			if (!parsed) {
 				fprintf (stderr, "Default config file %s invalid: (%d) %s\n",
 				         config,
@@ -435,7 +445,7 @@ main (int argc, char *argv[])
 		/* Try the preferred BarcodeManager.conf last */
 		if (!parsed && g_file_test (BM_DEFAULT_SYSTEM_CONF_FILE, G_FILE_TEST_EXISTS)) {
 			config = g_strdup (BM_DEFAULT_SYSTEM_CONF_FILE);
-			parsed = parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &error);
+			parsed = parse_config_file (config, &conf_plugins, &dhcp, &dns, &cfg_log_level, &cfg_log_domains, &stats_interval, &properties_delay, &error);
 			if (!parsed) {
 				fprintf (stderr, "Default config file %s invalid: (%d) %s\n",
 				         config,
@@ -457,6 +467,11 @@ main (int argc, char *argv[])
 		exit (1);
 	}
 
+	if (stats_interval >= 0)
+		bm_device_set_stats_interval (stats_interval);
+	if (properties_delay >= 0)
+		bm_properties_changed_signal_set_max_delay (properties_delay);
+
 	/* Plugins specified with '--plugins' override those of config file */
 	plugins = plugins ? plugins : g_strdup (conf_plugins);
 	g_free (conf_plugins);
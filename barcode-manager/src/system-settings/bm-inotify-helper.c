@@ -31,41 +31,73 @@ G_DEFINE_TYPE (NMInotifyHelper, bm_inotify_helper, G_TYPE_OBJECT)
 
 #define BM_INOTIFY_HELPER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), BM_TYPE_INOTIFY_HELPER, NMInotifyHelperPrivate))
 
+/* Window over which events for files in a watched directory are coalesced
+ * before the files are fingerprinted.
+ */
+#define COALESCE_MSEC 200
+
+#define DIR_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
 typedef struct {
 	int ifd;
 
 	GHashTable *wd_refs;
+
+	/* wd -> DirWatch */
+	GHashTable *dirs;
 } NMInotifyHelperPrivate;
 
+typedef struct {
+	NMInotifyHelper *self;
+	char *path;
+	guint refcount;
+
+	/* file name -> content checksum, for every regular file in the dir */
+	GHashTable *fingerprints;
+
+	/* file names with events since the last flush */
+	GHashTable *pending;
+	guint pending_id;
+} DirWatch;
+
 /* Signals */
 enum {
 	EVENT,
+	FILE_CHANGED,
 	LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+static void
+ref_watch (NMInotifyHelper *self, int wd)
+{
+	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
+	guint32 refcount;
+
+	refcount = GPOINTER_TO_UINT (g_hash_table_lookup (priv->wd_refs, GINT_TO_POINTER (wd)));
+	refcount++;
+	g_hash_table_replace (priv->wd_refs, GINT_TO_POINTER (wd), GUINT_TO_POINTER (refcount));
+}
+
 int
 bm_inotify_helper_add_watch (NMInotifyHelper *self, const char *path)
 {
 	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
 	int wd;
-	guint32 refcount;
 
 	g_return_val_if_fail (priv->ifd >= 0, -1);
 
 	/* We only care about modifications since we're just trying to get change
-	 * notifications on hardlinks.
+	 * notifications on hardlinks.  IN_MASK_ADD keeps the events of a
+	 * directory watch on the same path.
 	 */
 
-	wd = inotify_add_watch (priv->ifd, path, IN_CLOSE_WRITE);
+	wd = inotify_add_watch (priv->ifd, path, IN_CLOSE_WRITE | IN_MASK_ADD);
 	if (wd < 0)
 		return -1;
 
-	refcount = GPOINTER_TO_UINT (g_hash_table_lookup (priv->wd_refs, GINT_TO_POINTER (wd)));
-	refcount++;
-	g_hash_table_replace (priv->wd_refs, GINT_TO_POINTER (wd), GUINT_TO_POINTER (refcount));
-
+	ref_watch (self, wd);
 	return wd;
 }
 
@@ -89,6 +121,200 @@ bm_inotify_helper_remove_watch (NMInotifyHelper *self, int wd)
 		g_hash_table_replace (priv->wd_refs, GINT_TO_POINTER (wd), GUINT_TO_POINTER (refcount));
 }
 
+/* Checksum of the file's contents, or NULL if it isn't a readable regular
+ * file.  Config files are small, so reading them whole is cheaper than
+ * re-parsing them on every event.
+ */
+static char *
+fingerprint_file (const char *path)
+{
+	char *contents = NULL;
+	gsize len = 0;
+	char *fp;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_REGULAR))
+		return NULL;
+	if (!g_file_get_contents (path, &contents, &len, NULL))
+		return NULL;
+
+	fp = g_compute_checksum_for_data (G_CHECKSUM_SHA1, (const guchar *) contents, len);
+	g_free (contents);
+	return fp;
+}
+
+static void
+dir_watch_free (gpointer data)
+{
+	DirWatch *dir = data;
+
+	if (dir->pending_id)
+		g_source_remove (dir->pending_id);
+	g_hash_table_destroy (dir->pending);
+	g_hash_table_destroy (dir->fingerprints);
+	g_free (dir->path);
+	g_slice_free (DirWatch, dir);
+}
+
+typedef struct {
+	char *path;
+	BMInotifyFileChange change;
+} FileChange;
+
+static gboolean
+dir_changes_flush (gpointer user_data)
+{
+	DirWatch *dir = user_data;
+	NMInotifyHelper *self = dir->self;
+	GHashTable *pending;
+	GHashTableIter iter;
+	gpointer key;
+	GSList *changes = NULL, *elt;
+
+	dir->pending_id = 0;
+
+	/* Handlers may drop the watch, so settle the state first and emit
+	 * from a private list.
+	 */
+	pending = dir->pending;
+	dir->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	g_hash_table_iter_init (&iter, pending);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		const char *name = key;
+		const char *old_fp;
+		char *path, *new_fp;
+		FileChange *change;
+		BMInotifyFileChange type;
+
+		path = g_build_filename (dir->path, name, NULL);
+		new_fp = fingerprint_file (path);
+		old_fp = g_hash_table_lookup (dir->fingerprints, name);
+
+		/* Temporary files that came and went inside the window, and
+		 * rewrites with identical contents, produce nothing.
+		 */
+		if (!old_fp && !new_fp)
+			goto next;
+		else if (!old_fp)
+			type = BM_INOTIFY_FILE_ADDED;
+		else if (!new_fp)
+			type = BM_INOTIFY_FILE_REMOVED;
+		else if (strcmp (old_fp, new_fp))
+			type = BM_INOTIFY_FILE_UPDATED;
+		else
+			goto next;
+
+		if (new_fp) {
+			g_hash_table_replace (dir->fingerprints, g_strdup (name), new_fp);
+			new_fp = NULL;
+		} else
+			g_hash_table_remove (dir->fingerprints, name);
+
+		change = g_slice_new (FileChange);
+		change->path = path;
+		change->change = type;
+		changes = g_slist_prepend (changes, change);
+		path = NULL;
+
+	next:
+		g_free (new_fp);
+		g_free (path);
+	}
+	g_hash_table_destroy (pending);
+
+	g_object_ref (self);
+	for (elt = changes; elt; elt = g_slist_next (elt)) {
+		FileChange *change = elt->data;
+
+		g_signal_emit (self, signals[FILE_CHANGED], 0, change->path, change->change);
+		g_free (change->path);
+		g_slice_free (FileChange, change);
+	}
+	g_slist_free (changes);
+	g_object_unref (self);
+
+	return FALSE;
+}
+
+static void
+queue_dir_change (NMInotifyHelper *self, int wd, const char *name)
+{
+	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
+	DirWatch *dir;
+
+	dir = g_hash_table_lookup (priv->dirs, GINT_TO_POINTER (wd));
+	if (!dir || !name[0])
+		return;
+
+	g_hash_table_replace (dir->pending, g_strdup (name), NULL);
+	if (!dir->pending_id)
+		dir->pending_id = g_timeout_add (COALESCE_MSEC, dir_changes_flush, dir);
+}
+
+int
+bm_inotify_helper_watch_dir (NMInotifyHelper *self, const char *path)
+{
+	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
+	DirWatch *dir;
+	GDir *gdir;
+	const char *name;
+	int wd;
+
+	g_return_val_if_fail (priv->ifd >= 0, -1);
+	g_return_val_if_fail (path != NULL, -1);
+
+	wd = inotify_add_watch (priv->ifd, path, DIR_WATCH_MASK | IN_ONLYDIR | IN_MASK_ADD);
+	if (wd < 0)
+		return -1;
+
+	ref_watch (self, wd);
+
+	dir = g_hash_table_lookup (priv->dirs, GINT_TO_POINTER (wd));
+	if (dir) {
+		dir->refcount++;
+		return wd;
+	}
+
+	dir = g_slice_new0 (DirWatch);
+	dir->self = self;
+	dir->path = g_strdup (path);
+	dir->refcount = 1;
+	dir->fingerprints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	dir->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	/* Baseline, so that only later changes are reported */
+	gdir = g_dir_open (path, 0, NULL);
+	while (gdir && (name = g_dir_read_name (gdir))) {
+		char *file = g_build_filename (path, name, NULL);
+		char *fp = fingerprint_file (file);
+
+		if (fp)
+			g_hash_table_insert (dir->fingerprints, g_strdup (name), fp);
+		g_free (file);
+	}
+	if (gdir)
+		g_dir_close (gdir);
+
+	g_hash_table_insert (priv->dirs, GINT_TO_POINTER (wd), dir);
+	return wd;
+}
+
+void
+bm_inotify_helper_unwatch_dir (NMInotifyHelper *self, int wd)
+{
+	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
+	DirWatch *dir;
+
+	dir = g_hash_table_lookup (priv->dirs, GINT_TO_POINTER (wd));
+	if (!dir)
+		return;
+
+	if (--dir->refcount == 0)
+		g_hash_table_remove (priv->dirs, GINT_TO_POINTER (wd));
+
+	bm_inotify_helper_remove_watch (self, wd);
+}
+
 static gboolean
 inotify_event_handler (GIOChannel *channel, GIOCondition cond, gpointer user_data)
 {
@@ -107,8 +333,11 @@ inotify_event_handler (GIOChannel *channel, GIOCondition cond, gpointer user_dat
 			                        NULL, NULL);
 		}
 
-		if (!(evt.mask & IN_IGNORED))
+		if (!(evt.mask & IN_IGNORED)) {
 			g_signal_emit (self, signals[EVENT], 0, &evt, &filename[0]);
+			if (evt.mask & DIR_WATCH_MASK)
+				queue_dir_change (self, evt.wd, filename);
+		}
 	}
 
 	return TRUE;
@@ -174,6 +403,7 @@ bm_inotify_helper_init (NMInotifyHelper *self)
 	NMInotifyHelperPrivate *priv = BM_INOTIFY_HELPER_GET_PRIVATE (self);
 
 	priv->wd_refs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->dirs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, dir_watch_free);
 }
 
 static void
@@ -184,6 +414,7 @@ finalize (GObject *object)
 	if (priv->ifd >= 0)
 		close (priv->ifd);
 
+	g_hash_table_destroy (priv->dirs);
 	g_hash_table_destroy (priv->wd_refs);
 
 	G_OBJECT_CLASS (bm_inotify_helper_parent_class)->finalize (object);
@@ -208,5 +439,14 @@ bm_inotify_helper_class_init (NMInotifyHelperClass *klass)
 		              NULL, NULL,
 		              _bm_marshal_VOID__POINTER_STRING,
 		              G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_STRING);
+
+	signals[FILE_CHANGED] =
+		g_signal_new ("file-changed",
+		              G_OBJECT_CLASS_TYPE (object_class),
+		              G_SIGNAL_RUN_LAST,
+		              G_STRUCT_OFFSET (NMInotifyHelperClass, file_changed),
+		              NULL, NULL,
+		              _bm_marshal_VOID__STRING_UINT,
+		              G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_UINT);
 }
 
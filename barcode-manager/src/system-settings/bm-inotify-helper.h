@@ -32,6 +32,13 @@
 #define BM_IS_INOTIFY_HELPER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((obj), BM_TYPE_INOTIFY_HELPER))
 #define BM_INOTIFY_HELPER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), BM_TYPE_INOTIFY_HELPER, NMInotifyHelperClass))
 
+/* Content changes reported by "file-changed" for files in watched dirs */
+typedef enum {
+	BM_INOTIFY_FILE_ADDED = 0,
+	BM_INOTIFY_FILE_UPDATED,
+	BM_INOTIFY_FILE_REMOVED
+} BMInotifyFileChange;
+
 typedef struct {
 	GObject parent;
 } NMInotifyHelper;
@@ -41,6 +48,7 @@ typedef struct {
 
 	/* signals */
 	void (* event) (NMInotifyHelper *helper, struct inotify_event *evt, const char *filename);
+	void (* file_changed) (NMInotifyHelper *helper, const char *path, BMInotifyFileChange change);
 } NMInotifyHelperClass;
 
 GType bm_inotify_helper_get_type (void);
@@ -51,4 +59,12 @@ int bm_inotify_helper_add_watch (NMInotifyHelper *helper, const char *path);
 
 void bm_inotify_helper_remove_watch (NMInotifyHelper *helper, int wd);
 
+/* Watches a directory for files being written, moved or deleted.  Events
+ * are coalesced per file for a short window and "file-changed" is only
+ * emitted when a file's contents actually differ from what was last seen.
+ */
+int bm_inotify_helper_watch_dir (NMInotifyHelper *helper, const char *path);
+
+void bm_inotify_helper_unwatch_dir (NMInotifyHelper *helper, int wd);
+
 #endif  /* __INOTIFY_HELPER_H__ */
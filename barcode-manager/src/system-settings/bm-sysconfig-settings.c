@@ -40,6 +40,7 @@
 #include <bm-setting-serial.h>
 
 #include "bm-dbus-glib-types.h"
+#include "bm-dbus-manager.h"
 #include "bm-sysconfig-settings.h"
 #include "bm-sysconfig-connection.h"
 #include "bm-polkit-helpers.h"
@@ -56,6 +57,8 @@ EXPORT(bm_inotify_helper_get_type)
 EXPORT(bm_inotify_helper_get)
 EXPORT(bm_inotify_helper_add_watch)
 EXPORT(bm_inotify_helper_remove_watch)
+EXPORT(bm_inotify_helper_watch_dir)
+EXPORT(bm_inotify_helper_unwatch_dir)
 
 EXPORT(bm_sysconfig_connection_get_type)
 EXPORT(bm_sysconfig_connection_update)
@@ -81,12 +84,21 @@ typedef struct {
 	guint auth_changed_id;
 	char *config_file;
 
+	/* Connections are exported again on a new bus connection */
+	BMDBusManager *dbus_mgr;
+	guint dbus_changed_id;
+
 	GSList *pk_calls;
 	GSList *permissions_calls;
 
 	GSList *plugins;
-	gboolean connections_loaded;
 	GHashTable *connections;
+
+	/* Plugins being loaded, in configured order; merged from the front */
+	GPtrArray *loads;
+	guint next_load;
+	gboolean settings_loaded;
+
 	GSList *unmanaged_specs;
 } BMSysconfigSettingsPrivate;
 
@@ -113,38 +125,6 @@ enum {
 	LAST_PROP
 };
 
-static void
-load_connections (BMSysconfigSettings *self)
-{
-	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
-	GSList *iter;
-
-	if (priv->connections_loaded)
-		return;
-
-	for (iter = priv->plugins; iter; iter = g_slist_next (iter)) {
-		NMSystemConfigInterface *plugin = BM_SYSTEM_CONFIG_INTERFACE (iter->data);
-		GSList *plugin_connections;
-		GSList *elt;
-
-		plugin_connections = bm_system_config_interface_get_connections (plugin);
-
-		// FIXME: ensure connections from plugins loaded with a lower priority
-		// get rejected when they conflict with connections from a higher
-		// priority plugin.
-
-		for (elt = plugin_connections; elt; elt = g_slist_next (elt))
-			claim_connection (self, BM_SETTINGS_CONNECTION_INTERFACE (elt->data), TRUE);
-
-		g_slist_free (plugin_connections);
-	}
-
-	priv->connections_loaded = TRUE;
-
-	/* FIXME: Bad hack */
-	unmanaged_specs_changed (NULL, self);
-}
-
 static GSList *
 list_connections (BMSettingsService *settings)
 {
@@ -153,8 +133,9 @@ list_connections (BMSettingsService *settings)
 	gpointer key;
 	GSList *list = NULL;
 
-	load_connections (BM_SYSCONFIG_SETTINGS (settings));
-
+	/* Connections of plugins still loading are announced with
+	 * NewConnection as they arrive.
+	 */
 	g_hash_table_iter_init (&iter, priv->connections);
 	while (g_hash_table_iter_next (&iter, &key, NULL))
 		list = g_slist_prepend (list, BM_EXPORTED_CONNECTION (key));
@@ -221,7 +202,6 @@ bm_sysconfig_settings_get_unmanaged_specs (BMSysconfigSettings *self)
 {
 	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
 
-	load_connections (self);
 	return priv->unmanaged_specs;
 }
 
@@ -386,79 +366,205 @@ find_plugin (GSList *list, const char *pname)
 	return obj;
 }
 
+/* One configured plugin.  The worker thread only does the disk-bound part
+ * (dlopen and symbol lookup); everything touching GObjects happens when the
+ * result is merged on the main loop.
+ */
+typedef struct {
+	BMSysconfigSettings *self;
+	char *name;
+
+	/* Written by the worker before it queues the merge */
+	GModule *module;
+	GObject * (*factory_func) (void);
+	char *error;
+	gboolean done;
+} PluginLoad;
+
+static void
+plugin_load_free (PluginLoad *load)
+{
+	g_free (load->name);
+	g_free (load->error);
+	g_slice_free (PluginLoad, load);
+}
+
+static gboolean plugin_load_done (gpointer user_data);
+
+static gpointer
+plugin_load_thread (gpointer user_data)
+{
+	PluginLoad *load = user_data;
+	char *full_name, *path;
+
+	full_name = g_strdup_printf ("bm-settings-plugin-%s", load->name);
+	path = g_module_build_path (PLUGINDIR, full_name);
+	g_free (full_name);
+
+	load->module = g_module_open (path, G_MODULE_BIND_LOCAL);
+	g_free (path);
+
+	if (!load->module) {
+		load->error = g_strdup_printf ("Could not load plugin '%s': %s",
+		                               load->name, g_module_error ());
+	} else if (!g_module_symbol (load->module, "bm_system_config_factory",
+	                             (gpointer) (&load->factory_func))) {
+		load->error = g_strdup_printf ("Could not find plugin '%s' factory function.",
+		                               load->name);
+	}
+
+	g_idle_add (plugin_load_done, load);
+	return NULL;
+}
+
+static void
+merge_plugin (BMSysconfigSettings *self, PluginLoad *load)
+{
+	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
+	GObject *obj;
+	GSList *connections, *iter;
+
+	if (load->error) {
+		bm_log_err (LOGD_SYS_SET, "%s", load->error);
+		goto fail;
+	}
+
+	/* Two names may resolve to the same plugin */
+	if (find_plugin (priv->plugins, load->name))
+		goto fail;
+
+	obj = (*load->factory_func) ();
+	if (!obj || !BM_IS_SYSTEM_CONFIG_INTERFACE (obj)) {
+		bm_log_err (LOGD_SYS_SET, "Plugin '%s' returned invalid system config object.",
+		            load->name);
+		goto fail;
+	}
+
+	g_module_make_resident (load->module);
+	g_object_weak_ref (obj, (GWeakNotify) g_module_close, load->module);
+	load->module = NULL;
+
+	add_plugin (self, BM_SYSTEM_CONFIG_INTERFACE (obj));
+
+	// FIXME: ensure connections from plugins loaded with a lower priority
+	// get rejected when they conflict with connections from a higher
+	// priority plugin.
+	connections = bm_system_config_interface_get_connections (BM_SYSTEM_CONFIG_INTERFACE (obj));
+	for (iter = connections; iter; iter = g_slist_next (iter))
+		claim_connection (self, BM_SETTINGS_CONNECTION_INTERFACE (iter->data), TRUE);
+	g_slist_free (connections);
+
+	/* priv->plugins holds the only reference now */
+	g_object_unref (obj);
+	return;
+
+fail:
+	if (load->module) {
+		g_module_close (load->module);
+		load->module = NULL;
+	}
+}
+
+static void
+plugins_loaded (BMSysconfigSettings *self)
+{
+	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
+
+	g_ptr_array_foreach (priv->loads, (GFunc) plugin_load_free, NULL);
+	g_ptr_array_free (priv->loads, TRUE);
+	priv->loads = NULL;
+	priv->settings_loaded = TRUE;
+
+	bm_log_info (LOGD_SYS_SET, "Settings loaded (%u connections)",
+	             g_hash_table_size (priv->connections));
+
+	unmanaged_specs_changed (NULL, self);
+	g_object_notify (G_OBJECT (self), BM_SETTINGS_SYSTEM_INTERFACE_HOSTNAME);
+	g_object_notify (G_OBJECT (self), BM_SETTINGS_SYSTEM_INTERFACE_CAN_MODIFY);
+	g_object_notify (G_OBJECT (self), BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED);
+}
+
 static gboolean
-load_plugins (BMSysconfigSettings *self, const char *plugins, GError **error)
+plugin_load_done (gpointer user_data)
 {
-	GSList *list = NULL;
+	PluginLoad *load = user_data;
+	BMSysconfigSettings *self = load->self;
+	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
+
+	load->done = TRUE;
+
+	/* Plugins finish in any order but are merged in configured order so
+	 * that earlier plugins keep precedence.
+	 */
+	while (priv->next_load < priv->loads->len) {
+		PluginLoad *next = g_ptr_array_index (priv->loads, priv->next_load);
+
+		if (!next->done)
+			break;
+		merge_plugin (self, next);
+		priv->next_load++;
+	}
+
+	if (priv->next_load == priv->loads->len)
+		plugins_loaded (self);
+
+	/* Each pending load holds a reference */
+	g_object_unref (self);
+	return FALSE;
+}
+
+static void
+load_plugins (BMSysconfigSettings *self, const char *plugins)
+{
+	BMSysconfigSettingsPrivate *priv = BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self);
 	char **plist;
 	char **iter;
-	gboolean success = TRUE;
+	guint i;
 
 	plist = g_strsplit (plugins, ",", 0);
-	if (!plist)
-		return FALSE;
+	priv->loads = g_ptr_array_new ();
 
 	for (iter = plist; *iter; iter++) {
-		GModule *plugin;
-		char *full_name, *path;
 		const char *pname = g_strstrip (*iter);
-		GObject *obj;
-		GObject * (*factory_func) (void);
+		PluginLoad *load;
+		gboolean dup = FALSE;
 
 		/* ifcfg-fedora was renamed ifcfg-rh; handle old configs here */
 		if (!strcmp (pname, "ifcfg-fedora"))
 			pname = "ifcfg-rh";
 
-		obj = find_plugin (list, pname);
-		if (obj)
+		for (i = 0; i < priv->loads->len && !dup; i++)
+			dup = !strcmp (((PluginLoad *) g_ptr_array_index (priv->loads, i))->name, pname);
+		if (dup || !*pname)
 			continue;
 
-		full_name = g_strdup_printf ("bm-settings-plugin-%s", pname);
-		path = g_module_build_path (PLUGINDIR, full_name);
-
-		plugin = g_module_open (path, G_MODULE_BIND_LOCAL);
-		if (!plugin) {
-			g_set_error (error, 0, 0,
-			             "Could not load plugin '%s': %s",
-			             pname, g_module_error ());
-			g_free (full_name);
-			g_free (path);
-			success = FALSE;
-			break;
-		}
-
-		g_free (full_name);
-		g_free (path);
-
-		if (!g_module_symbol (plugin, "bm_system_config_factory", (gpointer) (&factory_func))) {
-			g_set_error (error, 0, 0,
-			             "Could not find plugin '%s' factory function.",
-			             pname);
-			success = FALSE;
-			break;
-		}
-
-		obj = (*factory_func) ();
-		if (!obj || !BM_IS_SYSTEM_CONFIG_INTERFACE (obj)) {
-			g_set_error (error, 0, 0,
-			             "Plugin '%s' returned invalid system config object.",
-			             pname);
-			success = FALSE;
-			break;
-		}
-
-		g_module_make_resident (plugin);
-		g_object_weak_ref (obj, (GWeakNotify) g_module_close, plugin);
-		add_plugin (self, BM_SYSTEM_CONFIG_INTERFACE (obj));
-		list = g_slist_append (list, obj);
+		load = g_slice_new0 (PluginLoad);
+		load->self = self;
+		load->name = g_strdup (pname);
+		g_ptr_array_add (priv->loads, load);
 	}
-
 	g_strfreev (plist);
 
-	g_slist_foreach (list, (GFunc) g_object_unref, NULL);
-	g_slist_free (list);
+	if (!priv->loads->len) {
+		plugins_loaded (self);
+		return;
+	}
 
-	return success;
+	/* Start every load before any can complete, since completions are
+	 * only dispatched from the main loop.
+	 */
+	for (i = 0; i < priv->loads->len; i++) {
+		PluginLoad *load = g_ptr_array_index (priv->loads, i);
+		GError *error = NULL;
+
+		g_object_ref (self);
+		if (!g_thread_create (plugin_load_thread, load, FALSE, &error)) {
+			bm_log_warn (LOGD_SYS_SET, "could not start loader for plugin '%s': %s",
+			             load->name, error->message);
+			g_error_free (error);
+			plugin_load_thread (load);
+		}
+	}
 }
 
 static void
@@ -473,6 +579,8 @@ connection_removed (BMSettingsConnectionInterface *connection,
 	gsize len;
 	GError *error = NULL;
 
+	bm_dbus_manager_unregister_object (priv->dbus_mgr, connection);
+
 	/* Remove connection from the table */
 	g_hash_table_remove (priv->connections, connection);
 
@@ -552,6 +660,9 @@ claim_connection (BMSysconfigSettings *self,
 
 	if (do_export) {
 		bm_settings_service_export_connection (BM_SETTINGS_SERVICE (self), connection);
+		bm_dbus_manager_register_object (priv->dbus_mgr,
+		                                 bm_connection_get_path (BM_CONNECTION (connection)),
+		                                 connection);
 		g_signal_emit_by_name (self, BM_SETTINGS_INTERFACE_NEW_CONNECTION, connection);
 	}
 }
@@ -589,8 +700,6 @@ typedef struct {
 	guint32 permissions_calls;
 } PolkitCall;
 
-#include "bm-dbus-manager.h"
-
 static PolkitCall *
 polkit_call_new (BMSysconfigSettings *self,
                  DBusGMethodInvocation *context,
@@ -1076,14 +1185,13 @@ bm_sysconfig_settings_new (const char *config_file,
 
 	priv->config_file = g_strdup (config_file);
 
-	if (plugins) {
-		/* Load the plugins; fail if a plugin is not found. */
-		if (!load_plugins (self, plugins, error)) {
-			g_object_unref (self);
-			return NULL;
-		}
-		unmanaged_specs_changed (NULL, self);
-	}
+	/* Plugins load in the background; SettingsLoaded turns TRUE once
+	 * all of them have been merged.
+	 */
+	if (plugins)
+		load_plugins (self, plugins);
+	else
+		priv->settings_loaded = TRUE;
 
 	return self;
 }
@@ -1102,6 +1210,12 @@ dispose (GObject *object)
 		priv->auth_changed_id = 0;
 	}
 
+	if (priv->dbus_mgr) {
+		g_signal_handler_disconnect (priv->dbus_mgr, priv->dbus_changed_id);
+		g_object_unref (priv->dbus_mgr);
+		priv->dbus_mgr = NULL;
+	}
+
 	/* Cancel PolicyKit requests */
 	for (iter = priv->pk_calls; iter; iter = g_slist_next (iter)) {
 		PolkitCall *call = iter->data;
@@ -1177,6 +1291,9 @@ get_property (GObject *object, guint prop_id,
 	case BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY:
 		g_value_set_boolean (value, !!get_plugin (self, BM_SYSTEM_CONFIG_INTERFACE_CAP_MODIFY_CONNECTIONS));
 		break;
+	case BM_SETTINGS_SYSTEM_INTERFACE_PROP_SETTINGS_LOADED:
+		g_value_set_boolean (value, BM_SYSCONFIG_SETTINGS_GET_PRIVATE (self)->settings_loaded);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1216,6 +1333,10 @@ bm_sysconfig_settings_class_init (BMSysconfigSettingsClass *class)
 									  BM_SETTINGS_SYSTEM_INTERFACE_PROP_CAN_MODIFY,
 									  BM_SETTINGS_SYSTEM_INTERFACE_CAN_MODIFY);
 
+	g_object_class_override_property (object_class,
+									  BM_SETTINGS_SYSTEM_INTERFACE_PROP_SETTINGS_LOADED,
+									  BM_SETTINGS_SYSTEM_INTERFACE_SETTINGS_LOADED);
+
 	/* signals */
 	signals[PROPERTIES_CHANGED] = 
 	                g_signal_new ("properties-changed",
@@ -1242,6 +1363,21 @@ bm_sysconfig_settings_class_init (BMSysconfigSettingsClass *class)
 	dbus_g_error_domain_register (BM_SETTING_ERROR, NULL, BM_TYPE_SETTING_ERROR);
 }
 
+static void
+dbus_connection_changed_cb (BMDBusManager *mgr,
+                            DBusConnection *connection,
+                            gpointer user_data)
+{
+	/* The dbus manager already exported our objects on the new bus;
+	 * connections added from now on go there too.
+	 */
+	if (connection) {
+		g_object_set (user_data,
+		              BM_SETTINGS_SERVICE_BUS, bm_dbus_manager_get_connection (mgr),
+		              NULL);
+	}
+}
+
 static void
 bm_sysconfig_settings_init (BMSysconfigSettings *self)
 {
@@ -1250,6 +1386,12 @@ bm_sysconfig_settings_init (BMSysconfigSettings *self)
 
 	priv->connections = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
 
+	priv->dbus_mgr = bm_dbus_manager_get ();
+	priv->dbus_changed_id = g_signal_connect (priv->dbus_mgr,
+	                                          "dbus-connection-changed",
+	                                          G_CALLBACK (dbus_connection_changed_cb),
+	                                          self);
+
 	priv->authority = polkit_authority_get_sync (NULL, &error);
 	if (priv->authority) {
 		priv->auth_changed_id = g_signal_connect (priv->authority,
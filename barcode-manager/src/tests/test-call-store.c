@@ -0,0 +1,248 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+
+#include <glib.h>
+#include <glib-object.h>
+#include <string.h>
+
+#include "bm-call-store.h"
+#include "bm-test-helpers.h"
+
+#if GLIB_CHECK_VERSION(2,25,12)
+typedef GTestFixtureFunc TCFunc;
+#else
+typedef void (*TCFunc)(void);
+#endif
+
+#define TESTCASE(t, d) g_test_create_case (#t, 0, d, NULL, (TCFunc) t, NULL)
+
+/* Call ids are only compared, so any distinct non-NULL pointer will do */
+#define CALL(i) ((gpointer *) GUINT_TO_POINTER ((i) + 1))
+#define CALL_INDEX(c) (GPOINTER_TO_UINT (c) - 1)
+
+static GObject **
+objects_new (guint count)
+{
+	GObject **objects;
+	guint i;
+
+	objects = g_new0 (GObject *, count);
+	for (i = 0; i < count; i++)
+		objects[i] = g_object_new (G_TYPE_OBJECT, NULL);
+	return objects;
+}
+
+static void
+objects_free (GObject **objects, guint count)
+{
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		if (objects[i])
+			g_object_unref (objects[i]);
+	}
+	g_free (objects);
+}
+
+static gboolean
+count_cb (GObject *object, gpointer call_id, gpointer user_data)
+{
+	return TRUE;
+}
+
+static void
+test_add_remove (void)
+{
+	NMCallStore *store;
+	GObject **objects;
+	NMCallHandle handle, stale;
+	guint i;
+
+	objects = objects_new (3);
+	store = bm_call_store_new ();
+
+	for (i = 0; i < 30; i++)
+		bm_call_store_add (store, objects[i % 3], CALL (i));
+	ASSERT (bm_call_store_get_size (store) == 30,
+	        "add-remove", "unexpected size %u", bm_call_store_get_size (store));
+	ASSERT (bm_call_store_foreach (store, objects[1], count_cb, NULL) == 10,
+	        "add-remove", "wrong number of calls for object");
+
+	/* Adding the same call again changes nothing */
+	stale = bm_call_store_add (store, objects[0], CALL (0));
+	ASSERT (bm_call_store_get_size (store) == 30,
+	        "add-remove", "duplicate call added");
+
+	bm_call_store_remove (store, objects[0], CALL (0));
+	ASSERT (bm_call_store_remove_handle (store, stale) == FALSE,
+	        "add-remove", "removed call still reachable by handle");
+
+	/* The freed slot is reused, but the old handle stays stale */
+	handle = bm_call_store_add (store, objects[0], CALL (100));
+	ASSERT (handle != stale, "add-remove", "handle reused");
+	ASSERT (bm_call_store_remove_handle (store, stale) == FALSE,
+	        "add-remove", "stale handle removed a newer call");
+	ASSERT (bm_call_store_remove_handle (store, handle) == TRUE,
+	        "add-remove", "handle not removed");
+
+	ASSERT (bm_call_store_cancel (store, objects[2], count_cb, NULL) == 10,
+	        "add-remove", "wrong number of calls cancelled");
+	ASSERT (bm_call_store_get_size (store) == 19,
+	        "add-remove", "unexpected size %u", bm_call_store_get_size (store));
+	ASSERT (bm_call_store_cancel (store, objects[2], count_cb, NULL) == 0,
+	        "add-remove", "cancelled calls still present");
+
+	/* Calls go away with their object */
+	g_object_unref (objects[1]);
+	objects[1] = NULL;
+	ASSERT (bm_call_store_get_size (store) == 9,
+	        "add-remove", "calls of a destroyed object kept");
+
+	bm_call_store_clear (store);
+	ASSERT (bm_call_store_get_size (store) == 0,
+	        "add-remove", "store not empty after clear");
+
+	bm_call_store_destroy (store);
+	objects_free (objects, 3);
+}
+
+typedef struct {
+	NMCallStore *store;
+	guint visited;
+} ModifyInfo;
+
+/* Removes the visited call and the one after it, and adds a new one */
+static gboolean
+modify_cb (GObject *object, gpointer call_id, gpointer user_data)
+{
+	ModifyInfo *info = user_data;
+	guint i = CALL_INDEX (call_id);
+
+	ASSERT (i < 1000, "modify", "call %u added during iteration was visited", i);
+
+	info->visited++;
+	bm_call_store_remove (info->store, object, call_id);
+	if (i + 1 < 10)
+		bm_call_store_remove (info->store, object, CALL (i + 1));
+	bm_call_store_add (info->store, object, CALL (1000 + i));
+	return TRUE;
+}
+
+static void
+test_modify_while_iterating (void)
+{
+	NMCallStore *store;
+	GObject **objects;
+	ModifyInfo info;
+	int count;
+	guint i;
+
+	objects = objects_new (1);
+	store = bm_call_store_new ();
+	for (i = 0; i < 10; i++)
+		bm_call_store_add (store, objects[0], CALL (i));
+
+	info.store = store;
+	info.visited = 0;
+	count = bm_call_store_foreach (store, objects[0], modify_cb, &info);
+
+	ASSERT (count == 5 && info.visited == 5,
+	        "modify", "visited %u calls, expected 5", info.visited);
+	ASSERT (bm_call_store_get_size (store) == 5,
+	        "modify", "unexpected size %u", bm_call_store_get_size (store));
+
+	bm_call_store_destroy (store);
+	objects_free (objects, 1);
+}
+
+/* A device resync: 'count' calls in flight over count / 100 objects, the
+ * calls of every other object cancelled in bulk and the rest completed one
+ * by one through their handles.  Afterwards a second round must fit in the
+ * slots the first one freed.
+ */
+static void
+resync (guint count)
+{
+	NMCallStore *store;
+	NMCallHandle *handles;
+	GObject **objects;
+	guint n_objects = count / 100;
+	guint i, cancelled = 0, completed = 0;
+
+	objects = objects_new (n_objects);
+	handles = g_new (NMCallHandle, count);
+	store = bm_call_store_new ();
+
+	for (i = 0; i < count; i++)
+		handles[i] = bm_call_store_add (store, objects[i % n_objects], CALL (i));
+	for (i = 0; i < n_objects; i += 2)
+		cancelled += bm_call_store_cancel (store, objects[i], count_cb, NULL);
+	for (i = 0; i < count; i++) {
+		if ((i % n_objects) & 1)
+			completed += bm_call_store_remove_handle (store, handles[i]);
+	}
+
+	ASSERT (cancelled == count / 2,
+	        "resync", "cancelled %u calls, expected %u", cancelled, count / 2);
+	ASSERT (completed == count / 2,
+	        "resync", "completed %u calls, expected %u", completed, count / 2);
+	ASSERT (bm_call_store_get_size (store) == 0,
+	        "resync", "store not empty");
+
+	/* Slots are the low half of a handle */
+	for (i = 0; i < count; i++) {
+		NMCallHandle handle;
+
+		handle = bm_call_store_add (store, objects[i % n_objects], CALL (i));
+		ASSERT ((handle & G_MAXUINT32) < count,
+		        "resync", "slot %u beyond %u calls", (guint) (handle & G_MAXUINT32), count);
+	}
+	ASSERT (bm_call_store_get_size (store) == count,
+	        "resync", "unexpected size %u", bm_call_store_get_size (store));
+
+	bm_call_store_destroy (store);
+	g_free (handles);
+	objects_free (objects, n_objects);
+}
+
+static void
+test_resync (void)
+{
+	/* Small, and large enough to grow the slot array many times */
+	resync (1000);
+	resync (50000);
+}
+
+int main (int argc, char **argv)
+{
+	GTestSuite *suite;
+
+	g_type_init ();
+	g_test_init (&argc, &argv, NULL);
+
+	suite = g_test_get_root ();
+
+	g_test_suite_add (suite, TESTCASE (test_add_remove, NULL));
+	g_test_suite_add (suite, TESTCASE (test_modify_while_iterating, NULL));
+	g_test_suite_add (suite, TESTCASE (test_resync, NULL));
+
+	return g_test_run ();
+}
@@ -0,0 +1,255 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* BarcodeManager - barcode scanner manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright (C) 2011 Jakob Flierl
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "bm-device-registry.h"
+#include "bm-test-helpers.h"
+
+#if GLIB_CHECK_VERSION(2,25,12)
+typedef GTestFixtureFunc TCFunc;
+#else
+typedef void (*TCFunc)(void);
+#endif
+
+#define TESTCASE(t, d) g_test_create_case (#t, 0, d, NULL, (TCFunc) t, NULL)
+
+/* Virtual devices are just distinct non-NULL pointers */
+#define DEVICE(i) GUINT_TO_POINTER ((i) + 1)
+
+typedef struct {
+	guint count;
+	char **ifaces;
+	char **udis;
+	char **paths;
+} Devices;
+
+static Devices *
+devices_new (guint count)
+{
+	Devices *devices;
+	guint i;
+
+	devices = g_new0 (Devices, 1);
+	devices->count = count;
+	devices->ifaces = g_new0 (char *, count + 1);
+	devices->udis = g_new0 (char *, count + 1);
+	devices->paths = g_new0 (char *, count + 1);
+
+	for (i = 0; i < count; i++) {
+		devices->ifaces[i] = g_strdup_printf ("hidraw%u", i);
+		devices->udis[i] = g_strdup_printf ("/sys/devices/virtual/hidraw/hidraw%u", i);
+		devices->paths[i] = g_strdup_printf ("/org/freedesktop/BarcodeManager/Devices/%u", i);
+	}
+	return devices;
+}
+
+static void
+devices_free (Devices *devices)
+{
+	g_strfreev (devices->ifaces);
+	g_strfreev (devices->udis);
+	g_strfreev (devices->paths);
+	g_free (devices);
+}
+
+static void
+add_all (BMDeviceRegistry *registry, Devices *devices)
+{
+	guint i;
+
+	for (i = 0; i < devices->count; i++) {
+		bm_device_registry_add (registry, DEVICE (i),
+		                        devices->ifaces[i],
+		                        devices->udis[i],
+		                        devices->paths[i]);
+	}
+}
+
+static void
+test_lookup (void)
+{
+	BMDeviceRegistry *registry;
+	Devices *devices;
+	guint i;
+
+	devices = devices_new (16);
+	registry = bm_device_registry_new ();
+	add_all (registry, devices);
+
+	ASSERT (bm_device_registry_get_size (registry) == 16,
+	        "lookup", "unexpected size %u", bm_device_registry_get_size (registry));
+
+	for (i = 0; i < devices->count; i++) {
+		ASSERT (bm_device_registry_lookup_iface (registry, devices->ifaces[i]) == DEVICE (i),
+		        "lookup", "iface %s not found", devices->ifaces[i]);
+		ASSERT (bm_device_registry_lookup_udi (registry, devices->udis[i]) == DEVICE (i),
+		        "lookup", "udi %s not found", devices->udis[i]);
+		ASSERT (bm_device_registry_lookup_path (registry, devices->paths[i]) == DEVICE (i),
+		        "lookup", "path %s not found", devices->paths[i]);
+	}
+
+	ASSERT (bm_device_registry_lookup_iface (registry, "hidraw999") == NULL,
+	        "lookup", "unknown iface found");
+	ASSERT (bm_device_registry_lookup_path (registry, NULL) == NULL,
+	        "lookup", "NULL path found");
+
+	/* Neither the device nor any of its keys may be registered twice */
+	ASSERT (bm_device_registry_add (registry, DEVICE (0), "other", NULL, NULL) == FALSE,
+	        "lookup", "device added twice");
+	ASSERT (bm_device_registry_add (registry, DEVICE (100), devices->ifaces[3], NULL, NULL) == FALSE,
+	        "lookup", "duplicate iface accepted");
+	ASSERT (bm_device_registry_add (registry, DEVICE (100), NULL, NULL, devices->paths[5]) == FALSE,
+	        "lookup", "duplicate path accepted");
+
+	bm_device_registry_free (registry);
+	devices_free (devices);
+}
+
+static void
+test_remove_keeps_order (void)
+{
+	BMDeviceRegistry *registry;
+	const GPtrArray *array;
+	Devices *devices;
+	guint i, expected;
+
+	devices = devices_new (10);
+	registry = bm_device_registry_new ();
+	add_all (registry, devices);
+
+	/* Remove the even devices, including the first and the last */
+	for (i = 0; i < devices->count; i += 2)
+		ASSERT (bm_device_registry_remove (registry, DEVICE (i)),
+		        "remove", "device %u not removed", i);
+	ASSERT (bm_device_registry_remove (registry, DEVICE (0)) == FALSE,
+	        "remove", "device removed twice");
+	ASSERT (bm_device_registry_lookup_udi (registry, devices->udis[4]) == NULL,
+	        "remove", "removed device still indexed");
+
+	array = bm_device_registry_get_devices (registry);
+	ASSERT (array->len == 5, "remove", "unexpected length %u", array->len);
+	for (i = 0, expected = 1; i < array->len; i++, expected += 2) {
+		ASSERT (g_ptr_array_index (array, i) == DEVICE (expected),
+		        "remove", "device %u out of order", i);
+	}
+
+	/* A removed interface name can be reused */
+	ASSERT (bm_device_registry_add (registry, DEVICE (100), devices->ifaces[2], NULL, NULL),
+	        "remove", "freed iface not reusable");
+	array = bm_device_registry_get_devices (registry);
+	ASSERT (g_ptr_array_index (array, array->len - 1) == DEVICE (100),
+	        "remove", "new device not appended");
+
+	bm_device_registry_free (registry);
+	devices_free (devices);
+}
+
+/* A hotplug storm: add every device, look each up by every key, then
+ * remove them in an interleaved order, iterating halfway.  Returns the
+ * nanoseconds per operation.
+ */
+static double
+storm (Devices *devices)
+{
+	BMDeviceRegistry *registry;
+	const GPtrArray *array;
+	GTimer *timer;
+	double elapsed;
+	guint i, ops, added = 0, found = 0, removed = 0, remaining;
+
+	timer = g_timer_new ();
+	registry = bm_device_registry_new ();
+
+	for (i = 0; i < devices->count; i++) {
+		added += bm_device_registry_add (registry, DEVICE (i),
+		                                 devices->ifaces[i],
+		                                 devices->udis[i],
+		                                 devices->paths[i]);
+	}
+	for (i = 0; i < devices->count; i++) {
+		found += bm_device_registry_lookup_iface (registry, devices->ifaces[i]) == DEVICE (i);
+		found += bm_device_registry_lookup_udi (registry, devices->udis[i]) == DEVICE (i);
+		found += bm_device_registry_lookup_path (registry, devices->paths[i]) == DEVICE (i);
+	}
+	for (i = 0; i < devices->count; i += 2)
+		removed += bm_device_registry_remove (registry, DEVICE (i));
+	array = bm_device_registry_get_devices (registry);
+	remaining = array->len;
+	for (i = 1; i < devices->count; i += 2)
+		removed += bm_device_registry_remove (registry, DEVICE (i));
+
+	elapsed = g_timer_elapsed (timer, NULL);
+	ops = devices->count * 5;
+
+	ASSERT (added == devices->count,
+	        "storm", "added %u devices, expected %u", added, devices->count);
+	ASSERT (found == devices->count * 3,
+	        "storm", "%u lookups succeeded, expected %u", found, devices->count * 3);
+	ASSERT (remaining == devices->count / 2,
+	        "storm", "%u devices halfway, expected %u", remaining, devices->count / 2);
+	ASSERT (removed == devices->count,
+	        "storm", "removed %u devices, expected %u", removed, devices->count);
+	ASSERT (bm_device_registry_get_size (registry) == 0,
+	        "storm", "registry not empty");
+	ASSERT (bm_device_registry_get_devices (registry)->len == 0,
+	        "storm", "device array not empty");
+
+	bm_device_registry_free (registry);
+	g_timer_destroy (timer);
+
+	return elapsed * 1e9 / ops;
+}
+
+static void
+test_storm (void)
+{
+	Devices *devices;
+	guint count;
+	double cost;
+
+	for (count = 1000; count <= 8000; count *= 2) {
+		devices = devices_new (count);
+		cost = storm (devices);
+		devices_free (devices);
+
+		/* Per-device cost should stay flat as the registry grows; with
+		 * -m perf the figures are printed to compare by hand.
+		 */
+		if (g_test_perf ())
+			g_test_message ("%u devices: %.0f ns/op", count, cost);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	GTestSuite *suite;
+
+	g_test_init (&argc, &argv, NULL);
+
+	suite = g_test_get_root ();
+
+	g_test_suite_add (suite, TESTCASE (test_lookup, NULL));
+	g_test_suite_add (suite, TESTCASE (test_remove_keeps_order, NULL));
+	g_test_suite_add (suite, TESTCASE (test_storm, NULL));
+
+	return g_test_run ();
+}
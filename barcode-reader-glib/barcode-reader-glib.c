@@ -1,58 +1,463 @@
 #include <stdio.h>
+#include <string.h>
 #include <dbus/dbus.h>
 
 #include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
 #include <glib.h>
- 
+
+#define SERVICE_NAME      "me.koppi.BarcodeReader"
+#define SERVICE_INTERFACE "me.koppi.BarcodeReader"
+#define SERVICE_PATH      "/me/koppi/BarcodeReader"
+
+/* How long to wait for the Ready signal of a service we activated before
+ * asking it directly. Older services never send Ready. */
+#define READY_TIMEOUT_MS 5000
+
+typedef enum {
+  TRANSPORT_STRING, /* read(s, u), payloads that are valid UTF-8 only */
+  TRANSPORT_BYTES   /* ReadBytes(ay, u, b, s), every payload */
+} Transport;
+
+typedef struct {
+  guint32 seq;
+  Transport transport;
+  int length;
+  char *data;
+  char *text;  /* decoded payload, NULL if the service couldn't decode it */
+} Scan;
+
+typedef struct {
+  DBusConnection *connection;
+  GMainLoop *loop;
+
+  gboolean activated;     /* the service was started on our behalf */
+  gboolean ready;
+  guint ready_timeout_id;
+  Transport transport;
+
+  /* Live scans are held back while the journal is fetched, so that
+   * scans are printed once and in order. */
+  gboolean buffering;
+  GQueue *pending;
+  guint32 last_seq;
+} Reader;
+
+/* Prints the decoded text if there is one, otherwise the payload bytes
+ * with anything but printable ASCII escaped. */
+static void print_scan(Reader *reader, guint32 seq, const char *data,
+                       int length, const char *text) {
+  int i;
+
+  /* seq 0 comes from services without a journal, never drop those */
+  if (seq != 0) {
+    if (seq <= reader->last_seq)
+      return;
+    reader->last_seq = seq;
+  }
+
+  if (text) {
+    printf ("read '%s'\n", text);
+  } else {
+    printf ("read '");
+    for (i = 0; i < length; i++) {
+      unsigned char c = data[i];
+
+      if (c >= 0x20 && c < 0x7f && c != '\\')
+        putchar (c);
+      else
+        printf ("\\x%02x", c);
+    }
+    printf ("'\n");
+  }
+  fflush (stdout);
+}
+
+static void queue_scan(Reader *reader, Transport transport, guint32 seq,
+                       const char *data, int length, const char *text) {
+  Scan *scan = g_slice_new (Scan);
+
+  scan->seq = seq;
+  scan->transport = transport;
+  scan->length = length;
+  scan->data = g_memdup (data, length);
+  scan->text = g_strdup (text);
+  g_queue_push_tail (reader->pending, scan);
+}
+
+static void handle_scan(Reader *reader, Transport transport, guint32 seq,
+                        const char *data, int length, const char *text) {
+  if (reader->buffering)
+    queue_scan (reader, transport, seq, data, length, text);
+  else if (transport == reader->transport)
+    print_scan (reader, seq, data, length, text);
+}
+
+static void flush_pending(Reader *reader) {
+  Scan *scan;
+
+  reader->buffering = FALSE;
+
+  /* Both flavours of every scan were queued before the transport was
+   * known; only the negotiated one is printed. */
+  while ((scan = g_queue_pop_head (reader->pending))) {
+    if (scan->transport == reader->transport)
+      print_scan (reader, scan->seq, scan->data, scan->length, scan->text);
+    g_free (scan->data);
+    g_free (scan->text);
+    g_slice_free (Scan, scan);
+  }
+}
+
+/* A new instance of the service numbers its scans from 1 again and has
+ * to be negotiated with afresh. Scans still held back came from the old
+ * instance and are dropped, they would be out of order with the new one. */
+static void service_reset(Reader *reader) {
+  Scan *scan;
+
+  reader->ready = FALSE;
+  reader->buffering = TRUE;
+  reader->last_seq = 0;
+
+  if (reader->ready_timeout_id) {
+    g_source_remove (reader->ready_timeout_id);
+    reader->ready_timeout_id = 0;
+  }
+
+  while ((scan = g_queue_pop_head (reader->pending))) {
+    g_free (scan->data);
+    g_free (scan->text);
+    g_slice_free (Scan, scan);
+  }
+}
+
+static void get_scans_cb(DBusPendingCall *pending, void *user_data) {
+  Reader *reader = user_data;
+  DBusMessage *reply;
+  DBusMessageIter iter, array, entry;
+
+  reply = dbus_pending_call_steal_reply (pending);
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR) {
+    fprintf (stderr, "failed to fetch journaled scans: %s\n",
+             dbus_message_get_error_name (reply));
+  } else if (dbus_message_iter_init (reply, &iter) &&
+             dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY) {
+    dbus_message_iter_recurse (&iter, &array);
+
+    while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT) {
+      dbus_uint32_t seq;
+      const char *code;
+      int length;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &seq);
+      dbus_message_iter_next (&entry);
+
+      if (reader->transport == TRANSPORT_BYTES) {
+        DBusMessageIter payload;
+        const char *data, *text;
+        dbus_bool_t valid;
+
+        /* (u ay b s), the fields of ReadBytes */
+        dbus_message_iter_recurse (&entry, &payload);
+        dbus_message_iter_get_fixed_array (&payload, &data, &length);
+        dbus_message_iter_next (&entry);
+        dbus_message_iter_get_basic (&entry, &valid);
+        dbus_message_iter_next (&entry);
+        dbus_message_iter_get_basic (&entry, &text);
+        print_scan (reader, seq, data, length, valid ? text : NULL);
+      } else {
+        dbus_message_iter_get_basic (&entry, &code);
+        print_scan (reader, seq, code, strlen (code), code);
+      }
+
+      dbus_message_iter_next (&array);
+    }
+  }
+
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+
+  flush_pending (reader);
+}
+
+static void fetch_journal(Reader *reader) {
+  DBusMessage *message;
+  DBusPendingCall *pending = NULL;
+  dbus_uint32_t since = 0;
+
+  message = dbus_message_new_method_call (SERVICE_NAME, SERVICE_PATH,
+                                          SERVICE_INTERFACE,
+                                          reader->transport == TRANSPORT_BYTES ?
+                                          "GetScansBytes" : "GetScans");
+  dbus_message_append_args (message, DBUS_TYPE_UINT32, &since,
+                            DBUS_TYPE_INVALID);
+
+  if (dbus_connection_send_with_reply (reader->connection, message,
+                                       &pending, -1) && pending)
+    dbus_pending_call_set_notify (pending, get_scans_cb, reader, NULL);
+  else
+    flush_pending (reader);
+
+  dbus_message_unref (message);
+}
+
+static gboolean has_capability(char **caps, int n_caps, const char *cap) {
+  int i;
+
+  for (i = 0; i < n_caps; i++)
+    if (strcmp (caps[i], cap) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static void service_ready(Reader *reader, char **caps, int n_caps) {
+  if (reader->ready)
+    return;
+
+  reader->ready = TRUE;
+
+  if (reader->ready_timeout_id) {
+    g_source_remove (reader->ready_timeout_id);
+    reader->ready_timeout_id = 0;
+  }
+
+  /* Prefer exact bytes; fall back to strings for older services. */
+  if (has_capability (caps, n_caps, "read-bytes"))
+    reader->transport = TRANSPORT_BYTES;
+  else if (has_capability (caps, n_caps, "read"))
+    reader->transport = TRANSPORT_STRING;
+  else
+    fprintf (stderr, "%s does not advertise a known transport\n",
+             SERVICE_NAME);
+
+  printf ("Connected to the %s service\n", SERVICE_NAME);
+
+  /* A service we started may have read scans before our match rule took
+   * effect; a running one has nothing we could have missed. */
+  if (reader->activated && has_capability (caps, n_caps, "journal"))
+    fetch_journal (reader);
+  else
+    flush_pending (reader);
+}
+
+static void get_capabilities_cb(DBusPendingCall *pending, void *user_data) {
+  Reader *reader = user_data;
+  DBusMessage *reply;
+  char **caps = NULL;
+  int n_caps = 0;
+  dbus_uint32_t seq;
+
+  reply = dbus_pending_call_steal_reply (pending);
+
+  if (!dbus_message_get_args (reply, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &caps, &n_caps,
+                              DBUS_TYPE_UINT32, &seq,
+                              DBUS_TYPE_INVALID)) {
+    /* A service predating the readiness protocol only speaks "read". */
+    static char *legacy[] = { "read" };
+
+    service_ready (reader, legacy, 1);
+  } else {
+    service_ready (reader, caps, n_caps);
+    dbus_free_string_array (caps);
+  }
+
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+}
+
+static void query_capabilities(Reader *reader) {
+  DBusMessage *message;
+  DBusPendingCall *pending = NULL;
+
+  message = dbus_message_new_method_call (SERVICE_NAME, SERVICE_PATH,
+                                          SERVICE_INTERFACE, "GetCapabilities");
+
+  if (dbus_connection_send_with_reply (reader->connection, message,
+                                       &pending, -1) && pending) {
+    dbus_pending_call_set_notify (pending, get_capabilities_cb, reader, NULL);
+  } else {
+    static char *legacy[] = { "read" };
+
+    service_ready (reader, legacy, 1);
+  }
+
+  dbus_message_unref (message);
+}
+
+static gboolean ready_timeout(gpointer user_data) {
+  Reader *reader = user_data;
+
+  reader->ready_timeout_id = 0;
+  query_capabilities (reader);
+
+  return FALSE;
+}
+
+static void start_service_cb(DBusPendingCall *pending, void *user_data) {
+  Reader *reader = user_data;
+  DBusMessage *reply;
+  DBusError error;
+  dbus_uint32_t result;
+
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_error_init (&error);
+
+  if (dbus_set_error_from_message (&error, reply) ||
+      !dbus_message_get_args (reply, &error, DBUS_TYPE_UINT32, &result,
+                              DBUS_TYPE_INVALID)) {
+    printf ("Failed to activate the %s service: %s\n", SERVICE_NAME,
+            error.message);
+    dbus_error_free (&error);
+    g_main_loop_quit (reader->loop);
+  } else if (reader->ready) {
+    /* Ready overtook the reply, nothing left to do. */
+  } else if (result == DBUS_START_REPLY_SUCCESS) {
+    /* Wait for Ready, but don't rely on it. */
+    reader->activated = TRUE;
+    if (!reader->ready_timeout_id)
+      reader->ready_timeout_id = g_timeout_add (READY_TIMEOUT_MS,
+                                                ready_timeout, reader);
+  } else {
+    query_capabilities (reader);
+  }
+
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+}
+
 static DBusHandlerResult dbus_filter (DBusConnection *connection, DBusMessage *message, void *user_data) {
+  Reader *reader = user_data;
   char *code;
- 
-  if ( dbus_message_is_signal (message, "me.koppi.BarcodeReader","read" ) ) {
-    printf ("read '");
+  dbus_uint32_t seq = 0;
 
+  if ( dbus_message_is_signal (message, SERVICE_INTERFACE, "read" ) ) {
     DBusError error;
 
     dbus_error_init (&error);
 
-    if (!dbus_message_get_args (message, &error, DBUS_TYPE_STRING, &code, DBUS_TYPE_INVALID)) {
-      fprintf (stderr, "failed to get StatusChanged arguments: %s (%s)", error.message, error.name);
+    if (!dbus_message_get_args (message, NULL, DBUS_TYPE_STRING, &code,
+                                DBUS_TYPE_UINT32, &seq, DBUS_TYPE_INVALID) &&
+        !dbus_message_get_args (message, &error, DBUS_TYPE_STRING, &code,
+                                DBUS_TYPE_INVALID)) {
+      fprintf (stderr, "failed to get read arguments: %s (%s)", error.message, error.name);
       dbus_error_free (&error);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
     }
 
-    printf ("%s'\n", code);
+    handle_scan (reader, TRANSPORT_STRING, seq, code, strlen (code), code);
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if ( dbus_message_is_signal (message, SERVICE_INTERFACE, "ReadBytes" ) ) {
+    const char *data;
+    int length;
+    dbus_bool_t valid;
+
+    if (dbus_message_get_args (message, NULL,
+                               DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, &length,
+                               DBUS_TYPE_UINT32, &seq,
+                               DBUS_TYPE_BOOLEAN, &valid,
+                               DBUS_TYPE_STRING, &code,
+                               DBUS_TYPE_INVALID))
+      handle_scan (reader, TRANSPORT_BYTES, seq, data, length,
+                   valid ? code : NULL);
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if ( dbus_message_is_signal (message, SERVICE_INTERFACE, "Ready" ) ) {
+    char **caps = NULL;
+    int n_caps = 0;
+
+    if (dbus_message_get_args (message, NULL,
+                               DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &caps, &n_caps,
+                               DBUS_TYPE_UINT32, &seq,
+                               DBUS_TYPE_INVALID)) {
+      /* Ready is only sent by a service that just came up; if we were
+       * ready already, it is a new instance. */
+      if (reader->ready)
+        service_reset (reader);
+      reader->activated = TRUE;
+      service_ready (reader, caps, n_caps);
+      dbus_free_string_array (caps);
+    }
 
     return DBUS_HANDLER_RESULT_HANDLED;
   }
- 
+
+  if ( dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "NameOwnerChanged" ) ) {
+    const char *name, *old_owner, *new_owner;
+
+    if (dbus_message_get_args (message, NULL,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &old_owner,
+                               DBUS_TYPE_STRING, &new_owner,
+                               DBUS_TYPE_INVALID) &&
+        strcmp (name, SERVICE_NAME) == 0) {
+      /* The service went away or was replaced */
+      if (*old_owner)
+        service_reset (reader);
+
+      /* A new instance announces itself with Ready; older services
+       * don't, so don't rely on it. */
+      if (*new_owner && !reader->ready && !reader->ready_timeout_id) {
+        reader->activated = TRUE;
+        reader->ready_timeout_id = g_timeout_add (READY_TIMEOUT_MS,
+                                                  ready_timeout, reader);
+      }
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
 int main() {
 
-  DBusConnection *connection;
   DBusError error;
   DBusMessage *message;
- 
-  const char *service_name = "me.koppi.BarcodeReader";
+  DBusPendingCall *pending = NULL;
 
-  dbus_uint32_t flag;
-  dbus_bool_t result;
+  const char *service_name = SERVICE_NAME;
 
-  GMainLoop *loop;
-  loop = g_main_loop_new(NULL,FALSE);
+  dbus_uint32_t flag = 0;
+  Reader reader;
+
+  memset (&reader, 0, sizeof (reader));
+  reader.loop = g_main_loop_new(NULL,FALSE);
+  reader.pending = g_queue_new ();
+  reader.buffering = TRUE;
 
   dbus_error_init (&error);
- 
-  connection = dbus_bus_get (DBUS_BUS_SESSION, &error);
- 
+
+  reader.connection = dbus_bus_get (DBUS_BUS_SESSION, &error);
+
   if ( dbus_error_is_set (&error) ) {
     printf ("Error getting dbus connection: %s\n", error.message);
     dbus_error_free (&error);
-    dbus_connection_unref(connection);
 
     return 0;
   }
- 
+
+  /* Subscribe before activating, so nothing the service sends once it is
+   * up can be missed. */
+  dbus_bus_add_match (reader.connection, "type=\'signal\',interface=\'" SERVICE_INTERFACE "\'", NULL);
+  /* to notice restarts of the service */
+  dbus_bus_add_match (reader.connection,
+                      "type=\'signal\',sender=\'" DBUS_SERVICE_DBUS "\',"
+                      "interface=\'" DBUS_INTERFACE_DBUS "\',member=\'NameOwnerChanged\',"
+                      "arg0=\'" SERVICE_NAME "\'", NULL);
+  dbus_connection_add_filter (reader.connection, dbus_filter, &reader, NULL);
+
+  dbus_connection_setup_with_g_main (reader.connection, NULL);
+
   message = dbus_message_new_method_call ("org.freedesktop.DBus",
 					  "/org/freedesktop/DBus",
 					  "org.freedesktop.DBus",
@@ -60,14 +465,11 @@ int main() {
 
   if (!message) {
     printf ("Error creating DBus message\n");
-    dbus_connection_unref (connection);
+    dbus_connection_unref (reader.connection);
 
     return 0;
   }
 
-  /* We don't want to receive a reply */
-  dbus_message_set_no_reply (message, TRUE);
- 
   /* Append the argument to the message, must ends with DBUS_TYPE_INVALID*/
   dbus_message_append_args (message,
 			    DBUS_TYPE_STRING,
@@ -75,23 +477,22 @@ int main() {
 			    DBUS_TYPE_UINT32,
 			    &flag,
 			    DBUS_TYPE_INVALID);
-  result = dbus_connection_send (connection, message, NULL);
- 
-  if (result) {
-    printf ("Connected to the %s service\n", service_name);
-  } else {
+
+  /* The reply tells whether we started the service or it was running;
+   * it arrives on the main loop, the startup path doesn't wait for it. */
+  if (!dbus_connection_send_with_reply (reader.connection, message, &pending, -1) || !pending) {
     printf ("Failed to activate the %s service\n", service_name);
+    dbus_message_unref (message);
+    dbus_connection_unref (reader.connection);
+
+    return 0;
   }
+  dbus_pending_call_set_notify (pending, start_service_cb, &reader, NULL);
 
-  dbus_bus_add_match (connection, "type=\'signal\',interface=\'me.koppi.BarcodeReader\'", NULL);
-  dbus_connection_add_filter (connection, dbus_filter, loop, NULL);
- 
-  dbus_connection_setup_with_g_main (connection, NULL);
- 
-  g_main_loop_run (loop);
+  g_main_loop_run (reader.loop);
 
   dbus_message_unref(message);
-  dbus_connection_unref(connection);
+  dbus_connection_unref(reader.connection);
 
   return 0;
 }